@@ -1,5 +1,12 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 
 // Helps in making REPL
 #include <editline/readline.h>
@@ -7,6 +14,9 @@
 // Including MPC lib
 #include "mpc.h"
 
+// Reader generated from lisp.grammar by mpcgen, see the makefile
+#include "lisp_parse.h"
+
 typedef struct lval {
     int type;
     long number;
@@ -25,17 +35,57 @@ enum {
     LVAL_SEXPR
 };
 
+// Output buffer. Bytes are collected in memory and flushed in blocks of
+// OBUF_BLOCK to a file descriptor or FILE*. With neither set the buffer
+// just grows, so callers can print into a string.
+typedef struct obuf {
+    char *data;
+    size_t len;
+    size_t cap;
+
+    int fd;
+    FILE *file;
+} obuf;
+
+enum {
+    OBUF_BLOCK = 1 << 16
+};
+
+// Ids of the grammar's tags in one parsed tree, looked up once per tree
+// so reading compares integers rather than searching tag strings. text is
+// the input the tree was parsed from, which node states point into.
+typedef struct ltags {
+    mpc_tree_t *tree;
+    const char *text;
+    int number;
+    int symbol;
+    int sexpr;
+    int regex;
+    int root;
+} ltags;
+
+void obuf_init_fd(obuf *b, int fd);
+void obuf_init_file(obuf *b, FILE *f);
+void obuf_init_mem(obuf *b);
+void obuf_free(obuf *b);
+void obuf_flush(obuf *b);
+char *obuf_str(obuf *b);
+void obuf_write(obuf *b, const char *s, size_t n);
+void obuf_putc(obuf *b, char c);
+void obuf_puts(obuf *b, const char *s);
+void obuf_long(obuf *b, long x);
+
 lval *lval_num(long x);
 lval *lval_err(char* s);
 lval *lval_sym(char* s);
 lval *lval_sexpr(void);
 void lval_del(lval* v);
 lval *lval_add(lval* v, lval* x);
-lval *lval_read_num(mpc_ast_t* t);
-lval *lval_read(mpc_ast_t* t);
-void lval_print_expr(lval* v, char open, char close);
-void lval_println(lval* v);
-void lval_print(lval* v);
+lval *lval_read_num(ltags *t, mpc_node_t *n);
+lval *lval_read(ltags* t, int n);
+void lval_print_expr(obuf* out, lval* v, char open, char close);
+void lval_println(obuf* out, lval* v);
+void lval_print(obuf* out, lval* v);
 lval *lval_eval_sexpr(lval* v);
 lval *lval_eval(lval* v);
 lval *lval_pop(lval* v, int i);
@@ -114,97 +164,361 @@ lval *lval_add(lval *v, lval *x)
     return v;
 }
 
-lval *lval_read_num(mpc_ast_t *t)
+// Loads eight bytes with s[0] in the lowest byte regardless of host
+// byte order. Compilers turn this into a single load on little-endian.
+static uint64_t lval_load8(const char *s)
+{
+    const unsigned char *u = (const unsigned char *)s;
+
+    return  (uint64_t)u[0]        | ((uint64_t)u[1] << 8)  |
+           ((uint64_t)u[2] << 16) | ((uint64_t)u[3] << 24) |
+           ((uint64_t)u[4] << 32) | ((uint64_t)u[5] << 40) |
+           ((uint64_t)u[6] << 48) | ((uint64_t)u[7] << 56);
+}
+
+static int lval_swar_is_digits8(uint64_t w)
+{
+    return ((w & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((w + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))
+           == 0x3333333333333333ULL;
+}
+
+// Converts eight ASCII digits to their value with three multiplies,
+// combining neighbouring digits, then pairs, then quads.
+static uint32_t lval_swar_parse8(uint64_t w)
 {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
+    w = ((w & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+    w = ((w & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
 
-    return errno != ERANGE ? lval_num(x)  : lval_err("Invalid Number");
+    return (uint32_t)(((w & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32);
 }
 
-lval *lval_read(mpc_ast_t *t)
+// Parses the decimal integer held in [s, s + len) in place. Returns 0 if
+// the span is not a number or the value does not fit in a long, which is
+// exactly when strtol would have reported ERANGE.
+static int lval_parse_long(const char *s, size_t len, long *out)
 {
-    if (strstr(t->tag, "number"))
+    int neg = (len > 0 && s[0] == '-');
+    unsigned long long limit = neg ? (unsigned long long)LONG_MAX + 1 : LONG_MAX;
+    unsigned long long acc = 0;
+
+    if (neg)
+    {
+        s++;
+        len--;
+    }
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    while (len >= 8)
     {
-        return lval_read_num(t);
+        uint64_t w = lval_load8(s);
+
+        if (!lval_swar_is_digits8(w))
+        {
+            return 0;
+        }
+
+        uint32_t chunk = lval_swar_parse8(w);
+
+        if (acc > (limit - chunk) / 100000000ULL)
+        {
+            return 0;
+        }
+
+        acc = acc * 100000000ULL + chunk;
+        s += 8;
+        len -= 8;
     }
-    if (strstr(t->tag, "symbol"))
+
+    while (len > 0)
     {
-        return lval_sym(t->contents);
+        unsigned d = (unsigned char)*s - '0';
+
+        if (d > 9 || acc > (limit - d) / 10)
+        {
+            return 0;
+        }
+
+        acc = acc * 10 + d;
+        s++;
+        len--;
+    }
+
+    *out = neg && acc != 0 ? -(long)(acc - 1) - 1 : (long)acc;
+
+    return 1;
+}
+
+static void ltags_init(ltags *t, mpc_tree_t *tree, const char *text)
+{
+    t->tree = tree;
+    t->text = text;
+    t->number = mpc_tree_tag(tree, "number");
+    t->symbol = mpc_tree_tag(tree, "symbol");
+    t->sexpr = mpc_tree_tag(tree, "sexpr");
+    t->regex = mpc_tree_tag(tree, "regex");
+    t->root = mpc_tree_tag(tree, ">");
+}
+
+// Whether node n is tagged with tag alone.
+static int ltags_only(ltags *t, int n, int tag)
+{
+    mpc_node_t *x = &t->tree->nodes[n];
+    return x->tags_num == 1 && t->tree->tagsets[x->tags] == tag;
+}
+
+// Reads the digits straight from the input span the number was parsed
+// from rather than from its copy in the tree.
+lval *lval_read_num(ltags *t, mpc_node_t *n)
+{
+    long x;
+
+    return lval_parse_long(t->text + n->state.pos, n->length, &x)
+        ? lval_num(x) : lval_err("Invalid Number");
+}
+
+lval *lval_read(ltags *t, int n)
+{
+    mpc_node_t *node = &t->tree->nodes[n];
+
+    if (mpc_tree_has(t->tree, n, t->number))
+    {
+        return lval_read_num(t, node);
+    }
+    if (mpc_tree_has(t->tree, n, t->symbol))
+    {
+        return lval_sym(node->contents);
     }
 
     lval *x = NULL;
-    if (strcmp(t->tag, ">") == 0)
+    if (ltags_only(t, n, t->root))
     {
         x = lval_sexpr();
     }
-    if (strstr(t->tag, "sexr"))
+    if (mpc_tree_has(t->tree, n, t->sexpr))
     {
         x = lval_sexpr();
     }
 
-    for (int i = 0; i < t->children_num; i++)
+    for (int i = node->children; i < node->children + node->children_num; i++)
     {
-        if (strcmp(t->children[i]->contents, "(") == 0)
+        char *contents = t->tree->nodes[i].contents;
+
+        if (strcmp(contents, "(") == 0)
             continue;
 
-        if (strcmp(t->children[i]->contents, ")") == 0)
+        if (strcmp(contents, ")") == 0)
             continue;
 
-        if (strcmp(t->children[i]->contents, "{") == 0)
+        if (strcmp(contents, "{") == 0)
             continue;
 
-        if (strcmp(t->children[i]->contents, "}") == 0)
+        if (strcmp(contents, "}") == 0)
             continue;
 
-        if (strcmp(t->children[i]->tag, "regex") == 0)
+        if (ltags_only(t, i, t->regex))
             continue;
 
-        x = lval_add(x, lval_read(t->children[i]));
+        x = lval_add(x, lval_read(t, i));
     }
 
     return x;
 }
 
-void lval_print(lval *v)
+static void obuf_init(obuf *b, int fd, FILE *f)
+{
+    b->data = malloc(OBUF_BLOCK);
+    b->len = 0;
+    b->cap = OBUF_BLOCK;
+    b->fd = fd;
+    b->file = f;
+}
+
+void obuf_init_fd(obuf *b, int fd)
+{
+    obuf_init(b, fd, NULL);
+}
+
+void obuf_init_file(obuf *b, FILE *f)
+{
+    obuf_init(b, -1, f);
+}
+
+void obuf_init_mem(obuf *b)
+{
+    obuf_init(b, -1, NULL);
+}
+
+void obuf_free(obuf *b)
+{
+    obuf_flush(b);
+    free(b->data);
+    b->data = NULL;
+}
+
+void obuf_flush(obuf *b)
+{
+    if (b->file)
+    {
+        fwrite(b->data, 1, b->len, b->file);
+        fflush(b->file);
+        b->len = 0;
+    }
+    else if (b->fd >= 0)
+    {
+        size_t done = 0;
+
+        while (done < b->len)
+        {
+            ssize_t n = write(b->fd, b->data + done, b->len - done);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0)
+                break;
+
+            done += n;
+        }
+
+        b->len = 0;
+    }
+}
+
+// Returns the collected bytes as a NUL-terminated string. Only meaningful
+// for memory buffers; the pointer stays owned by the buffer.
+char *obuf_str(obuf *b)
+{
+    obuf_putc(b, '\0');
+    b->len--;
+
+    return b->data;
+}
+
+static void obuf_reserve(obuf *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return;
+
+    if (b->fd >= 0 || b->file)
+    {
+        obuf_flush(b);
+
+        if (n <= b->cap)
+            return;
+    }
+
+    while (b->len + n > b->cap)
+    {
+        b->cap *= 2;
+    }
+
+    b->data = realloc(b->data, b->cap);
+}
+
+void obuf_write(obuf *b, const char *s, size_t n)
+{
+    obuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+}
+
+void obuf_putc(obuf *b, char c)
+{
+    if (b->len == b->cap)
+        obuf_reserve(b, 1);
+
+    b->data[b->len++] = c;
+}
+
+void obuf_puts(obuf *b, const char *s)
+{
+    obuf_write(b, s, strlen(s));
+}
+
+static const char obuf_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Formats x right to left, emitting two digits per division.
+void obuf_long(obuf *b, long x)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? 0UL - (unsigned long)x : (unsigned long)x;
+
+    while (u >= 100)
+    {
+        unsigned i = (unsigned)(u % 100) * 2;
+        u /= 100;
+        p -= 2;
+        memcpy(p, obuf_digits + i, 2);
+    }
+
+    if (u >= 10)
+    {
+        p -= 2;
+        memcpy(p, obuf_digits + u * 2, 2);
+    }
+    else
+    {
+        *--p = (char)('0' + u);
+    }
+
+    if (x < 0)
+        *--p = '-';
+
+    obuf_write(b, p, tmp + sizeof(tmp) - p);
+}
+
+void lval_print(obuf *out, lval *v)
 {
     switch (v->type)
     {
         case LVAL_NUM:
-            printf("%ld", v->number);
+            obuf_long(out, v->number);
             break;
         case LVAL_ERR:
-            printf("Error: %s", v->err);
+            obuf_puts(out, "Error: ");
+            obuf_puts(out, v->err);
             break;
         case LVAL_SYM:
-            printf("%s", v->sym);
+            obuf_puts(out, v->sym);
+            break;
         case LVAL_SEXPR:
-            lval_print_expr(v, '(', ')');
+            lval_print_expr(out, v, '(', ')');
             break;
     }
 }
 
-void lval_println(lval *v)
+void lval_println(obuf *out, lval *v)
 {
-    lval_print(v);
-    putchar('\n');
+    lval_print(out, v);
+    obuf_putc(out, '\n');
 }
 
-void lval_print_expr(lval *v, char open, char close)
+void lval_print_expr(obuf *out, lval *v, char open, char close)
 {
-    putchar(open);
+    obuf_putc(out, open);
 
     for (int i = 0; i < v->count; i++)
     {
-        lval_print(v->cell[i]);
+        lval_print(out, v->cell[i]);
 
         if (i != v->count - 1)
         {
-            putchar(' ');
+            obuf_putc(out, ' ');
         }
     }
 
-    putchar(close);
+    obuf_putc(out, close);
 }
 
 
@@ -335,53 +649,476 @@ lval *lval_eval_sexpr(lval *v)
     return result;
 }
 
-int main(void)
+// Streaming reader for batch mode. Input is pulled in blocks and cut
+// into top-level forms; bytes before keep are dropped on the next
+// refill, so memory is bounded by one batch of forms.
+typedef struct lreader {
+    FILE *file;
+    int eof;
+
+    char *buf;
+    size_t cap;
+    size_t keep;
+    size_t start;
+    size_t len;
+
+    // Scan state of the form being read, kept across refills.
+    size_t scan;
+    int depth;
+
+    // Position of buf[start] in the whole input, for error messages.
+    int row;
+    int col;
+} lreader;
+
+enum {
+    LREADER_BLOCK = 1 << 16
+};
+
+static void lreader_init(lreader *r, FILE *f)
 {
-    mpc_parser_t *Number = mpc_new("number");
-    mpc_parser_t *Symbol = mpc_new("symbol");
-    mpc_parser_t *Sexpr = mpc_new("sexpr");
-    mpc_parser_t *Expr = mpc_new("expr");
-    mpc_parser_t *Lisp = mpc_new("lisp");
+    r->file = f;
+    r->eof = 0;
+    r->cap = LREADER_BLOCK;
+    r->buf = malloc(r->cap);
+    r->keep = 0;
+    r->start = 0;
+    r->len = 0;
+    r->scan = 0;
+    r->depth = 0;
+    r->row = 0;
+    r->col = 0;
+}
 
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "                                        \
-              number : /-?[0-9]+/ ;                    \
-              symbol : '+' | '-' | '*' | '/' ;         \
-              sexpr  : '(' <expr>* ')' ;               \
-              expr   : <number> | <symbol> | <sexpr> ; \
-              lisp   : /^/ <expr>+ /$/ ;               \
-              ",
-              Number, Symbol, Sexpr, Expr, Lisp);
+static void lreader_free(lreader *r)
+{
+    free(r->buf);
+}
 
-    puts("Lisp Version 0.9.29\n");
-    puts("Press Ctrl+c to exit\n");
+// Moves the kept tail to the front of the buffer and reads another
+// block.
+static int lreader_fill(lreader *r)
+{
+    if (r->eof)
+        return 0;
 
-    while (1)
+    if (r->keep > 0)
     {
-        char *input = readline("Lisp >> ");
+        memmove(r->buf, r->buf + r->keep, r->len - r->keep);
+        r->len -= r->keep;
+        r->scan -= r->keep;
+        r->start -= r->keep;
+        r->keep = 0;
+    }
 
-        add_history(input);
+    if (r->cap - r->len < LREADER_BLOCK)
+    {
+        while (r->cap - r->len < LREADER_BLOCK)
+        {
+            r->cap *= 2;
+        }
+        r->buf = realloc(r->buf, r->cap);
+    }
 
-        mpc_result_t r;
+    size_t n = fread(r->buf + r->len, 1, LREADER_BLOCK, r->file);
+    r->len += n;
 
-        if (mpc_parse("<stdin>", input, Lisp, &r))
+    if (n == 0)
+        r->eof = 1;
+
+    return n > 0;
+}
+
+static int lreader_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static void lreader_advance(lreader *r, size_t to)
+{
+    for (size_t i = r->start; i < to; i++)
+    {
+        if (r->buf[i] == '\n')
         {
-            // On success print the result
-            lval *result = lval_eval(lval_read(r.output));
-            lval_println(result);
-            lval_del(result);
+            r->row++;
+            r->col = 0;
         }
         else
         {
-            // Otherwise print the error
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            r->col++;
         }
+    }
+
+    r->start = to;
+}
+
+// Finds the next top-level form: a paren-balanced list or a single atom.
+// The grammar has no strings, so every paren and space counts. On
+// success the form is [*form, *form + *len), valid until the next call
+// that moves keep past it. Returns 0 once only whitespace is left.
+static int lreader_next(lreader *r, char **form, size_t *len)
+{
+    for (;;)
+    {
+        while (r->start < r->len && lreader_is_space(r->buf[r->start]))
+        {
+            lreader_advance(r, r->start + 1);
+        }
+
+        if (r->start < r->len)
+            break;
+
+        if (!lreader_fill(r))
+            return 0;
+    }
+
+    r->scan = r->start;
+    r->depth = 0;
+
+    for (;;)
+    {
+        while (r->scan < r->len)
+        {
+            char c = r->buf[r->scan];
+
+            if (c == '(')
+            {
+                r->depth++;
+            }
+            else if (c == ')')
+            {
+                r->depth--;
+
+                if (r->depth <= 0)
+                {
+                    r->scan++;
+                    goto found;
+                }
+            }
+            else if (r->depth == 0 && lreader_is_space(c))
+            {
+                goto found;
+            }
+
+            r->scan++;
+
+            if (r->depth == 0 && r->scan < r->len && r->buf[r->scan] == '(')
+                goto found;
+        }
+
+        // Unterminated form at end of input is handed out as is, so the
+        // parser can report what is missing.
+        if (!lreader_fill(r))
+            break;
+    }
+
+found:
+    *form = r->buf + r->start;
+    *len = r->scan - r->start;
+
+    return 1;
+}
+
+static void lisp_print_error(obuf *out, mpc_err_t *e)
+{
+    char *msg = mpc_err_string(e);
+    obuf_puts(out, msg);
+    free(msg);
+}
+
+// A top-level form and what it reads as: the unevaluated value, or the
+// error it failed to parse with.
+typedef struct lform
+{
+    size_t start;
+    size_t len;
+    int row;
+    int col;
+
+    lval *value;
+    mpc_err_t *error;
+} lform;
+
+// Parses the form at text + f->start without evaluating it. row and col
+// give the position of the form within its file so error locations point
+// into the file. Only touches f, so forms can be read on any thread.
+static void lisp_read_form(const char *filename, const char *text, lform *f)
+{
+    mpc_result_t r;
+
+    f->value = NULL;
+    f->error = NULL;
+
+    if (lisp_parse_lisp_tree(filename, text + f->start, f->len, &r))
+    {
+        ltags t;
+        ltags_init(&t, r.output, text + f->start);
+
+        f->value = lval_read(&t, 0);
+        mpc_tree_delete(t.tree);
+    }
+    else
+    {
+        if (r.error->state.row == 0)
+        {
+            r.error->state.col += f->col;
+        }
+        r.error->state.row += f->row;
+
+        f->error = r.error;
+    }
+}
+
+// Evaluates a read form and prints the result, or prints its error.
+static void lisp_eval_form(lform *f, obuf *out)
+{
+    if (f->value)
+    {
+        lval *result = lval_eval(f->value);
+        lval_println(out, result);
+        lval_del(result);
+    }
+    else
+    {
+        lisp_print_error(out, f->error);
+        mpc_err_delete(f->error);
+    }
+}
+
+// Parses, evaluates and prints len bytes of input.
+static void lisp_eval_print(const char *filename, const char *input, size_t len, int row, int col,
+                            obuf *out)
+{
+    lform f = { 0, len, row, col, NULL, NULL };
+
+    lisp_read_form(filename, input, &f);
+    lisp_eval_form(&f, out);
+}
+
+// Parallel loader. Forms are collected from the reader in batches of
+// about jobs * LLOADER_BATCH bytes, read by jobs threads taking
+// LLOADER_GRAIN forms at a time, then evaluated in order on the calling
+// thread. Reading has no side effects, so the output is the same as
+// reading and evaluating one form at a time.
+typedef struct lloader
+{
+    const char *filename;
+    const char *text;
+    int jobs;
+
+    lform *forms;
+    size_t num;
+    size_t cap;
+
+    size_t next;
+    pthread_mutex_t lock;
+} lloader;
+
+enum {
+    LLOADER_BATCH = 1 << 18,
+    LLOADER_GRAIN = 16
+};
+
+static void *lloader_work(void *data)
+{
+    lloader *l = data;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&l->lock);
+        size_t from = l->next;
+        size_t to = from + LLOADER_GRAIN < l->num ? from + LLOADER_GRAIN : l->num;
+        l->next = to;
+        pthread_mutex_unlock(&l->lock);
+
+        if (from == to)
+            break;
+
+        for (size_t i = from; i < to; i++)
+        {
+            lisp_read_form(l->filename, l->text, &l->forms[i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Reads every collected form. The calling thread works too, and if a
+// thread cannot be started the others just take its share.
+static void lloader_read(lloader *l)
+{
+    pthread_t threads[l->jobs];
+    int started = 0;
+
+    l->next = 0;
+
+    for (int i = 1; i < l->jobs && (size_t)i * LLOADER_GRAIN < l->num; i++)
+    {
+        if (pthread_create(&threads[started], NULL, lloader_work, l) == 0)
+            started++;
+    }
+
+    lloader_work(l);
+
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Evaluates every top-level form of f in order, releasing each batch
+// once its results have been written.
+static void lisp_run_stream(const char *filename, FILE *f, int jobs, obuf *out)
+{
+    lreader rd;
+    lloader l;
+    char *form;
+    size_t len;
+
+    lreader_init(&rd, f);
+
+    l.filename = filename;
+    l.jobs = jobs;
+    l.cap = 64;
+    l.forms = malloc(l.cap * sizeof(lform));
+    pthread_mutex_init(&l.lock, NULL);
+
+    for (;;)
+    {
+        size_t bytes = 0;
+
+        // Forms are kept as offsets from keep until the batch is
+        // complete, since reading further may move the buffer.
+        l.num = 0;
+        rd.keep = rd.start;
+
+        while (bytes < (size_t)jobs * LLOADER_BATCH && lreader_next(&rd, &form, &len))
+        {
+            if (l.num == l.cap)
+            {
+                l.cap *= 2;
+                l.forms = realloc(l.forms, l.cap * sizeof(lform));
+            }
+
+            lform *lf = &l.forms[l.num++];
+            lf->start = form - rd.buf - rd.keep;
+            lf->len = len;
+            lf->row = rd.row;
+            lf->col = rd.col;
+
+            bytes += len;
+            lreader_advance(&rd, form + len - rd.buf);
+        }
+
+        if (l.num == 0)
+            break;
+
+        l.text = rd.buf + rd.keep;
+        lloader_read(&l);
+
+        for (size_t i = 0; i < l.num; i++)
+        {
+            lisp_eval_form(&l.forms[i], out);
+        }
+    }
+
+    pthread_mutex_destroy(&l.lock);
+    free(l.forms);
+    lreader_free(&rd);
+}
+
+// Number of threads to read with unless -j says otherwise.
+static int lisp_default_jobs(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1)
+        return 1;
+
+    return n > 64 ? 64 : (int)n;
+}
+
+static int lisp_batch(int argc, char **argv)
+{
+    int status = 0;
+    int jobs = lisp_default_jobs();
+    obuf out;
+
+    obuf_init_fd(&out, STDOUT_FILENO);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0)
+        {
+            char *end;
+            long n = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+
+            if (n < 1 || *end != '\0')
+            {
+                obuf_flush(&out);
+                fprintf(stderr, "lisp: -j needs a positive number of jobs\n");
+                fprintf(stderr, "usage: lisp [-j jobs] file.lisp ... | -\n");
+                obuf_free(&out);
+                return 2;
+            }
+
+            jobs = n > 64 ? 64 : (int)n;
+            i++;
+            continue;
+        }
+
+        if (strcmp(argv[i], "-") == 0)
+        {
+            lisp_run_stream("<stdin>", stdin, jobs, &out);
+            continue;
+        }
+
+        FILE *f = fopen(argv[i], "rb");
+
+        if (f == NULL)
+        {
+            obuf_flush(&out);
+            fprintf(stderr, "lisp: cannot open '%s': %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        lisp_run_stream(argv[i], f, jobs, &out);
+        fclose(f);
+    }
+
+    obuf_free(&out);
+
+    return status;
+}
+
+int main(int argc, char **argv)
+{
+    // Batch mode: lisp [-j jobs] file.lisp ... or lisp - for stdin
+    if (argc > 1)
+    {
+        return lisp_batch(argc, argv);
+    }
+
+    puts("Lisp Version 0.9.29\n");
+    puts("Press Ctrl+c to exit\n");
+
+    obuf out;
+    obuf_init_file(&out, stdout);
+
+    while (1)
+    {
+        char *input = readline("Lisp >> ");
+
+        add_history(input);
+
+        lisp_eval_print("<stdin>", input, strlen(input), 0, 0, &out);
+        obuf_flush(&out);
 
         free(input);
     }
 
-    mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lisp);
+    obuf_free(&out);
 
     return 0;
 }
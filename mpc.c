@@ -1,5 +1,65 @@
+/*
+ ** Files are parsed from a read-only mapping where
+ ** the platform has `mmap`. Define `MPC_NO_MMAP` to
+ ** always read them through stdio instead.
+ */
+
+#if !defined(_WIN32) && !defined(MPC_NO_MMAP)
+#define MPC_MMAP
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "mpc.h"
 
+#ifdef MPC_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+ ** Runs of characters from a class are matched
+ ** sixteen bytes at a time with SSE2 where the
+ ** compiler targets it. Define `MPC_NO_SIMD` to
+ ** always match them one byte at a time.
+ */
+
+#if defined(__SSE2__) && !defined(MPC_NO_SIMD)
+#define MPC_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+ ** Define `MPC_LAZY_ROWS` to have strings and maps
+ ** only track the byte offset while parsing. Rows
+ ** and columns are then worked out from an index of
+ ** the newlines, built with `memchr` as far as it is
+ ** needed, for the states a parse hands out and the
+ ** error it fails with. Files read through stdio
+ ** and pipes still count them as they go.
+ */
+
+/*
+ ** Define `MPC_PROFILE` to have the parsing loop
+ ** count how each named parser is used and what
+ ** it costs, for parses made through a context
+ ** given a report. Cycles are read from the
+ ** timestamp counter where there is one, and are
+ ** `clock` ticks elsewhere.
+ */
+
+#ifdef MPC_PROFILE
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define mpc_profile_clock() ((double)__rdtsc())
+#else
+#include <time.h>
+#define mpc_profile_clock() ((double)clock())
+#endif
+#endif
+
 /*
  ** State Type
  */
@@ -30,7 +90,7 @@ static mpc_state_t *mpc_state_copy(mpc_state_t s) {
  ** Error Type
  */
 
-static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved) {
+mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved) {
     mpc_err_t *x = malloc(sizeof(mpc_err_t));
     x->filename = malloc(strlen(filename) + 1);
     strcpy(x->filename, filename);
@@ -44,7 +104,7 @@ static mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *e
     return x;
 }
 
-static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
+mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure) {
     mpc_err_t *x = malloc(sizeof(mpc_err_t));
     x->filename = malloc(strlen(filename) + 1);
     strcpy(x->filename, filename);
@@ -57,9 +117,32 @@ static mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *
     return x;
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+
+    int i;
+    mpc_err_t *y = malloc(sizeof(mpc_err_t));
+    y->filename = malloc(strlen(x->filename) + 1);
+    strcpy(y->filename, x->filename);
+    y->state = x->state;
+    y->expected_num = x->expected_num;
+    y->expected = malloc(sizeof(char*) * x->expected_num);
+    for (i = 0; i < x->expected_num; i++) {
+        y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+        strcpy(y->expected[i], x->expected[i]);
+    }
+    y->failure = NULL;
+    if (x->failure) {
+        y->failure = malloc(strlen(x->failure) + 1);
+        strcpy(y->failure, x->failure);
+    }
+    y->recieved = x->recieved;
+    return y;
+}
+
 void mpc_err_delete(mpc_err_t *x) {
 
     int i;
+    if (x == NULL) { return; }
     for (i = 0; i < x->expected_num; i++) {
         free(x->expected[i]);
     }
@@ -122,13 +205,12 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
     va_end(va);
 }
 
-static char char_unescape_buffer[3];
-
-static char *mpc_err_char_unescape(char c) {
+static char *mpc_err_char_unescape(char c, char *buffer) {
 
-    char_unescape_buffer[0] = '\'';
-    char_unescape_buffer[1] = ' ';
-    char_unescape_buffer[2] = '\'';
+    buffer[0] = '\'';
+    buffer[1] = ' ';
+    buffer[2] = '\'';
+    buffer[3] = '\0';
 
     switch (c) {
 
@@ -142,8 +224,8 @@ static char *mpc_err_char_unescape(char c) {
         case '\t': return "tab";
         case ' ' : return "space";
         default:
-                   char_unescape_buffer[1] = c;
-                   return char_unescape_buffer;
+                   buffer[1] = c;
+                   return buffer;
     }
 
 }
@@ -151,6 +233,7 @@ static char *mpc_err_char_unescape(char c) {
 char *mpc_err_string(mpc_err_t *x) {
 
     char *buffer = calloc(1, 1024);
+    char unescaped[4];
     int max = 1023;
     int pos = 0; 
     int i;
@@ -179,13 +262,13 @@ char *mpc_err_string(mpc_err_t *x) {
     }
 
     mpc_err_string_cat(buffer, &pos, &max, " at ");
-    mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+    mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, unescaped));
     mpc_err_string_cat(buffer, &pos, &max, "\n");
 
     return realloc(buffer, strlen(buffer) + 1);
 }
 
-static mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
+mpc_err_t *mpc_err_or(mpc_err_t** x, int n) {
 
     int i, j;
     mpc_err_t *e = malloc(sizeof(mpc_err_t));
@@ -258,11 +341,11 @@ static mpc_err_t *mpc_err_repeat(mpc_err_t *x, const char *prefix) {
 
 }
 
-static mpc_err_t *mpc_err_many1(mpc_err_t *x) {
+mpc_err_t *mpc_err_many1(mpc_err_t *x) {
     return mpc_err_repeat(x, "one or more of ");
 }
 
-static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
+mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
     mpc_err_t *y;
     int digits = n/10 + 1;
     char *prefix = malloc(digits + strlen(" of ") + 1);
@@ -277,40 +360,74 @@ static mpc_err_t *mpc_err_count(mpc_err_t *x, int n) {
  */
 
 /*
- ** In mpc the input type has three modes of 
- ** operation: String, File and Pipe.
+ ** In mpc the input type has four modes of 
+ ** operation: String, Mmap, File and Pipe.
  **
- ** String is easy. The whole contents are 
- ** loaded into a buffer and scanned through.
- ** The cursor can jump around at will making 
- ** backtracking easy.
+ ** String is easy. The caller's buffer is
+ ** borrowed, never copied, and scanned through
+ ** up to a length given up front, so it may
+ ** contain NUL bytes. The cursor can jump around
+ ** at will making backtracking easy.
  **
- ** The second is a File which is also somewhat
+ ** Mmap is used for regular files when possible.
+ ** The file is mapped read-only and the mapped
+ ** bytes are scanned in place exactly like a
+ ** string.
+ **
+ ** Otherwise a File is used which is also somewhat
  ** easy. The contents are never loaded into 
  ** memory but backtracking can still be achieved
  ** by seeking in the file at different positions.
  **
- ** The final mode is Pipe. This is the difficult
- ** one. As we assume pipes cannot be seeked - and 
- ** only support a single character lookahead at 
- ** any point, when the input is marked for a 
- ** potential backtracking we start buffering any 
- ** input.
+ ** The final mode is Pipe, which is also the
+ ** fallback for files that cannot be seeked.
+ ** This is the difficult
+ ** one. As we assume pipes cannot be seeked
+ ** every character read is appended to a buffer
+ ** which tracks its own length and grows
+ ** geometrically.
  **
  ** This means that if we are requested to seek
  ** back we can simply start reading from the
- ** buffer instead of the input.
+ ** buffer instead of the input. Bytes behind
+ ** both the oldest mark and the cursor can never
+ ** be read again, so they are dropped whenever
+ ** the buffer fills up. A pipe is therefore
+ ** parsed in linear time and only holds the
+ ** input since the oldest active mark.
  **
  ** Of course using `mpc_predictive` will disable
  ** backtracking and make LL(1) grammars easy
  ** to parse for all input methods.
  **
+ ** A parser wrapped in `mpc_commit` moves every
+ ** mark the parse has made up to where it stops,
+ ** so nothing before can be read again. A pipe of
+ ** many forms each committed to then only buffers
+ ** the form being read. The results of the forms
+ ** are still kept until the repeat around them
+ ** folds them, so the memory used grows with them
+ ** all the same.
+ **
+ ** The marks a commit moved are counted, and going
+ ** back to one of them cuts the input. The parser
+ ** that would have gone back further cannot, so
+ ** once cut every choice fails rather than trying
+ ** the next alternative from the wrong place, and
+ ** the whole parse fails.
+ **
+ ** Inputs also own the stacks used to parse them.
+ ** These only ever grow, so a parse context which
+ ** keeps one input around for many strings makes
+ ** no allocations of its own once warmed up.
+ **
  */
 
 enum {
     MPC_INPUT_STRING = 0,
     MPC_INPUT_FILE   = 1,
-    MPC_INPUT_PIPE   = 2
+    MPC_INPUT_PIPE   = 2,
+    MPC_INPUT_MMAP   = 3
 };
 
 typedef struct {
@@ -319,41 +436,117 @@ typedef struct {
     char *filename;  
     mpc_state_t state;
 
-    char *string;
+    const char *string;
     char *buffer;
     FILE *file;
 
+    int buffer_start;
+    int buffer_len;
+    int buffer_slots;
+    int ended;
+
+    int length;
+    char *map;
+    size_t map_size;
+    long map_offset;
+
     int backtrack;
     int marks_num;
+    int marks_slots;
     mpc_state_t* marks;
     char* lasts;
 
+    int marks_floor;
+    int committed;
+    int cut;
+
     char last;
 
+    struct mpc_stack_t *spare;
+    struct mpc_vm_entry_t *trail;
+    int trail_slots;
+    struct mpc_vm_cap_t *caps;
+    int caps_slots;
+
+#ifdef MPC_LAZY_ROWS
+    int *lines;
+    int lines_num;
+    int lines_slots;
+    int lines_scanned;
+#endif
+
+#ifdef MPC_PROFILE
+    unsigned long rewinds;
+    struct mpc_profile_t *profile;
+    struct mpc_profile_t *counts;
+#endif
+
 } mpc_input_t;
 
-static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
+/*
+ ** Sets up everything inputs of all types share,
+ ** leaving each constructor only what differs.
+ */
 
-    mpc_input_t *i = malloc(sizeof(mpc_input_t));
+static void mpc_input_init(mpc_input_t *i, const char *filename, int type) {
 
     i->filename = malloc(strlen(filename) + 1);
     strcpy(i->filename, filename);
-    i->type = MPC_INPUT_STRING;
+    i->type = type;
 
     i->state = mpc_state_new();
 
-    i->string = malloc(strlen(string) + 1);
-    strcpy(i->string, string);
+    i->string = NULL;
     i->buffer = NULL;
+    i->buffer_start = 0;
+    i->buffer_len = 0;
+    i->buffer_slots = 0;
+    i->ended = 0;
     i->file = NULL;
 
+    i->length = 0;
+    i->map = NULL;
+    i->map_size = 0;
+    i->map_offset = 0;
+
     i->backtrack = 1;
     i->marks_num = 0;
+    i->marks_slots = 0;
     i->marks = NULL;
     i->lasts = NULL;
 
+    i->marks_floor = 0;
+    i->committed = 0;
+    i->cut = 0;
+
     i->last = '\0';
 
+    i->spare = NULL;
+    i->trail = NULL;
+    i->trail_slots = 0;
+    i->caps = NULL;
+    i->caps_slots = 0;
+#ifdef MPC_LAZY_ROWS
+    i->lines = NULL;
+    i->lines_num = 0;
+    i->lines_slots = 0;
+    i->lines_scanned = 0;
+#endif
+#ifdef MPC_PROFILE
+    i->rewinds = 0;
+    i->profile = NULL;
+    i->counts = NULL;
+#endif
+}
+
+static mpc_input_t *mpc_input_new_string(const char *filename, const char *string, int length) {
+
+    mpc_input_t *i = malloc(sizeof(mpc_input_t));
+
+    mpc_input_init(i, filename, MPC_INPUT_STRING);
+    i->string = string;
+    i->length = length;
+
     return i;
 }
 
@@ -361,59 +554,102 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
 
     mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
-    i->filename = malloc(strlen(filename) + 1);
-    strcpy(i->filename, filename);
+    mpc_input_init(i, filename, MPC_INPUT_PIPE);
+    i->file = pipe;
 
-    i->type = MPC_INPUT_PIPE;
-    i->state = mpc_state_new();
+    return i;
 
-    i->string = NULL;
-    i->buffer = NULL;
-    i->file = pipe;
+}
 
-    i->backtrack = 1;
-    i->marks_num = 0;
-    i->marks = NULL;
-    i->lasts = NULL;
+#ifdef MPC_MMAP
 
-    i->last = '\0';
+/*
+ ** Maps the rest of a regular file starting at the
+ ** current position of `file`. On success the input
+ ** becomes an Mmap input and the stream is moved to
+ ** just after the consumed bytes when it is deleted.
+ */
 
-    return i;
+static int mpc_input_map(mpc_input_t *i) {
+
+    struct stat st;
+    long offset;
+    void *map;
+
+    if (fstat(fileno(i->file), &st) != 0 || !S_ISREG(st.st_mode)) { return 0; }
+
+    offset = ftell(i->file);
+    if (offset < 0 || st.st_size - offset > 0x7FFFFFFF) { return 0; }
 
+    i->type = MPC_INPUT_MMAP;
+    i->map_offset = offset;
+
+    if (st.st_size <= offset) {
+        i->string = "";
+        i->length = 0;
+        return 1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(i->file), 0);
+    if (map == MAP_FAILED) {
+        i->type = MPC_INPUT_FILE;
+        return 0;
+    }
+
+    i->map = map;
+    i->map_size = st.st_size;
+    i->string = i->map + offset;
+    i->length = (int)(st.st_size - offset);
+    return 1;
 }
 
+#endif
+
 static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
 
     mpc_input_t *i = malloc(sizeof(mpc_input_t));
 
-    i->filename = malloc(strlen(filename) + 1);
-    strcpy(i->filename, filename);
-    i->type = MPC_INPUT_FILE;
-    i->state = mpc_state_new();
-
-    i->string = NULL;
-    i->buffer = NULL;
+    mpc_input_init(i, filename, MPC_INPUT_FILE);
     i->file = file;
 
-    i->backtrack = 1;
-    i->marks_num = 0;
-    i->marks = NULL;
-    i->lasts = NULL;
+#ifdef MPC_MMAP
+    if (mpc_input_map(i)) { return i; }
+#endif
 
-    i->last = '\0';
+    if (fseek(file, 0, SEEK_CUR) != 0) {
+        i->type = MPC_INPUT_PIPE;
+    }
 
     return i;
 }
 
+struct mpc_stack_t;
+static void mpc_stack_delete(struct mpc_stack_t *s);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
     free(i->filename);
 
-    if (i->type == MPC_INPUT_STRING) { free(i->string); }
     if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
+#ifdef MPC_MMAP
+    if (i->type == MPC_INPUT_MMAP) {
+        if (i->map) { munmap(i->map, i->map_size); }
+        fseek(i->file, i->map_offset + i->state.pos, SEEK_SET);
+    }
+#endif
+
     free(i->marks);
     free(i->lasts);
+    mpc_stack_delete(i->spare);
+    free(i->trail);
+    free(i->caps);
+#ifdef MPC_LAZY_ROWS
+    free(i->lines);
+#endif
+#ifdef MPC_PROFILE
+    if (i->counts) { mpc_profile_delete(i->counts); }
+#endif
     free(i);
 }
 
@@ -424,37 +660,34 @@ static void mpc_input_mark(mpc_input_t *i) {
 
     if (i->backtrack < 1) { return; }
 
-    i->marks_num++;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-    i->marks[i->marks_num-1] = i->state;
-    i->lasts[i->marks_num-1] = i->last;
-
-    if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-        i->buffer = calloc(1, 1);
+    if (i->marks_num == i->marks_slots) {
+        i->marks_slots = i->marks_slots ? i->marks_slots * 2 : 32;
+        i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+        i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
     }
 
+    i->marks[i->marks_num] = i->state;
+    i->lasts[i->marks_num] = i->last;
+    i->marks_num++;
+
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-
     if (i->backtrack < 1) { return; }
-
     i->marks_num--;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
-
-    if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-        free(i->buffer);
-        i->buffer = NULL;
-    }
-
+    if (i->committed > i->marks_num) { i->committed = i->marks_num; }
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
 
     if (i->backtrack < 1) { return; }
 
+    if (i->marks_num <= i->committed) { i->cut = 1; }
+
+#ifdef MPC_PROFILE
+    i->rewinds++;
+#endif
+
     i->state = i->marks[i->marks_num-1];
     i->last  = i->lasts[i->marks_num-1];
 
@@ -465,18 +698,92 @@ static void mpc_input_rewind(mpc_input_t *i) {
     mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-    return i->state.pos < (strlen(i->buffer) + i->marks[0].pos);
+static void mpc_input_jump(mpc_input_t *i, mpc_state_t s, char last) {
+
+    i->state = s;
+    i->last = last;
+
+    if (i->type == MPC_INPUT_FILE) {
+        fseek(i->file, i->state.pos, SEEK_SET);
+    }
+}
+
+/* Marks from before the parse began belong to the caller and are kept */
+static void mpc_input_commit(mpc_input_t *i) {
+
+    int j;
+
+    for (j = i->marks_floor; j < i->marks_num; j++) {
+        i->marks[j] = i->state;
+        i->lasts[j] = i->last;
+    }
+
+    i->committed = i->marks_num;
+}
+
+static int mpc_input_buffer_end(mpc_input_t *i) {
+    return i->buffer_start + i->buffer_len;
+}
+
+static void mpc_input_buffer_reserve(mpc_input_t *i, int n) {
+
+    int keep, dead;
+
+    while (i->buffer_slots - i->buffer_len < n) {
+
+        keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+        dead = keep - i->buffer_start;
+
+        if (dead > 0 && dead >= i->buffer_len / 2) {
+            memmove(i->buffer, i->buffer + dead, i->buffer_len - dead);
+            i->buffer_start += dead;
+            i->buffer_len -= dead;
+        } else {
+            i->buffer_slots = i->buffer_slots ? i->buffer_slots * 2 : 4096;
+            i->buffer = realloc(i->buffer, i->buffer_slots);
+        }
+    }
+}
+
+static void mpc_input_buffer_append(mpc_input_t *i, char c) {
+    mpc_input_buffer_reserve(i, 1);
+    i->buffer[i->buffer_len++] = c;
+}
+
+static void mpc_input_buffer_write(mpc_input_t *i, const char *s, int n) {
+    mpc_input_buffer_reserve(i, n);
+    memcpy(i->buffer + i->buffer_len, s, n);
+    i->buffer_len += n;
+}
+
+/*
+ ** Makes sure the character under the cursor is
+ ** in the buffer, reading it from the pipe if
+ ** needed. Returns zero at the end of the input.
+ ** A fed input has no pipe, and only has what it
+ ** has been fed so far.
+ */
+
+static int mpc_input_buffer_fill(mpc_input_t *i) {
+    int c;
+    if (i->state.pos < mpc_input_buffer_end(i)) { return 1; }
+    if (i->file == NULL) { return 0; }
+    c = getc(i->file);
+    if (c == EOF) { return 0; }
+    mpc_input_buffer_append(i, c);
+    return 1;
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
-    return i->buffer[i->state.pos - i->marks[0].pos];
+    if (!mpc_input_buffer_fill(i)) { return '\0'; }
+    return i->buffer[i->state.pos - i->buffer_start];
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-    if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+    if (i->type == MPC_INPUT_STRING && i->state.pos >= i->length) { return 1; }
+    if (i->type == MPC_INPUT_MMAP && i->state.pos >= i->length) { return 1; }
     if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
-    if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
+    if (i->type == MPC_INPUT_PIPE && i->state.pos >= mpc_input_buffer_end(i)) { return 1; }
     return 0;
 }
 
@@ -486,19 +793,10 @@ static char mpc_input_getc(mpc_input_t *i) {
 
     switch (i->type) {
 
-        case MPC_INPUT_STRING: return i->string[i->state.pos];
+        case MPC_INPUT_STRING:
+        case MPC_INPUT_MMAP: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
         case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-        case MPC_INPUT_PIPE:
-
-                             if (!i->buffer) { c = getc(i->file); return c; }
-
-                             if (i->buffer && mpc_input_buffer_in_range(i)) {
-                                 c = mpc_input_buffer_get(i);
-                                 return c;
-                             } else {
-                                 c = getc(i->file);
-                                 return c;
-                             }
+        case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
         default: return c;
     }
@@ -509,7 +807,8 @@ static char mpc_input_peekc(mpc_input_t *i) {
     char c = '\0';
 
     switch (i->type) {
-        case MPC_INPUT_STRING: return i->string[i->state.pos];
+        case MPC_INPUT_STRING:
+        case MPC_INPUT_MMAP: return i->state.pos < i->length ? i->string[i->state.pos] : '\0';
         case MPC_INPUT_FILE: 
 
                                c = fgetc(i->file);
@@ -518,23 +817,7 @@ static char mpc_input_peekc(mpc_input_t *i) {
                                fseek(i->file, -1, SEEK_CUR);
                                return c;
 
-        case MPC_INPUT_PIPE:
-
-                               if (!i->buffer) {
-                                   c = getc(i->file);
-                                   if (feof(i->file)) { return '\0'; }
-                                   ungetc(c, i->file);
-                                   return c;
-                               }
-
-                               if (i->buffer && mpc_input_buffer_in_range(i)) {
-                                   return mpc_input_buffer_get(i);
-                               } else {
-                                   c = getc(i->file);
-                                   if (feof(i->file)) { return '\0'; }
-                                   ungetc(c, i->file);
-                                   return c;
-                               }
+        case MPC_INPUT_PIPE: return mpc_input_buffer_get(i);
 
         default: return c;
     }
@@ -545,40 +828,35 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
     switch (i->type) {
         case MPC_INPUT_STRING: break;
+        case MPC_INPUT_MMAP: break;
         case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); break;
-        case MPC_INPUT_PIPE:
-
-                             if (!i->buffer) { ungetc(c, i->file); break; }
-
-                             if (i->buffer && mpc_input_buffer_in_range(i)) {
-                                 break;
-                             } else {
-                                 ungetc(c, i->file); 
-                             }
-
+        case MPC_INPUT_PIPE: break;
     }
 
     return 0;
 }
 
-static int mpc_input_success(mpc_input_t *i, char c, char **o) {
+static int mpc_input_contiguous(mpc_input_t *i) {
+    return i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP;
+}
 
-    if (i->type == MPC_INPUT_PIPE &&
-            i->buffer &&
-            !mpc_input_buffer_in_range(i)) {
+#ifdef MPC_LAZY_ROWS
+#define mpc_input_counts_rows(i) (!mpc_input_contiguous(i))
+#else
+#define mpc_input_counts_rows(i) 1
+#endif
 
-        i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-        i->buffer[strlen(i->buffer) + 1] = '\0';
-        i->buffer[strlen(i->buffer) + 0] = c;
-    }
+static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
     i->last = c;
     i->state.pos++;
-    i->state.col++;
 
-    if (c == '\n') {
-        i->state.col = 0;
-        i->state.row++;
+    if (mpc_input_counts_rows(i)) {
+        i->state.col++;
+        if (c == '\n') {
+            i->state.col = 0;
+            i->state.row++;
+        }
     }
 
     if (o) {
@@ -590,34 +868,93 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     return 1;
 }
 
-static int mpc_input_any(mpc_input_t *i, char **o) {
-    char x = mpc_input_getc(i);
-    if (mpc_input_terminated(i)) { return 0; }
-    return mpc_input_success(i, x, o);
+static void mpc_state_advance(mpc_state_t *st, const char *s, int n) {
+
+    const char *t = s;
+    const char *nl;
+
+    while ((nl = memchr(t, '\n', s + n - t))) {
+        st->row++;
+        t = nl + 1;
+    }
+
+    st->col = t == s ? st->col + n : (int)(s + n - t);
+    st->pos += n;
 }
 
-static int mpc_input_char(mpc_input_t *i, char c, char **o) {
-    char x = mpc_input_getc(i);
-    if (mpc_input_terminated(i)) { return 0; }
-    return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+static void mpc_input_advance(mpc_input_t *i, int n) {
+    if (n <= 0) { return; }
+    i->last = i->string[i->state.pos + n - 1];
+    if (mpc_input_counts_rows(i)) {
+        mpc_state_advance(&i->state, i->string + i->state.pos, n);
+    } else {
+        i->state.pos += n;
+    }
+}
+
+/*
+ ** Fills in the row and column of `s` when they
+ ** are not being counted, extending the index of
+ ** newlines up to it first. The row is the number
+ ** of newlines before `s`.
+ */
+
+static void mpc_input_locate(mpc_input_t *i, mpc_state_t *s) {
+#ifdef MPC_LAZY_ROWS
+
+    const char *nl;
+    int lo, hi, mid;
+
+    if (mpc_input_counts_rows(i) || s->pos < 0) { return; }
+
+    while (i->lines_scanned < s->pos) {
+        nl = memchr(i->string + i->lines_scanned, '\n', s->pos - i->lines_scanned);
+        if (nl == NULL) { i->lines_scanned = s->pos; break; }
+        if (i->lines_num == i->lines_slots) {
+            i->lines_slots = i->lines_slots ? i->lines_slots * 2 : 64;
+            i->lines = realloc(i->lines, sizeof(int) * i->lines_slots);
+        }
+        i->lines[i->lines_num++] = (int)(nl - i->string);
+        i->lines_scanned = (int)(nl - i->string) + 1;
+    }
+
+    lo = 0;
+    hi = i->lines_num;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (i->lines[mid] < s->pos) { lo = mid + 1; } else { hi = mid; }
+    }
+
+    s->row = lo;
+    s->col = lo ? s->pos - i->lines[lo-1] - 1 : s->pos;
+
+#else
+    (void)i; (void)s;
+#endif
+}
+
+static mpc_state_t mpc_input_state(mpc_input_t *i) {
+    mpc_state_t s = i->state;
+    mpc_input_locate(i, &s);
+    return s;
 }
 
-static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
+static int mpc_input_any(mpc_input_t *i, char **o) {
     char x = mpc_input_getc(i);
     if (mpc_input_terminated(i)) { return 0; }
-    return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+    return mpc_input_success(i, x, o);
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_char(mpc_input_t *i, char c, char **o) {
     char x = mpc_input_getc(i);
     if (mpc_input_terminated(i)) { return 0; }
-    return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+    return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_class(mpc_input_t *i, const unsigned char *c, char **o) {
     char x = mpc_input_getc(i);
     if (mpc_input_terminated(i)) { return 0; }
-    return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
+    return (c[(unsigned char)x >> 3] >> (x & 7)) & 1 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -628,14 +965,11 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
 
 static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
 
-    char *co = NULL;
     const char *x = c;
 
     mpc_input_mark(i);
     while (*x) {
-        if (mpc_input_char(i, *x, &co)) {
-            free(co);
-        } else {
+        if (!mpc_input_char(i, *x, NULL)) {
             mpc_input_rewind(i);
             return 0;
         }
@@ -643,15 +977,73 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
     }
     mpc_input_unmark(i);
 
-    *o = malloc(strlen(c) + 1);
-    strcpy(*o, c);
+    if (o) {
+        *o = malloc(strlen(c) + 1);
+        strcpy(*o, c);
+    }
     return 1;
 }
 
+/*
+ ** Strings and maps may contain NUL bytes, so for
+ ** those the start and end of input anchors look
+ ** at the position rather than the neighbouring
+ ** characters.
+ */
+
+static int mpc_soi_anchor(char prev, char next);
+static int mpc_eoi_anchor(char prev, char next);
+
 static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char)) {
+    if (mpc_input_contiguous(i)) {
+        if (f == mpc_soi_anchor) { return i->state.pos == 0; }
+        if (f == mpc_eoi_anchor) { return i->state.pos >= i->length; }
+    }
     return f(i->last, mpc_input_peekc(i));
 }
 
+/*
+ ** Spans need the consumed input to still be in
+ ** memory, and need failed parsers to rewind what
+ ** they consumed, so they are not used for files
+ ** or when backtracking is disabled.
+ */
+
+static int mpc_input_spans(mpc_input_t *i) {
+    return i->backtrack > 0 && i->type != MPC_INPUT_FILE;
+}
+
+static char *mpc_slice(const char *x, int n) {
+
+    char *o;
+    int j, k;
+
+    if (n == 0) { return calloc(1, 1); }
+
+    o = malloc(n + 1);
+
+    if (memchr(x, '\0', n) == NULL) {
+        memcpy(o, x, n);
+        o[n] = '\0';
+        return o;
+    }
+
+    /* Matched NUL bytes never appear in folded strings */
+    for (j = 0, k = 0; j < n; j++) {
+        if (x[j] != '\0') { o[k++] = x[j]; }
+    }
+    o[k] = '\0';
+    return o;
+}
+
+static char *mpc_input_slice(mpc_input_t *i, int start) {
+    if (i->type == MPC_INPUT_PIPE) {
+        return mpc_slice(i->buffer + (start - i->buffer_start), i->state.pos - start);
+    } else {
+        return mpc_slice(i->string + start, i->state.pos - start);
+    }
+}
+
 /*
  ** Parser Type
  */
@@ -668,23 +1060,25 @@ enum {
 
     MPC_TYPE_ANY       = 8,
     MPC_TYPE_SINGLE    = 9,
-    MPC_TYPE_ONEOF     = 10,
-    MPC_TYPE_NONEOF    = 11,
-    MPC_TYPE_RANGE     = 12,
-    MPC_TYPE_SATISFY   = 13,
-    MPC_TYPE_STRING    = 14,
-
-    MPC_TYPE_APPLY     = 15,
-    MPC_TYPE_APPLY_TO  = 16,
-    MPC_TYPE_PREDICT   = 17,
-    MPC_TYPE_NOT       = 18,
-    MPC_TYPE_MAYBE     = 19,
-    MPC_TYPE_MANY      = 20,
-    MPC_TYPE_MANY1     = 21,
-    MPC_TYPE_COUNT     = 22,
-
-    MPC_TYPE_OR        = 23,
-    MPC_TYPE_AND       = 24
+    MPC_TYPE_CLASS     = 10,
+    MPC_TYPE_SATISFY   = 11,
+    MPC_TYPE_STRING    = 12,
+
+    MPC_TYPE_APPLY     = 13,
+    MPC_TYPE_APPLY_TO  = 14,
+    MPC_TYPE_PREDICT   = 15,
+    MPC_TYPE_NOT       = 16,
+    MPC_TYPE_MAYBE     = 17,
+    MPC_TYPE_MANY      = 18,
+    MPC_TYPE_MANY1     = 19,
+    MPC_TYPE_COUNT     = 20,
+
+    MPC_TYPE_OR        = 21,
+    MPC_TYPE_AND       = 22,
+
+    MPC_TYPE_MEMO      = 23,
+    MPC_TYPE_DFA       = 24,
+    MPC_TYPE_COMMIT    = 25
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -692,7 +1086,7 @@ typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
 typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { unsigned char x[32]; int n; unsigned char lo[4]; unsigned char width[4]; int stops; unsigned char stop[2]; } mpc_pdata_class_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
 typedef struct { char *x; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
@@ -700,8 +1094,10 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned long *table; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t c; mpc_dtor_t dx; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; struct mpc_dfa_t *d; } mpc_pdata_dfa_t;
 
 typedef union {
     mpc_pdata_fail_t fail;
@@ -709,7 +1105,7 @@ typedef union {
     mpc_pdata_expect_t expect;
     mpc_pdata_anchor_t anchor;
     mpc_pdata_single_t single;
-    mpc_pdata_range_t range;
+    mpc_pdata_class_t class;
     mpc_pdata_satisfy_t satisfy;
     mpc_pdata_string_t string;
     mpc_pdata_apply_t apply;
@@ -719,2474 +1115,7485 @@ typedef union {
     mpc_pdata_repeat_t repeat;
     mpc_pdata_and_t and;
     mpc_pdata_or_t or;
+    mpc_pdata_memo_t memo;
+    mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
+struct mpc_prog_t;
+
+#ifdef MPC_PROFILE
+
+/*
+ ** Profile counts are kept per parser in a table
+ ** which only grows, so entries can be held by
+ ** index while a parse runs. The index maps each
+ ** parser to its entry, and is rebuilt twice as
+ ** large whenever it is half full.
+ */
+
+typedef struct mpc_profile_entry_t {
+    mpc_parser_t *parser;
+    unsigned long calls;
+    unsigned long successes;
+    unsigned long failures;
+    unsigned long backtracks;
+    unsigned long bytes;
+    double cycles;
+    int active;
+} mpc_profile_entry_t;
+
+struct mpc_profile_t {
+    int entries_num;
+    int entries_slots;
+    mpc_profile_entry_t *entries;
+    int index_slots;
+    int *index;
+};
+
+static int mpc_profile_slot(mpc_profile_t *r, mpc_parser_t *p) {
+    int j = (int)(((size_t)p >> 4) * 2654435761u) & (r->index_slots - 1);
+    while (r->index[j] >= 0 && r->entries[r->index[j]].parser != p) {
+        j = (j + 1) & (r->index_slots - 1);
+    }
+    return j;
+}
+
+static int mpc_profile_entry(mpc_profile_t *r, mpc_parser_t *p) {
+
+    int j;
+
+    if (r->entries_num * 2 >= r->index_slots) {
+        free(r->index);
+        r->index_slots = r->index_slots ? r->index_slots * 2 : 64;
+        r->index = malloc(sizeof(int) * r->index_slots);
+        for (j = 0; j < r->index_slots; j++) { r->index[j] = -1; }
+        for (j = 0; j < r->entries_num; j++) {
+            r->index[mpc_profile_slot(r, r->entries[j].parser)] = j;
+        }
+    }
+
+    j = mpc_profile_slot(r, p);
+    if (r->index[j] >= 0) { return r->index[j]; }
+
+    if (r->entries_num == r->entries_slots) {
+        r->entries_slots = r->entries_slots ? r->entries_slots * 2 : 32;
+        r->entries = realloc(r->entries, sizeof(mpc_profile_entry_t) * r->entries_slots);
+    }
+
+    memset(&r->entries[r->entries_num], 0, sizeof(mpc_profile_entry_t));
+    r->entries[r->entries_num].parser = p;
+    r->index[j] = r->entries_num;
+    return r->entries_num++;
+}
+
+#endif
+
 struct mpc_parser_t {
     char retained;
     char *name;
     char type;
+    char span;
     mpc_pdata_t data;
+    struct mpc_prog_t *prog;
 };
 
 /*
- ** Stack Type
+ ** Character Classes
+ **
+ ** `oneof`, `noneof` and `range` all build a class
+ ** holding a bitmap of the bytes it accepts. Most
+ ** classes are made of a few ranges of bytes, and
+ ** these are also kept so long runs of the class
+ ** can be matched many bytes at a time. Classes
+ ** missing only one or two bytes, such as the rest
+ ** of a line or the body of a string, also keep
+ ** those bytes so a run can just look for them.
  */
 
-typedef struct {
+static int mpc_set_has(const unsigned char *x, int c) { return (x[c >> 3] >> (c & 7)) & 1; }
+static void mpc_set_add(unsigned char *x, int c) { x[c >> 3] |= (unsigned char)(1 << (c & 7)); }
 
-    int parsers_num;
-    int parsers_slots;
-    mpc_parser_t **parsers;
-    int *states;
+static void mpc_class_ranges(mpc_pdata_class_t *c) {
 
-    int results_num;
-    int results_slots;
-    mpc_result_t *results;
-    int *returns;
+    int j, k;
 
-    mpc_err_t *err;
+    c->stops = 0;
 
-} mpc_stack_t;
+    for (j = 0; j < 256; j++) {
+        if (mpc_set_has(c->x, j)) { continue; }
+        if (c->stops == 2) { c->stops = -1; break; }
+        c->stop[c->stops++] = (unsigned char)j;
+    }
 
-static mpc_stack_t *mpc_stack_new(const char *filename) {
-    mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+    c->n = 0;
 
-    s->parsers_num = 0;
-    s->parsers_slots = 0;
-    s->parsers = NULL;
-    s->states = NULL;
+    for (j = 0; j < 256; j = k) {
+        if (!mpc_set_has(c->x, j)) { k = j+1; continue; }
+        for (k = j; k < 256 && mpc_set_has(c->x, k); k++);
+        if (c->n == 4) { c->n = 0; return; }
+        c->lo[c->n] = (unsigned char)j;
+        c->width[c->n] = (unsigned char)(k-1-j);
+        c->n++;
+    }
+}
 
-    s->results_num = 0;
-    s->results_slots = 0;
-    s->results = NULL;
-    s->returns = NULL;
+/*
+ ** Returns how many of the first `n` bytes of `s`
+ ** are not one of the `stops` bytes of `stop`. One
+ ** byte is left to `memchr`, and two are compared
+ ** sixteen bytes at a time with SSE2.
+ */
 
-    s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+static int mpc_stops_run(const unsigned char *stop, int stops, const char *s, int n) {
 
-    return s;
-}
+    const char *e;
+    int j = 0;
 
-static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
-    mpc_err_t *errs[2];
-    errs[0] = s->err;
-    errs[1] = e;
-    s->err = mpc_err_or(errs, 2);
-}
+#ifdef MPC_SSE2
+    int mask;
+    __m128i v, a, b;
+#endif
 
-static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
-    int success = s->returns[0];
+    if (stops == 0) { return n; }
 
-    if (success) {
-        r->output = s->results[0].output;
-        mpc_err_delete(s->err);
-    } else {
-        mpc_stack_err(s, s->results[0].error);
-        r->error = s->err;
+    if (stops == 1) {
+        e = memchr(s, stop[0], n);
+        return e ? (int)(e - s) : n;
     }
 
-    free(s->parsers);
-    free(s->states);
-    free(s->results);
-    free(s->returns);
-    free(s);
+#ifdef MPC_SSE2
+    a = _mm_set1_epi8((char)stop[0]);
+    b = _mm_set1_epi8((char)stop[1]);
+    for (; j + 16 <= n; j += 16) {
+        v = _mm_loadu_si128((const __m128i*)(s + j));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)));
+        if (mask) {
+            while (!(mask & 1)) { mask >>= 1; j++; }
+            return j;
+        }
+    }
+#endif
 
-    return success;
+    while (j < n && (unsigned char)s[j] != stop[0] && (unsigned char)s[j] != stop[1]) { j++; }
+    return j;
 }
 
-/* Stack Parser Stuff */
+/*
+ ** Returns how many of the first `n` bytes of `s`
+ ** are in the class, also stopping at the byte
+ ** `stop` unless it is negative. With SSE2, each
+ ** range check is a wrapping subtract of the lower
+ ** bound followed by an unsigned compare with the
+ ** width.
+ */
 
-static void mpc_stack_set_state(mpc_stack_t *s, int x) {
-    s->states[s->parsers_num-1] = x;
-}
+static int mpc_class_run(const mpc_pdata_class_t *c, int stop, const char *s, int n) {
 
-static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
-    if (s->parsers_num > s->parsers_slots) {
-        s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-        s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-        s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-    }
-}
+    unsigned char stops[2];
+    int j = 0;
 
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-    if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-        s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
-        s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-        s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-    }
-}
+#ifdef MPC_SSE2
+    int k, mask;
+    __m128i v, d, m;
+#endif
 
-static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
-    s->parsers_num++;
-    mpc_stack_parsers_reserve_more(s);
-    s->parsers[s->parsers_num-1] = p;
-    s->states[s->parsers_num-1] = 0;
-}
+    if (stop >= 0 && !mpc_set_has(c->x, stop)) { stop = -1; }
 
-static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-    *p = s->parsers[s->parsers_num-1];
-    *st = s->states[s->parsers_num-1];
-    s->parsers_num--;
-    mpc_stack_parsers_reserve_less(s);
-}
+    if (c->stops >= 0 && c->stops + (stop >= 0) <= 2) {
+        memcpy(stops, c->stop, c->stops);
+        if (stop >= 0) { stops[c->stops] = (unsigned char)stop; }
+        return mpc_stops_run(stops, c->stops + (stop >= 0), s, n);
+    }
 
-static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
-    *p = s->parsers[s->parsers_num-1];
-    *st = s->states[s->parsers_num-1];
-}
+#ifdef MPC_SSE2
+    if (c->n > 0) {
+        for (; j + 16 <= n; j += 16) {
+            v = _mm_loadu_si128((const __m128i*)(s + j));
+            m = _mm_setzero_si128();
+            for (k = 0; k < c->n; k++) {
+                d = _mm_sub_epi8(v, _mm_set1_epi8((char)c->lo[k]));
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8((char)c->width[k])), d));
+            }
+            if (stop >= 0) { m = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)stop)), m); }
+            mask = _mm_movemask_epi8(m);
+            if (mask != 0xFFFF) {
+                while (mask & 1) { mask >>= 1; j++; }
+                return j;
+            }
+        }
+    }
+#endif
 
-static int mpc_stack_empty(mpc_stack_t *s) {
-    return s->parsers_num == 0;
+    while (j < n && mpc_set_has(c->x, (unsigned char)s[j]) && (unsigned char)s[j] != stop) { j++; }
+    return j;
 }
 
-/* Stack Result Stuff */
+/*
+ ** The body of a string is `many` of an escape or
+ ** a class, as built by `mpc_string_lit`. Runs of
+ ** the class are skipped up to the next backslash,
+ ** and a backslash with a byte after it is skipped
+ ** as an escape. A backslash ending the input is
+ ** left where it is, for the parser to match.
+ */
 
-static mpc_result_t mpc_result_err(mpc_err_t *e) {
-    mpc_result_t r;
-    r.error = e;
-    return r;
-}
+static int mpc_escaped_run(const mpc_pdata_class_t *c, const char *s, int n) {
 
-static mpc_result_t mpc_result_out(mpc_val_t *x) {
-    mpc_result_t r;
-    r.output = x;
-    return r;
-}
+    int j = 0;
 
-static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
-    if (s->results_num > s->results_slots) {
-        s->results_slots = ceil((s->results_slots + 1) * 1.5);
-        s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-        s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+    for (;;) {
+        j += mpc_class_run(c, '\\', s + j, n - j);
+        if (j + 1 < n && s[j] == '\\') { j += 2; continue; }
+        return j;
     }
 }
 
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-    if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-        s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
-        s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-        s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-    }
+static mpc_parser_t *mpc_class_of(mpc_parser_t *x) {
+    if (x->type == MPC_TYPE_EXPECT) { x = x->data.expect.x; }
+    return x->type == MPC_TYPE_CLASS ? x : NULL;
 }
 
-static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
-    s->results_num++;
-    mpc_stack_results_reserve_more(s);
-    s->results[s->results_num-1] = x;
-    s->returns[s->results_num-1] = r;
+static mpc_parser_t *mpc_unexpected(mpc_parser_t *x) {
+    if (x->type == MPC_TYPE_EXPECT && !x->retained) { x = x->data.expect.x; }
+    return x->retained ? NULL : x;
 }
 
-static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
-    int r;
-    *x = s->results[s->results_num-1];
-    r = s->returns[s->results_num-1];
-    s->results_num--;
-    mpc_stack_results_reserve_less(s);
-    return r;
-}
+static mpc_parser_t *mpc_escaped_of(mpc_parser_t *x) {
 
-static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
-    *x = s->results[s->results_num-1];
-    return s->returns[s->results_num-1];
-}
+    mpc_parser_t *e, *c;
 
-static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
-    mpc_result_t x;
-    while (n) {
-        mpc_stack_popr(s, &x);
-        mpc_stack_err(s, x.error);
-        n--;
-    }
-}
+    if ((x = mpc_unexpected(x)) == NULL) { return NULL; }
+    if (x->type != MPC_TYPE_OR || x->data.or.n != 2) { return NULL; }
 
-static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
-    mpc_result_t x;
-    while (n) {
-        mpc_stack_popr(s, &x);
-        ds[n-1](x.output);
-        n--;
-    }
-}
+    e = mpc_unexpected(x->data.or.xs[0]);
+    c = mpc_unexpected(x->data.or.xs[1]);
 
-static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
-    mpc_result_t x;
-    while (n) {
-        mpc_stack_popr(s, &x);
-        dx(x.output);
-        n--;
-    }
-}
+    if (e == NULL || c == NULL || e->type != MPC_TYPE_AND || e->data.and.n != 2) { return NULL; }
+    if (c->type != MPC_TYPE_CLASS) { return NULL; }
 
-static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
-    mpc_result_t x;
-    while (n) {
-        mpc_stack_popr(s, &x);
-        n--;
-    }
-}
+    x = mpc_unexpected(e->data.and.xs[0]);
+    e = mpc_unexpected(e->data.and.xs[1]);
 
-static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
-    mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
-    mpc_stack_popr_n(s, n);
-    return x;
-}
+    if (x == NULL || x->type != MPC_TYPE_SINGLE || x->data.single.x != '\\') { return NULL; }
+    if (e == NULL || e->type != MPC_TYPE_ANY) { return NULL; }
 
-static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
-    mpc_err_t *x = mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
-    mpc_stack_popr_n(s, n);
-    return x;
+    return c;
 }
 
 /*
- ** This is rather pleasant. The core parsing routine
- ** is written in about 200 lines of C.
+ ** Regex DFA
  **
- ** I also love the way in which each parsing type
- ** concisely matches some construct or pattern.
- **
- ** Particularly nice are the `or` and `and`
- ** types which have a broken but mirrored structure
- ** with return value and error reflected.
+ ** Regular expressions are built from ordinary
+ ** combinators, which match one character at a
+ ** time through the parsing machine. Where it is
+ ** safe, `mpc_re` also compiles the combinators
+ ** into an NFA which is turned into a DFA when
+ ** the regex is built, so matching only reads the
+ ** tables. The DFA scans the input directly and
+ ** finds the longest prefix in the language of
+ ** the regex.
  **
- ** When this function was written in recursive form
- ** it looked pretty nice. But I've since switched
- ** it around to an awkward while loop. It was an
- ** unfortunate change for code simplicity but it
- ** is noble in the name of performance (and 
- ** not smashing the stack).
+ ** The combinators do not search for the longest
+ ** match. `or` takes its first alternative that
+ ** succeeds and `many` never gives back what it
+ ** has consumed. For LL(1) regexes the two agree,
+ ** so the DFA is only built when every choice can
+ ** be made from the next character alone, and
+ ** when it fails the combinators are run instead
+ ** so the error is exactly the usual one. `count`
+ ** also insists the repeat after the last one
+ ** fails, which a DFA cannot look for, so regexes
+ ** using `{n}` are always run as combinators.
+ ** Under `mpc_predictive` a failed sequence does
+ ** not give back what it consumed either, so the
+ ** DFA is only used while backtracking is on.
  **
- ** But it is now a pretty ugly beast...
+ ** Every state is built up front rather than as a
+ ** match first needs it, so a regex never changes
+ ** once made and threads can share it. This costs
+ ** time and a 1KB row of transitions per state
+ ** when the regex is made, even for states no
+ ** input ever reaches. To keep that bounded a DFA
+ ** has at most `MPC_DFA_MAX_STATES` states. Past
+ ** that the rest are left out, and a match which
+ ** reaches one quietly falls back to the slower
+ ** combinators, with the same result.
  */
 
-#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
-#define MPC_SUCCESS(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
-#define MPC_FAILURE(x) mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(x), 0); continue
-#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+enum {
+    MPC_NFA_SPLIT  = -1,
+    MPC_NFA_ACCEPT = -2,
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+    MPC_DFA_UNKNOWN = -2,
+    MPC_DFA_DEAD    = -1,
 
-    /* Stack */
-    int st = 0;
-    mpc_parser_t *p = NULL;
-    mpc_stack_t *stk = mpc_stack_new(i->filename);
+    MPC_DFA_MAX_STATES = 1024
+};
 
-    /* Variables */
-    char *s;
-    mpc_result_t r;
+typedef struct {
+    int cls;
+    int out0;
+    int out1;
+} mpc_nfa_state_t;
 
-    /* Go! */
-    mpc_stack_pushp(stk, init);
+typedef struct mpc_dfa_t {
 
-    while (!mpc_stack_empty(stk)) {
+    int nfa_num;
+    mpc_nfa_state_t *nfa;
+    int classes_num;
+    unsigned char (*classes)[32];
+    int start;
 
-        mpc_stack_peepp(stk, &p, &st);
+    int states_num;
+    int *trans;
+    char *accept;
 
-        switch (p->type) {
+    /* Only used while the states are built */
+    int *sets_num;
+    int **sets;
+    int *stack;
+    char *seen;
 
-            /* Basic Parsers */
+} mpc_dfa_t;
 
-            case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, &s));
-            case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, &s));
-            case MPC_TYPE_RANGE:     MPC_PRIMATIVE(s, mpc_input_range(i, p->data.range.x, p->data.range.y, &s));
-            case MPC_TYPE_ONEOF:     MPC_PRIMATIVE(s, mpc_input_oneof(i, p->data.string.x, &s));
-            case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
-            case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
-            case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
 
-                                     /* Other parsers */
+static void mpc_set_union(unsigned char *x, const unsigned char *y) {
+    int j;
+    for (j = 0; j < 32; j++) { x[j] |= y[j]; }
+}
 
-            case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
-            case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-            case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
-            case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-            case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-            case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(i->state));
+static int mpc_set_disjoint(const unsigned char *x, const unsigned char *y) {
+    int j;
+    for (j = 0; j < 32; j++) { if (x[j] & y[j]) { return 0; } }
+    return 1;
+}
 
-            case MPC_TYPE_ANCHOR:
-                                     if (mpc_input_anchor(i, p->data.anchor.f)) {
-                                         MPC_SUCCESS(NULL);
-                                     } else {
-                                         MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
-                                     }
+/*
+ ** Fills `set` with the bytes a single character
+ ** parser accepts. Returns zero for anything else.
+ */
 
-                                     /* Application Parsers */
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *set) {
 
-            case MPC_TYPE_EXPECT:
-                                     if (st == 0) { MPC_CONTINUE(1, p->data.expect.x); }
-                                     if (st == 1) {
-                                         if (mpc_stack_popr(stk, &r)) {
-                                             MPC_SUCCESS(r.output);
-                                         } else {
-                                             mpc_err_delete(r.error); 
-                                             MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
-                                         }
-                                     }
+    switch (p->type) {
+        case MPC_TYPE_ANY:    memset(set, 0xFF, 32); return 1;
+        case MPC_TYPE_CLASS:  memcpy(set, p->data.class.x, 32); return 1;
+        case MPC_TYPE_SINGLE:
+            memset(set, 0, 32);
+            mpc_set_add(set, (unsigned char)p->data.single.x);
+            return 1;
+        default: return 0;
+    }
+}
 
-            case MPC_TYPE_APPLY:
-                                     if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
-                                     if (st == 1) {
-                                         if (mpc_stack_popr(stk, &r)) {
-                                             MPC_SUCCESS(p->data.apply.f(r.output));
-                                         } else {
-                                             MPC_FAILURE(r.error);
-                                         }
-                                     }
+/*
+ ** Computes FIRST and whether `p` can match the
+ ** empty string. Returns zero if `p` contains
+ ** anything the DFA cannot represent.
+ */
 
-            case MPC_TYPE_APPLY_TO:
-                                     if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
-                                     if (st == 1) {
-                                         if (mpc_stack_popr(stk, &r)) {
-                                             MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
-                                         } else {
-                                             MPC_FAILURE(r.error);
-                                         }
-                                     }
+static int mpc_dfa_first(mpc_parser_t *p, unsigned char *first, int *nullable) {
 
-            case MPC_TYPE_PREDICT:
-                                     if (st == 0) { mpc_input_backtrack_disable(i); MPC_CONTINUE(1, p->data.predict.x); }
-                                     if (st == 1) {
-                                         mpc_input_backtrack_enable(i);
-                                         mpc_stack_popp(stk, &p, &st);
-                                         continue;
-                                     }
+    unsigned char x[32];
+    int j, n;
 
-                                     /* Optional Parsers */
+    memset(first, 0, 32);
+    *nullable = 0;
 
-                                     /* TODO: Update Not Error Message */
+    switch (p->type) {
 
-            case MPC_TYPE_NOT:
-                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.not.x); }
-                                     if (st == 1) {
-                                         if (mpc_stack_popr(stk, &r)) {
-                                             mpc_input_rewind(i);
-                                             p->data.not.dx(r.output);
-                                             MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
-                                         } else {
-                                             mpc_input_unmark(i);
-                                             mpc_stack_err(stk, r.error);
-                                             MPC_SUCCESS(p->data.not.lf());
-                                         }
-                                     }
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_CLASS:
+            return mpc_dfa_class(p, first);
 
-            case MPC_TYPE_MAYBE:
-                                     if (st == 0) { MPC_CONTINUE(1, p->data.not.x); }
-                                     if (st == 1) {
-                                         if (mpc_stack_popr(stk, &r)) {
-                                             MPC_SUCCESS(r.output);
-                                         } else {
-                                             mpc_stack_err(stk, r.error);
-                                             MPC_SUCCESS(p->data.not.lf());
-                                         }
-                                     }
+        case MPC_TYPE_STRING:
+            if (p->data.string.x[0] == '\0') { *nullable = 1; return 1; }
+            mpc_set_add(first, (unsigned char)p->data.string.x[0]);
+            return 1;
 
-                                     /* Repeat Parsers */
+        case MPC_TYPE_LIFT:
+            *nullable = 1;
+            return p->data.lift.lf == mpcf_ctor_str;
 
-            case MPC_TYPE_MANY:
-                                     if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
-                                     if (st >  0) {
-                                         if (mpc_stack_peekr(stk, &r)) {
-                                             MPC_CONTINUE(st+1, p->data.repeat.x);
-                                         } else {
-                                             mpc_stack_popr(stk, &r);
-                                             mpc_stack_err(stk, r.error);
-                                             MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
-                                         }
-                                     }
+        case MPC_TYPE_EXPECT:
+            return mpc_dfa_first(p->data.expect.x, first, nullable);
 
-            case MPC_TYPE_MANY1:
-                                     if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
-                                     if (st >  0) {
-                                         if (mpc_stack_peekr(stk, &r)) {
-                                             MPC_CONTINUE(st+1, p->data.repeat.x);
-                                         } else {
-                                             if (st == 1) {
-                                                 mpc_stack_popr(stk, &r);
-                                                 MPC_FAILURE(mpc_err_many1(r.error));
-                                             } else {
-                                                 mpc_stack_popr(stk, &r);
-                                                 mpc_stack_err(stk, r.error);
-                                                 MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
-                                             }
-                                         }
-                                     }
-
-            case MPC_TYPE_COUNT:
-                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.repeat.x); }
-                                     if (st >  0) {
-                                         if (mpc_stack_peekr(stk, &r)) {
-                                             MPC_CONTINUE(st+1, p->data.repeat.x);
-                                         } else {
-                                             if (st != (p->data.repeat.n+1)) {
-                                                 mpc_stack_popr(stk, &r);
-                                                 mpc_stack_popr_out_single(stk, st-1, p->data.repeat.dx);
-                                                 mpc_input_rewind(i);
-                                                 MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
-                                             } else {
-                                                 mpc_stack_popr(stk, &r);
-                                                 mpc_stack_err(stk, r.error);
-                                                 mpc_input_unmark(i);
-                                                 MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, p->data.repeat.f));
-                                             }
-                                         }
-                                     }
+        case MPC_TYPE_MAYBE:
+            *nullable = 1;
+            return mpc_dfa_first(p->data.not.x, first, &n);
 
-                                     /* Combinatory Parsers */
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+            if (!mpc_dfa_first(p->data.repeat.x, first, nullable)) { return 0; }
+            if (p->type == MPC_TYPE_MANY) { *nullable = 1; }
+            return 1;
 
-            case MPC_TYPE_OR:
+        case MPC_TYPE_OR:
+            for (j = 0; j < p->data.or.n; j++) {
+                if (!mpc_dfa_first(p->data.or.xs[j], x, &n)) { return 0; }
+                mpc_set_union(first, x);
+                *nullable = *nullable || n;
+            }
+            return 1;
 
-                                     if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+        case MPC_TYPE_AND:
+            *nullable = 1;
+            for (j = 0; j < p->data.and.n; j++) {
+                if (!mpc_dfa_first(p->data.and.xs[j], x, &n)) { return 0; }
+                if (*nullable) { mpc_set_union(first, x); }
+                *nullable = *nullable && n;
+            }
+            return 1;
 
-                                     if (st == 0) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-                                     if (st <= p->data.or.n) {
-                                         if (mpc_stack_peekr(stk, &r)) {
-                                             mpc_stack_popr(stk, &r);
-                                             mpc_stack_popr_err(stk, st-1);
-                                             MPC_SUCCESS(r.output);
-                                         }
-                                         if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
-                                         if (st == p->data.or.n) { MPC_FAILURE(mpc_stack_merger_err(stk, p->data.or.n)); }
-                                     }
+        default: return 0;
+    }
+}
 
-            case MPC_TYPE_AND:
+/*
+ ** Checks the LL(1) conditions given what may
+ ** follow `p`. Nothing follows the regex as a
+ ** whole, since it matches a prefix and any
+ ** character may come after.
+ */
 
-                                     if (p->data.or.n == 0) { MPC_SUCCESS(p->data.and.f(0, NULL)); }
+static int mpc_dfa_ll1(mpc_parser_t *p, const unsigned char *follow) {
 
-                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-                                     if (st <= p->data.and.n) {
-                                         if (!mpc_stack_peekr(stk, &r)) {
-                                             mpc_input_rewind(i);
-                                             mpc_stack_popr(stk, &r);
-                                             mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
-                                             MPC_FAILURE(r.error);
-                                         }
-                                         if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
-                                         if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, p->data.and.f)); }
-                                     }
+    unsigned char first[32], x[32], y[32];
+    int j, k, n, nullable;
 
-                                     /* End */
+    if (!mpc_dfa_first(p, first, &nullable)) { return 0; }
 
-            default:
+    switch (p->type) {
 
-                                     MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
-        }
-    }
+        case MPC_TYPE_EXPECT:
+            return mpc_dfa_ll1(p->data.expect.x, follow);
 
-    return mpc_stack_terminate(stk, final);
+        case MPC_TYPE_MAYBE:
+            mpc_dfa_first(p->data.not.x, x, &n);
+            if (!mpc_set_disjoint(x, follow)) { return 0; }
+            return mpc_dfa_ll1(p->data.not.x, follow);
 
-}
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+            mpc_dfa_first(p->data.repeat.x, x, &n);
+            if (n || !mpc_set_disjoint(x, follow)) { return 0; }
+            memcpy(y, follow, 32);
+            mpc_set_union(y, x);
+            return mpc_dfa_ll1(p->data.repeat.x, y);
+
+        case MPC_TYPE_OR:
+            for (j = 0; j < p->data.or.n; j++) {
+                mpc_dfa_first(p->data.or.xs[j], x, &n);
+                if (n && j != p->data.or.n-1) { return 0; }
+                if (n && !mpc_set_disjoint(first, follow)) { return 0; }
+                for (k = j+1; k < p->data.or.n; k++) {
+                    mpc_dfa_first(p->data.or.xs[k], y, &n);
+                    if (!mpc_set_disjoint(x, y)) { return 0; }
+                }
+                if (!mpc_dfa_ll1(p->data.or.xs[j], follow)) { return 0; }
+            }
+            return 1;
 
-#undef MPC_CONTINUE
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMATIVE
+        case MPC_TYPE_AND:
+            for (j = 0; j < p->data.and.n; j++) {
+                memset(y, 0, 32);
+                n = 1;
+                for (k = j+1; k < p->data.and.n && n; k++) {
+                    mpc_dfa_first(p->data.and.xs[k], x, &n);
+                    mpc_set_union(y, x);
+                }
+                if (n) { mpc_set_union(y, follow); }
+                if (!mpc_dfa_ll1(p->data.and.xs[j], y)) { return 0; }
+            }
+            return 1;
 
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_string(filename, string);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
+        default: return 1;
+    }
 }
 
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_file(filename, file);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
+static int mpc_nfa_state(mpc_dfa_t *d, int cls, int out0, int out1) {
+    d->nfa = realloc(d->nfa, sizeof(mpc_nfa_state_t) * (d->nfa_num + 1));
+    d->nfa[d->nfa_num].cls = cls;
+    d->nfa[d->nfa_num].out0 = out0;
+    d->nfa[d->nfa_num].out1 = out1;
+    return d->nfa_num++;
 }
 
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-    int x;
-    mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-    x = mpc_parse_input(i, p, r);
-    mpc_input_delete(i);
-    return x;
+static int mpc_nfa_class(mpc_dfa_t *d, const unsigned char *set) {
+    int j;
+    for (j = 0; j < d->classes_num; j++) {
+        if (memcmp(d->classes[j], set, 32) == 0) { return j; }
+    }
+    d->classes = realloc(d->classes, sizeof(*d->classes) * (d->classes_num + 1));
+    memcpy(d->classes[d->classes_num], set, 32);
+    return d->classes_num++;
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+/*
+ ** Compiles `p` backwards, returning the state
+ ** which matches `p` and then continues at `next`.
+ */
 
-    FILE *f = fopen(filename, "rb");
-    int res;
+static int mpc_nfa_compile(mpc_dfa_t *d, mpc_parser_t *p, int next) {
 
-    if (f == NULL) {
-        r->output = NULL;
-        r->error = mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
-        return 0;
-    }
+    unsigned char set[32];
+    int j, s;
 
-    res = mpc_parse_file(filename, f, p, r);
-    fclose(f);
-    return res;
+    switch (p->type) {
+
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_CLASS:
+            mpc_dfa_class(p, set);
+            return mpc_nfa_state(d, mpc_nfa_class(d, set), next, -1);
+
+        case MPC_TYPE_STRING:
+            for (j = strlen(p->data.string.x) - 1; j >= 0; j--) {
+                memset(set, 0, 32);
+                mpc_set_add(set, (unsigned char)p->data.string.x[j]);
+                next = mpc_nfa_state(d, mpc_nfa_class(d, set), next, -1);
+            }
+            return next;
+
+        case MPC_TYPE_EXPECT: return mpc_nfa_compile(d, p->data.expect.x, next);
+        case MPC_TYPE_MAYBE:  return mpc_nfa_state(d, MPC_NFA_SPLIT, mpc_nfa_compile(d, p->data.not.x, next), next);
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+            s = mpc_nfa_state(d, MPC_NFA_SPLIT, -1, next);
+            j = mpc_nfa_compile(d, p->data.repeat.x, s);
+            d->nfa[s].out0 = j;
+            return p->type == MPC_TYPE_MANY ? s : j;
+
+        case MPC_TYPE_OR:
+            s = mpc_nfa_compile(d, p->data.or.xs[p->data.or.n-1], next);
+            for (j = p->data.or.n-2; j >= 0; j--) {
+                s = mpc_nfa_state(d, MPC_NFA_SPLIT, mpc_nfa_compile(d, p->data.or.xs[j], next), s);
+            }
+            return s;
+
+        case MPC_TYPE_AND:
+            for (j = p->data.and.n-1; j >= 0; j--) {
+                next = mpc_nfa_compile(d, p->data.and.xs[j], next);
+            }
+            return next;
+
+        default: return next;
+    }
 }
 
 /*
- ** Building a Parser
+ ** Adds the states reachable from `s` without
+ ** consuming input to the set being built on
+ ** `d->stack`. Sets are kept sorted so equal sets
+ ** compare equal.
  */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_dfa_closure(mpc_dfa_t *d, int s, int *num) {
 
-static void mpc_undefine_or(mpc_parser_t *p) {
+    int j, t;
 
-    int i;
-    for (i = 0; i < p->data.or.n; i++) {
-        mpc_undefine_unretained(p->data.or.xs[i], 0);
+    if (s < 0 || d->seen[s]) { return; }
+    d->seen[s] = 1;
+
+    if (d->nfa[s].cls == MPC_NFA_SPLIT) {
+        mpc_dfa_closure(d, d->nfa[s].out0, num);
+        mpc_dfa_closure(d, d->nfa[s].out1, num);
+        return;
     }
-    free(p->data.or.xs);
 
+    for (j = *num; j > 0 && d->stack[j-1] > s; j--) {
+        t = d->stack[j-1]; d->stack[j] = t;
+    }
+    d->stack[j] = s;
+    (*num)++;
 }
 
-static void mpc_undefine_and(mpc_parser_t *p) {
+static int mpc_dfa_state(mpc_dfa_t *d, int num) {
 
-    int i;
-    for (i = 0; i < p->data.and.n; i++) {
-        mpc_undefine_unretained(p->data.and.xs[i], 0);
+    int j;
+
+    memset(d->seen, 0, d->nfa_num);
+
+    for (j = 0; j < d->states_num; j++) {
+        if (d->sets_num[j] == num && memcmp(d->sets[j], d->stack, sizeof(int) * num) == 0) { return j; }
     }
-    free(p->data.and.xs);
-    free(p->data.and.dxs);
 
-}
+    if (num == 0) { return MPC_DFA_DEAD; }
+    if (d->states_num == MPC_DFA_MAX_STATES) { return MPC_DFA_UNKNOWN; }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+    d->states_num++;
+    d->trans = realloc(d->trans, sizeof(int) * 256 * d->states_num);
+    d->accept = realloc(d->accept, d->states_num);
+    d->sets_num = realloc(d->sets_num, sizeof(int) * d->states_num);
+    d->sets = realloc(d->sets, sizeof(int*) * d->states_num);
 
-    if (p->retained && !force) { return; }
+    for (j = 0; j < 256; j++) { d->trans[(d->states_num-1) * 256 + j] = MPC_DFA_UNKNOWN; }
+    d->accept[d->states_num-1] = 0;
+    for (j = 0; j < num; j++) {
+        if (d->nfa[d->stack[j]].cls == MPC_NFA_ACCEPT) { d->accept[d->states_num-1] = 1; }
+    }
+    d->sets_num[d->states_num-1] = num;
+    d->sets[d->states_num-1] = malloc(sizeof(int) * num);
+    memcpy(d->sets[d->states_num-1], d->stack, sizeof(int) * num);
 
-    switch (p->type) {
+    return d->states_num-1;
+}
 
-        case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+static int mpc_dfa_step(mpc_dfa_t *d, int state, unsigned char c) {
 
-        case MPC_TYPE_ONEOF: 
-        case MPC_TYPE_NONEOF:
-        case MPC_TYPE_STRING:
-                            free(p->data.string.x); 
-                            break;
+    int j, s, num = 0;
+    int *set = d->sets[state];
 
-        case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-        case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-        case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    for (j = 0; j < d->sets_num[state]; j++) {
+        s = set[j];
+        if (d->nfa[s].cls >= 0 && mpc_set_has(d->classes[d->nfa[s].cls], c)) {
+            mpc_dfa_closure(d, d->nfa[s].out0, &num);
+        }
+    }
 
-        case MPC_TYPE_MAYBE:
-        case MPC_TYPE_NOT:
-                                mpc_undefine_unretained(p->data.not.x, 0);
-                                break;
+    s = mpc_dfa_state(d, num);
+    if (s != MPC_DFA_UNKNOWN) { d->trans[state * 256 + c] = s; }
+    return s;
+}
 
-        case MPC_TYPE_EXPECT:
-                                mpc_undefine_unretained(p->data.expect.x, 0);
-                                free(p->data.expect.m);
-                                break;
+/*
+ ** Builds every state reachable from the start
+ ** state, so a match never changes the DFA and
+ ** one regex can be used by many threads at once.
+ ** Characters in exactly the same classes always
+ ** step alike, so one of each kind is stepped and
+ ** the rest copy its transitions. If there are
+ ** too many states the missing ones stay unknown
+ ** and matches reaching them fall back to the
+ ** combinators.
+ */
 
-        case MPC_TYPE_MANY:
-        case MPC_TYPE_MANY1:
-        case MPC_TYPE_COUNT:
-                                mpc_undefine_unretained(p->data.repeat.x, 0);
-                                break;
+static void mpc_dfa_build(mpc_dfa_t *d) {
 
-        case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-        case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    int reps[256], kind[256];
+    int reps_num = 0;
+    int c, j, k, s;
 
-        default: break;
+    for (c = 0; c < 256; c++) {
+        for (j = 0; j < reps_num; j++) {
+            for (k = 0; k < d->classes_num; k++) {
+                if (mpc_set_has(d->classes[k], c) != mpc_set_has(d->classes[k], reps[j])) { break; }
+            }
+            if (k == d->classes_num) { break; }
+        }
+        if (j == reps_num) { reps[reps_num++] = c; }
+        kind[c] = j;
     }
 
-    if (!force) {
-        free(p->name);
-        free(p);
+    for (s = 0; s < d->states_num; s++) {
+        for (j = 0; j < reps_num; j++) { mpc_dfa_step(d, s, (unsigned char)reps[j]); }
+        for (c = 0; c < 256; c++) { d->trans[s * 256 + c] = d->trans[s * 256 + reps[kind[c]]]; }
     }
 
+    for (s = 0; s < d->states_num; s++) { free(d->sets[s]); }
+    free(d->sets);
+    free(d->sets_num);
+    free(d->stack);
+    free(d->seen);
+    d->sets = NULL;
+    d->sets_num = NULL;
+    d->stack = NULL;
+    d->seen = NULL;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-    if (p->retained) {
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *x) {
 
-        if (p->type != MPC_TYPE_UNDEFINED) {
-            mpc_undefine_unretained(p, 0);
-        } 
+    unsigned char follow[32];
+    int num = 0;
+    mpc_dfa_t *d;
 
-        free(p->name);
-        free(p);
+    memset(follow, 0, 32);
+    if (!x->span || !mpc_dfa_ll1(x, follow)) { return NULL; }
 
-    } else {
-        mpc_undefine_unretained(p, 0);  
-    }
-}
+    d = calloc(1, sizeof(mpc_dfa_t));
+    d->start = mpc_nfa_compile(d, x, mpc_nfa_state(d, MPC_NFA_ACCEPT, -1, -1));
+    d->stack = malloc(sizeof(int) * d->nfa_num);
+    d->seen = calloc(d->nfa_num, 1);
 
-static void mpc_soft_delete(mpc_val_t *x) {
-    mpc_undefine_unretained(x, 0);
-}
+    mpc_dfa_closure(d, d->start, &num);
+    mpc_dfa_state(d, num);
+    mpc_dfa_build(d);
 
-static mpc_parser_t *mpc_undefined(void) {
-    mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-    p->retained = 0;
-    p->type = MPC_TYPE_UNDEFINED;
-    p->name = NULL;
-    return p;
+    return d;
 }
 
-mpc_parser_t *mpc_new(const char *name) {
-    mpc_parser_t *p = mpc_undefined();
-    p->retained = 1;
-    p->name = realloc(p->name, strlen(name) + 1);
-    strcpy(p->name, name);
-    return p;
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+    free(d->accept);
+    free(d->trans);
+    free(d->classes);
+    free(d->nfa);
+    free(d);
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-    mpc_undefine_unretained(p, 1);
-    p->type = MPC_TYPE_UNDEFINED;
-    return p;
-}
+/*
+ ** Finds the longest match of `d` in `s`. Returns
+ ** its length, or -1 if there is none. `scan` is
+ ** set to how far the input had to be read, which
+ ** bounds where the combinators would have put
+ ** any errors along the way.
+ */
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+static int mpc_dfa_match(const mpc_dfa_t *d, const char *s, int len, int *scan) {
 
-    if (p->retained) {
-        p->type = a->type;
-        p->data = a->data;
-    } else {
-        mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-        p->type = a2->type;
-        p->data = a2->data;
-        free(a2);
+    int j, t, state = 0;
+    int match = d->accept[0] ? 0 : -1;
+
+    for (j = 0; j < len; j++) {
+        t = d->trans[state * 256 + (unsigned char)s[j]];
+        if (t == MPC_DFA_UNKNOWN) { *scan = len; return -1; }
+        if (t == MPC_DFA_DEAD) { break; }
+        state = t;
+        if (d->accept[state]) { match = j+1; }
     }
 
-    free(a);
-    return p;  
+    *scan = j;
+    return match;
 }
 
-void mpc_cleanup(int n, ...) {
-    int i;
-    mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+/*
+ ** Memo Type
+ **
+ ** A memo records how a `mpc_memo` parser went
+ ** when run at some position: whether it matched,
+ ** the state it finished in, a copy of its output
+ ** or error, and the errors it merged into the
+ ** stack along the way. Replaying these gives
+ ** exactly the same parse as running it again.
+ **
+ ** While a memo is being filled in, `err` and
+ ** `pend` hold those of the enclosing parse
+ ** instead.
+ */
 
-    va_list va;
-    va_start(va, n);
-    for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-    for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-    for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
-    va_end(va);  
+typedef struct {
+    mpc_parser_t *p;
+    mpc_state_t state;
+    char last;
+    int end;
+} mpc_pending_t;
 
-    free(list);
+typedef struct {
+    mpc_parser_t *p;
+    int pos;
+    int success;
+    mpc_state_t state;
+    char last;
+    mpc_result_t result;
+    mpc_err_t *err;
+    mpc_pending_t pend;
+} mpc_memo_t;
+
+static mpc_memo_t *mpc_memo_new(mpc_parser_t *p, int pos, mpc_err_t *err, mpc_pending_t pend) {
+    mpc_memo_t *m = malloc(sizeof(mpc_memo_t));
+    m->p = p;
+    m->pos = pos;
+    m->success = 0;
+    m->result.output = NULL;
+    m->err = err;
+    m->pend = pend;
+    return m;
+}
+
+static void mpc_memo_delete(mpc_memo_t *m) {
+    if (m->success) {
+        m->p->data.memo.dx(m->result.output);
+    } else {
+        mpc_err_delete(m->result.error);
+    }
+    mpc_err_delete(m->err);
+    free(m);
 }
 
-mpc_parser_t *mpc_pass(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_PASS;
-    return p;
-}
+/*
+ ** PEG Machine
+ **
+ ** With backtracking on, a parser which fails
+ ** never leaves the input moved, which is exactly
+ ** how parsing expression grammars behave. So a
+ ** parser can also be compiled, in the style of
+ ** LPeg, to a flat program for a small machine
+ ** which runs over strings and maps.
+ **
+ ** The parsing loop builds outputs as it goes and
+ ** destroys those of the branches which fail. The
+ ** machine instead records a list of capture
+ ** events, dropping those of failed branches along
+ ** with the input they consumed, and only runs
+ ** the folds and applies over the list once the
+ ** whole parse has succeeded.
+ **
+ ** The machine does not build errors. When it
+ ** fails, the parse is run again by the parsing
+ ** loop, which finds the error.
+ */
 
-mpc_parser_t *mpc_fail(const char *m) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_FAIL;
-    p->data.fail.m = malloc(strlen(m) + 1);
-    strcpy(p->data.fail.m, m);
-    return p;
-}
+enum {
+    MPC_OP_END,
+    MPC_OP_FAIL,
+    MPC_OP_ANY,
+    MPC_OP_CHAR,
+    MPC_OP_SET,
+    MPC_OP_SATISFY,
+    MPC_OP_STRING,
+    MPC_OP_SPAN,
+    MPC_OP_ESCAPED,
+    MPC_OP_DFA,
+    MPC_OP_ANCHOR,
+    MPC_OP_TEST,
+    MPC_OP_CHOICE,
+    MPC_OP_COMMIT,
+    MPC_OP_PARTIAL_COMMIT,
+    MPC_OP_FAIL_TWICE,
+    MPC_OP_CALL,
+    MPC_OP_RETURN,
+    MPC_OP_CAPTURE,
+    MPC_OP_SLICE_END
+};
+
+enum {
+    MPC_CAP_CHAR,
+    MPC_CAP_STRING,
+    MPC_CAP_NULL,
+    MPC_CAP_LIFT,
+    MPC_CAP_VAL,
+    MPC_CAP_STATE,
+    MPC_CAP_SLICE,
+    MPC_CAP_OPEN,
+    MPC_CAP_CLOSE
+};
 
 /*
- ** As `snprintf` is not ANSI standard this 
- ** function `mpc_failf` should be considered
- ** unsafe.
- **
- ** You have a few options if this is going to be
- ** trouble.
- **
- ** - Ensure the format string does not exceed
- **   the buffer length using precision specifiers
- **   such as `%.512s`.
- **
- ** - Patch this function in your code base to 
- **   use `snprintf` or whatever variant your
- **   system supports.
- **
- ** - Avoid it altogether.
- **
+ ** `x` is the target of jumps, the character of
+ ** `char`, the length of `string` and the least
+ ** run of `span`. `cap` asks consuming instructions
+ ** to also capture what they matched. `test` jumps
+ ** to `x` unless the next byte is in set `y`, and
+ ** fails instead if `x` is negative.
  */
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
+typedef struct {
+    char op;
+    char cap;
+    int x;
+    int y;
+    mpc_parser_t *p;
+} mpc_inst_t;
 
-    va_list va;
-    char *buffer;
+typedef struct mpc_prog_t {
+    int num;
+    int slots;
+    mpc_inst_t *code;
+    int sets_num;
+    unsigned char *sets;
+} mpc_prog_t;
 
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_FAIL;
+static void mpc_prog_delete(mpc_prog_t *prog) {
+    if (prog == NULL) { return; }
+    free(prog->code);
+    free(prog->sets);
+    free(prog);
+}
 
-    va_start(va, fmt);
-    buffer = malloc(2048);
-    vsprintf(buffer, fmt, va);
-    va_end(va);
+/*
+ ** Retained parsers are compiled once for each
+ ** way they are used, with and without captures,
+ ** as subroutines. Calls hold the number of the
+ ** subroutine until every one has been placed.
+ */
 
-    buffer = realloc(buffer, strlen(buffer) + 1);
-    p->data.fail.m = buffer;
-    return p;
+typedef struct {
+    mpc_prog_t *prog;
+    int ok;
+    int subs_num;
+    mpc_parser_t **subs;
+    char *subs_cap;
+    int *subs_pc;
+} mpc_compile_t;
 
+static int mpc_compile_op(mpc_compile_t *c, int op, int cap, int x, mpc_parser_t *p) {
+
+    mpc_prog_t *prog = c->prog;
+
+    if (prog->num == prog->slots) {
+        prog->slots = prog->slots ? prog->slots * 2 : 64;
+        prog->code = realloc(prog->code, sizeof(mpc_inst_t) * prog->slots);
+    }
+
+    prog->code[prog->num].op = (char)op;
+    prog->code[prog->num].cap = (char)cap;
+    prog->code[prog->num].x = x;
+    prog->code[prog->num].y = 0;
+    prog->code[prog->num].p = p;
+    return prog->num++;
 }
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_LIFT_VAL;
-    p->data.lift.x = x;
-    return p;
+static void mpc_compile_here(mpc_compile_t *c, int j) {
+    c->prog->code[j].x = c->prog->num;
 }
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_LIFT;
-    p->data.lift.lf = lf;
-    return p;
+static int mpc_compile_sub(mpc_compile_t *c, mpc_parser_t *p, int cap) {
+
+    int j;
+
+    for (j = 0; j < c->subs_num; j++) {
+        if (c->subs[j] == p && c->subs_cap[j] == cap) { return j; }
+    }
+
+    c->subs = realloc(c->subs, sizeof(mpc_parser_t*) * (c->subs_num+1));
+    c->subs_cap = realloc(c->subs_cap, c->subs_num+1);
+    c->subs_pc = realloc(c->subs_pc, sizeof(int) * (c->subs_num+1));
+    c->subs[c->subs_num] = p;
+    c->subs_cap[c->subs_num] = (char)cap;
+    c->subs_pc[c->subs_num] = -1;
+    return c->subs_num++;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ANCHOR;
-    p->data.anchor.f = f;
-    return p;
+static void mpc_compile_parser(mpc_compile_t *c, mpc_parser_t *p, int cap);
+static int mpc_first(mpc_parser_t *p, unsigned char *set, int depth);
+
+/*
+ ** Alternatives of an `or` which cannot start with
+ ** the next byte are stepped over by a test before
+ ** they push a choice or capture anything. As with
+ ** optimising, NUL and the end of input never skip.
+ */
+
+static int mpc_compile_test(mpc_compile_t *c, mpc_parser_t *p, int x) {
+
+    unsigned char set[32];
+    mpc_prog_t *prog = c->prog;
+    int j;
+
+    if (!mpc_first(p, set, 0)) { return -1; }
+
+    prog->sets = realloc(prog->sets, 32 * (prog->sets_num+1));
+    memcpy(prog->sets + 32 * prog->sets_num, set, 32);
+
+    j = mpc_compile_op(c, MPC_OP_TEST, 0, x, NULL);
+    prog->code[j].y = prog->sets_num++;
+    return j;
 }
 
-mpc_parser_t *mpc_state(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_STATE;
-    return p;
+static void mpc_compile_not(mpc_compile_t *c, mpc_parser_t *x) {
+    int j = mpc_compile_op(c, MPC_OP_CHOICE, 0, 0, NULL);
+    mpc_compile_parser(c, x, 0);
+    mpc_compile_op(c, MPC_OP_FAIL_TWICE, 0, 0, NULL);
+    mpc_compile_here(c, j);
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_EXPECT;
-    p->data.expect.x = a;
-    p->data.expect.m = malloc(strlen(expected) + 1);
-    strcpy(p->data.expect.m, expected);
-    return p;
+static void mpc_compile_body(mpc_compile_t *c, mpc_parser_t *p, int cap) {
+
+    int j, k, t, *ends;
+    mpc_parser_t *x, *y;
+
+    switch (p->type) {
+
+        case MPC_TYPE_UNDEFINED:
+        case MPC_TYPE_FAIL: mpc_compile_op(c, MPC_OP_FAIL, 0, 0, NULL); break;
+
+        case MPC_TYPE_PASS:     if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_NULL, p); }  break;
+        case MPC_TYPE_LIFT:     if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_LIFT, p); }  break;
+        case MPC_TYPE_LIFT_VAL: if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_VAL, p); }   break;
+        case MPC_TYPE_STATE:    if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_STATE, p); } break;
+
+        case MPC_TYPE_ANCHOR:
+                                mpc_compile_op(c, MPC_OP_ANCHOR, 0, 0, p);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_NULL, p); }
+                                break;
+
+        case MPC_TYPE_ANY:     mpc_compile_op(c, MPC_OP_ANY, cap, 0, p); break;
+        case MPC_TYPE_SINGLE:  mpc_compile_op(c, MPC_OP_CHAR, cap, p->data.single.x, p); break;
+        case MPC_TYPE_CLASS:   mpc_compile_op(c, MPC_OP_SET, cap, 0, p); break;
+        case MPC_TYPE_SATISFY: mpc_compile_op(c, MPC_OP_SATISFY, cap, 0, p); break;
+        case MPC_TYPE_STRING:  mpc_compile_op(c, MPC_OP_STRING, cap, (int)strlen(p->data.string.x), p); break;
+
+        case MPC_TYPE_EXPECT: mpc_compile_parser(c, p->data.expect.x, cap); break;
+        case MPC_TYPE_MEMO:   mpc_compile_parser(c, p->data.memo.x, cap); break;
+
+        /* The machine's own parse is only lost when the regex has too many states */
+        case MPC_TYPE_DFA:
+                                j = cap ? -1 : mpc_compile_op(c, MPC_OP_DFA, 0, 0, p);
+                                mpc_compile_parser(c, p->data.dfa.x, cap);
+                                if (j >= 0) { mpc_compile_here(c, j); }
+                                break;
+
+        /* Predictive and committed parsers do not give back what they consumed on failure */
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT: c->ok = 0; break;
+
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_APPLY_TO:
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_OPEN, p); }
+                                mpc_compile_parser(c, p->type == MPC_TYPE_APPLY ? p->data.apply.x : p->data.apply_to.x, cap);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_CLOSE, p); }
+                                break;
+
+        case MPC_TYPE_NOT:
+                                mpc_compile_not(c, p->data.not.x);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_LIFT, p); }
+                                break;
+
+        case MPC_TYPE_MAYBE:
+                                j = mpc_compile_op(c, MPC_OP_CHOICE, 0, 0, NULL);
+                                mpc_compile_parser(c, p->data.not.x, cap);
+                                k = mpc_compile_op(c, MPC_OP_COMMIT, 0, 0, NULL);
+                                mpc_compile_here(c, j);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_LIFT, p); }
+                                mpc_compile_here(c, k);
+                                break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+                                x = p->data.repeat.x;
+                                if (!cap && (y = mpc_unexpected(x)) && y->type == MPC_TYPE_CLASS) {
+                                    mpc_compile_op(c, MPC_OP_SPAN, 0, p->type == MPC_TYPE_MANY1, y);
+                                    break;
+                                }
+                                /* String bodies skip ahead, and the loop matches the rest */
+                                if (!cap && p->type == MPC_TYPE_MANY && (y = mpc_escaped_of(x))) {
+                                    mpc_compile_op(c, MPC_OP_ESCAPED, 0, 0, y);
+                                }
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_OPEN, p); }
+                                if (p->type == MPC_TYPE_MANY1) { mpc_compile_parser(c, x, cap); }
+                                j = mpc_compile_op(c, MPC_OP_CHOICE, 0, 0, NULL);
+                                k = c->prog->num;
+                                mpc_compile_parser(c, x, cap);
+                                mpc_compile_op(c, MPC_OP_PARTIAL_COMMIT, 0, k, NULL);
+                                mpc_compile_here(c, j);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_CLOSE, p); }
+                                break;
+
+        /* Exactly `n` matches, as the loop fails on any more */
+        case MPC_TYPE_COUNT:
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_OPEN, p); }
+                                for (j = 0; j < p->data.repeat.n; j++) {
+                                    mpc_compile_parser(c, p->data.repeat.x, cap);
+                                }
+                                mpc_compile_not(c, p->data.repeat.x);
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_CLOSE, p); }
+                                break;
+
+        case MPC_TYPE_OR:
+                                if (p->data.or.n == 0) {
+                                    if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_NULL, p); }
+                                    break;
+                                }
+                                ends = malloc(sizeof(int) * p->data.or.n);
+                                for (j = 0; j < p->data.or.n-1; j++) {
+                                    t = mpc_compile_test(c, p->data.or.xs[j], 0);
+                                    k = mpc_compile_op(c, MPC_OP_CHOICE, 0, 0, NULL);
+                                    mpc_compile_parser(c, p->data.or.xs[j], cap);
+                                    ends[j] = mpc_compile_op(c, MPC_OP_COMMIT, 0, 0, NULL);
+                                    mpc_compile_here(c, k);
+                                    if (t >= 0) { mpc_compile_here(c, t); }
+                                }
+                                mpc_compile_test(c, p->data.or.xs[j], -1);
+                                mpc_compile_parser(c, p->data.or.xs[j], cap);
+                                for (j = 0; j < p->data.or.n-1; j++) { mpc_compile_here(c, ends[j]); }
+                                free(ends);
+                                break;
+
+        case MPC_TYPE_AND:
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_OPEN, p); }
+                                for (j = 0; j < p->data.and.n; j++) {
+                                    mpc_compile_parser(c, p->data.and.xs[j], cap);
+                                }
+                                if (cap) { mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_CLOSE, p); }
+                                break;
+
+        default: c->ok = 0; break;
+    }
 }
 
 /*
- ** As `snprintf` is not ANSI standard this 
- ** function `mpc_expectf` should be considered
- ** unsafe.
- **
- ** You have a few options if this is going to be
- ** trouble.
- **
- ** - Ensure the format string does not exceed
- **   the buffer length using precision specifiers
- **   such as `%.512s`.
- **
- ** - Patch this function in your code base to 
- **   use `snprintf` or whatever variant your
- **   system supports.
- **
- ** - Avoid it altogether.
- **
+ ** Like the parsing loop, a span starts at the
+ ** first span parser reached with outputs on, and
+ ** everything inside it is matched without any
+ ** captures.
  */
 
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-    va_list va;
-    char *buffer;
+static void mpc_compile_parser(mpc_compile_t *c, mpc_parser_t *p, int cap) {
 
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_EXPECT;
+    if (cap && p->span) {
+        mpc_compile_op(c, MPC_OP_CAPTURE, 0, MPC_CAP_SLICE, p);
+        mpc_compile_parser(c, p, 0);
+        mpc_compile_op(c, MPC_OP_SLICE_END, 0, 0, NULL);
+        return;
+    }
 
-    va_start(va, fmt);
-    buffer = malloc(2048);
-    vsprintf(buffer, fmt, va);
-    va_end(va);
+    if (p->retained) {
+        mpc_compile_op(c, MPC_OP_CALL, 0, mpc_compile_sub(c, p, cap), p);
+    } else {
+        mpc_compile_body(c, p, cap);
+    }
+}
 
-    buffer = realloc(buffer, strlen(buffer) + 1);
-    p->data.expect.x = a;
-    p->data.expect.m = buffer;
-    return p;
+static mpc_prog_t *mpc_prog_new(mpc_parser_t *p) {
+
+    mpc_compile_t c;
+    int j;
+
+    c.prog = calloc(1, sizeof(mpc_prog_t));
+    c.ok = 1;
+    c.subs_num = 0;
+    c.subs = NULL;
+    c.subs_cap = NULL;
+    c.subs_pc = NULL;
+
+    mpc_compile_parser(&c, p, 1);
+    mpc_compile_op(&c, MPC_OP_END, 0, 0, NULL);
+
+    for (j = 0; c.ok && j < c.subs_num; j++) {
+        c.subs_pc[j] = c.prog->num;
+        mpc_compile_body(&c, c.subs[j], c.subs_cap[j]);
+        mpc_compile_op(&c, MPC_OP_RETURN, 0, 0, NULL);
+    }
+
+    for (j = 0; j < c.prog->num; j++) {
+        if (c.prog->code[j].op == MPC_OP_CALL) {
+            c.prog->code[j].x = c.subs_pc[c.prog->code[j].x];
+        }
+    }
+
+    free(c.subs);
+    free(c.subs_cap);
+    free(c.subs_pc);
+
+    if (!c.ok) {
+        mpc_prog_delete(c.prog);
+        return NULL;
+    }
+
+    return c.prog;
 }
 
 /*
- ** Basic Parsers
+ ** Choice entries on the stack hold where to go on
+ ** failure and the position and number of captures
+ ** to go back to. Call entries hold where to return
+ ** to and have no position.
  */
 
-mpc_parser_t *mpc_any(void) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ANY;
-    return mpc_expect(p, "any character");
-}
+typedef struct mpc_vm_entry_t {
+    int pc;
+    int pos;
+    int caps;
+} mpc_vm_entry_t;
 
-mpc_parser_t *mpc_char(char c) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_SINGLE;
-    p->data.single.x = c;
-    return mpc_expectf(p, "'%c'", c);
-}
+/*
+ ** A capture is just the instruction which made
+ ** it and the position it was made at, so many
+ ** fit in cache. The end of a slice is a capture
+ ** of its own.
+ */
 
-mpc_parser_t *mpc_range(char s, char e) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_RANGE;
-    p->data.range.x = s;
-    p->data.range.y = e;
-    return mpc_expectf(p, "character between '%c' and '%c'", s, e);
-}
+typedef struct mpc_vm_cap_t {
+    int pc;
+    int pos;
+} mpc_vm_cap_t;
 
-mpc_parser_t *mpc_oneof(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_ONEOF;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "one of '%s'", s);
+typedef struct {
+    mpc_vm_entry_t *stack;
+    int stack_num;
+    int stack_slots;
+    mpc_vm_cap_t *caps;
+    int caps_num;
+    int caps_slots;
+    struct mpc_vm_out_t *out;
+} mpc_vm_t;
+
+static void mpc_vm_push(mpc_vm_t *vm, int pc, int pos, int caps) {
+
+    if (vm->stack_num == vm->stack_slots) {
+        vm->stack_slots = vm->stack_slots ? vm->stack_slots * 2 : 64;
+        vm->stack = realloc(vm->stack, sizeof(mpc_vm_entry_t) * vm->stack_slots);
+    }
+
+    vm->stack[vm->stack_num].pc = pc;
+    vm->stack[vm->stack_num].pos = pos;
+    vm->stack[vm->stack_num].caps = caps;
+    vm->stack_num++;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_NONEOF;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "one of '%s'", s);
+static void mpc_vm_flush(mpc_vm_t *vm);
 
-}
+static void mpc_vm_capture(mpc_vm_t *vm, int pc, int pos) {
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_SATISFY;
-    p->data.satisfy.f = f;
-    return mpc_expectf(p, "character satisfying function %p", f);
+    if (vm->caps_num == vm->caps_slots && vm->out) {
+        mpc_vm_flush(vm);
+    }
+
+    if (vm->caps_num == vm->caps_slots) {
+        vm->caps_slots = vm->caps_slots ? vm->caps_slots * 2 : 256;
+        vm->caps = realloc(vm->caps, sizeof(mpc_vm_cap_t) * vm->caps_slots);
+    }
+
+    vm->caps[vm->caps_num].pc = pc;
+    vm->caps[vm->caps_num].pos = pos;
+    vm->caps_num++;
 }
 
-mpc_parser_t *mpc_string(const char *s) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_STRING;
-    p->data.string.x = malloc(strlen(s) + 1);
-    strcpy(p->data.string.x, s);
-    return mpc_expectf(p, "\"%s\"", s);
+static int mpc_vm_anchor(mpc_input_t *i, int(*f)(char,char), int start, int pos) {
+    if (f == mpc_soi_anchor) { return pos == 0; }
+    if (f == mpc_eoi_anchor) { return pos >= i->length; }
+    return f(pos > start ? i->string[pos-1] : i->last, pos < i->length ? i->string[pos] : '\0');
 }
 
 /*
- ** Core Parsers
+ ** Runs `prog` from the current position of `i`.
+ ** Returns the position it ends at, or -1 if it
+ ** fails.
  */
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_APPLY;
-    p->data.apply.x = a;
-    p->data.apply.f = f;
-    return p;
-}
+static int mpc_vm_run(mpc_vm_t *vm, mpc_prog_t *prog, mpc_input_t *i) {
+
+    mpc_inst_t *in;
+    const char *s = i->string;
+    int len = i->length;
+    int start = i->state.pos;
+    int pc = 0, pos = start;
+    int n, scan;
+
+    while (1) {
+
+        in = &prog->code[pc];
+
+        switch (in->op) {
+
+            case MPC_OP_END: return pos;
+
+            case MPC_OP_ANY:
+                if (pos >= len) { goto fail; }
+                if (in->cap) { mpc_vm_capture(vm, pc, pos); }
+                pos++; pc++;
+                continue;
+
+            case MPC_OP_CHAR:
+                if (pos >= len || s[pos] != (char)in->x) { goto fail; }
+                if (in->cap) { mpc_vm_capture(vm, pc, pos); }
+                pos++; pc++;
+                continue;
+
+            case MPC_OP_SET:
+                if (pos >= len || !mpc_set_has(in->p->data.class.x, (unsigned char)s[pos])) { goto fail; }
+                if (in->cap) { mpc_vm_capture(vm, pc, pos); }
+                pos++; pc++;
+                continue;
+
+            case MPC_OP_SATISFY:
+                if (pos >= len || !in->p->data.satisfy.f(s[pos])) { goto fail; }
+                if (in->cap) { mpc_vm_capture(vm, pc, pos); }
+                pos++; pc++;
+                continue;
+
+            case MPC_OP_STRING:
+                if (len - pos < in->x || memcmp(s + pos, in->p->data.string.x, in->x) != 0) { goto fail; }
+                if (in->cap) { mpc_vm_capture(vm, pc, pos); }
+                pos += in->x; pc++;
+                continue;
+
+            case MPC_OP_SPAN:
+                n = mpc_class_run(&in->p->data.class, -1, s + pos, len - pos);
+                if (n < in->x) { goto fail; }
+                pos += n; pc++;
+                continue;
+
+            case MPC_OP_ESCAPED:
+                pos += mpc_escaped_run(&in->p->data.class, s + pos, len - pos);
+                pc++;
+                continue;
+
+            case MPC_OP_DFA:
+                n = mpc_dfa_match(in->p->data.dfa.d, s + pos, len - pos, &scan);
+                if (n >= 0) {
+                    pos += n; pc = in->x;
+                } else if (scan < len - pos) {
+                    goto fail;
+                } else {
+                    pc++;
+                }
+                continue;
+
+            case MPC_OP_ANCHOR:
+                if (!mpc_vm_anchor(i, in->p->data.anchor.f, start, pos)) { goto fail; }
+                pc++;
+                continue;
+
+            case MPC_OP_TEST:
+                n = pos < len ? (unsigned char)s[pos] : 0;
+                if (n == 0 || mpc_set_has(prog->sets + 32 * in->y, n)) {
+                    pc++;
+                } else if (in->x < 0) {
+                    goto fail;
+                } else {
+                    pc = in->x;
+                }
+                continue;
+
+            case MPC_OP_CHOICE:
+                mpc_vm_push(vm, in->x, pos, vm->caps_num);
+                pc++;
+                continue;
+
+            case MPC_OP_COMMIT:
+                vm->stack_num--;
+                pc = in->x;
+                continue;
+
+            case MPC_OP_PARTIAL_COMMIT:
+                vm->stack[vm->stack_num-1].pos = pos;
+                vm->stack[vm->stack_num-1].caps = vm->caps_num;
+                pc = in->x;
+                continue;
+
+            case MPC_OP_FAIL_TWICE:
+                vm->stack_num--;
+                goto fail;
+
+            case MPC_OP_CALL:
+                mpc_vm_push(vm, pc+1, -1, 0);
+                pc = in->x;
+                continue;
+
+            case MPC_OP_RETURN:
+                pc = vm->stack[--vm->stack_num].pc;
+                continue;
+
+            case MPC_OP_CAPTURE:
+            case MPC_OP_SLICE_END:
+                mpc_vm_capture(vm, pc, pos);
+                pc++;
+                continue;
+
+            default: goto fail;
+        }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_APPLY_TO;
-    p->data.apply_to.x = a;
-    p->data.apply_to.f = f;
-    p->data.apply_to.d = x;
-    return p;
+    fail:
+        while (vm->stack_num > 0 && vm->stack[vm->stack_num-1].pos < 0) { vm->stack_num--; }
+        if (vm->stack_num == 0) { return -1; }
+        vm->stack_num--;
+        pc = vm->stack[vm->stack_num].pc;
+        pos = vm->stack[vm->stack_num].pos;
+        vm->caps_num = vm->stack[vm->stack_num].caps;
+    }
 }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_PREDICT;
-    p->data.predict.x = a;
-    return p;
+static mpc_val_t *mpc_vm_fold(mpc_parser_t *p, int n, mpc_val_t **xs) {
+    switch (p->type) {
+        case MPC_TYPE_APPLY:    return p->data.apply.f(xs[0]);
+        case MPC_TYPE_APPLY_TO: return p->data.apply_to.f(xs[0], p->data.apply_to.d);
+        case MPC_TYPE_AND:      return p->data.and.f(n, n ? xs : NULL);
+        default:                return p->data.repeat.f(n, xs);
+    }
 }
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_NOT;
-    p->data.not.x = a;
-    p->data.not.dx = da;
-    p->data.not.lf = lf;
-    return p;
-}
+/*
+ ** Turns the captures into the output. Every
+ ** value is pushed onto a stack, and each close
+ ** folds those pushed since its open. Captures
+ ** come in order of position, so the rows and
+ ** columns of states are counted in one pass.
+ **
+ ** The captures can be handed over in pieces, as
+ ** when reporting events, in which case the folds
+ ** which build the AST are replaced by calls to
+ ** the event callbacks.
+ */
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-    return mpc_not_lift(a, da, mpcf_ctor_null);
+typedef struct mpc_vm_out_t {
+    mpc_prog_t *prog;
+    mpc_input_t *input;
+    mpc_val_t **vals;
+    int vals_num;
+    int vals_slots;
+    int *opens;
+    int opens_num;
+    int opens_slots;
+    mpc_state_t st;
+    mpc_state_t at;
+    const mpc_events_t *events;
+    void *data;
+} mpc_vm_out_t;
+
+static void mpc_vm_out_init(mpc_vm_out_t *o, mpc_prog_t *prog, mpc_input_t *i, const mpc_events_t *events, void *data) {
+    o->prog = prog;
+    o->input = i;
+    o->vals = NULL;
+    o->vals_num = 0;
+    o->vals_slots = 0;
+    o->opens = NULL;
+    o->opens_num = 0;
+    o->opens_slots = 0;
+    o->st = mpc_input_state(i);
+    o->at = o->st;
+    o->events = events;
+    o->data = data;
+}
+
+static int mpc_vm_rule(mpc_parser_t *p) {
+    return p->type == MPC_TYPE_APPLY_TO && p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag;
 }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MAYBE;
-    p->data.not.x = a;
-    p->data.not.lf = lf;
-    return p;
-}
+/*
+ ** Rules are tagged with their name as they are
+ ** left, and strings, chars and regexes with their
+ ** kind. Everything else building the AST is left
+ ** out, only keeping the strings tokens are made
+ ** from.
+ */
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-    return mpc_maybe_lift(a, mpcf_ctor_null);
-}
+static mpc_val_t *mpc_vm_event(mpc_vm_out_t *o, mpc_parser_t *p, int n, mpc_val_t **xs) {
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MANY;
-    p->data.repeat.x = a;
-    p->data.repeat.f = f;
-    return p;
+    const mpc_events_t *e = o->events;
+
+    if (mpc_vm_rule(p)) {
+        if (e->leave) { e->leave(o->data, p->data.apply_to.d); }
+        return NULL;
+    }
+
+    if (p->type == MPC_TYPE_APPLY_TO && p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag) {
+        if (e->token) { e->token(o->data, p->data.apply_to.d, xs[0], o->at); }
+        free(xs[0]);
+        return NULL;
+    }
+
+    if (p->type == MPC_TYPE_APPLY && p->data.apply.f == mpcf_str_ast) { return xs[0]; }
+    if (p->type == MPC_TYPE_APPLY && p->data.apply.f == (mpc_apply_t)mpc_ast_add_root) { return NULL; }
+    if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_state_ast) { free(xs[0]); return NULL; }
+    if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_fold_ast) { return NULL; }
+    if (p->type != MPC_TYPE_AND && p->type != MPC_TYPE_APPLY && p->type != MPC_TYPE_APPLY_TO
+    &&  p->data.repeat.f == mpcf_fold_ast) { return NULL; }
+
+    return mpc_vm_fold(p, n, xs);
 }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_MANY1;
-    p->data.repeat.x = a;
-    p->data.repeat.f = f;
-    return p;
+static void mpc_vm_emit(mpc_vm_out_t *o, mpc_vm_cap_t *caps, int n) {
+
+    mpc_input_t *i = o->input;
+    mpc_vm_cap_t *e;
+    mpc_inst_t *in;
+    mpc_val_t *x;
+    char *c;
+    int j, h;
+
+    for (j = 0; j < n; j++) {
+
+        e = &caps[j];
+        in = &o->prog->code[e->pc];
+
+        if (in->op == MPC_OP_CAPTURE && in->x == MPC_CAP_OPEN) {
+            if (o->opens_num == o->opens_slots) {
+                o->opens_slots = o->opens_slots ? o->opens_slots * 2 : 64;
+                o->opens = realloc(o->opens, sizeof(int) * o->opens_slots);
+            }
+            o->opens[o->opens_num++] = o->vals_num;
+            if (o->events && o->events->enter && mpc_vm_rule(in->p)) {
+                o->events->enter(o->data, in->p->data.apply_to.d, o->at);
+            }
+            continue;
+        }
+
+        switch (in->op == MPC_OP_CAPTURE ? in->x : in->op == MPC_OP_STRING ? MPC_CAP_STRING : MPC_CAP_CHAR) {
+
+            case MPC_CAP_CLOSE:
+                h = o->opens[--o->opens_num];
+                x = o->events
+                  ? mpc_vm_event(o, in->p, o->vals_num - h, o->vals + h)
+                  : mpc_vm_fold(in->p, o->vals_num - h, o->vals + h);
+                o->vals_num = h;
+                break;
+
+            case MPC_CAP_CHAR:
+                c = malloc(2);
+                c[0] = i->string[e->pos];
+                c[1] = '\0';
+                x = c;
+                break;
+
+            case MPC_CAP_STRING:
+                x = malloc(in->x + 1);
+                memcpy(x, in->p->data.string.x, in->x + 1);
+                break;
+
+            case MPC_CAP_LIFT:
+                x = in->p->type == MPC_TYPE_LIFT ? in->p->data.lift.lf() : in->p->data.not.lf();
+                break;
+
+            case MPC_CAP_STATE:
+                mpc_state_advance(&o->st, i->string + o->st.pos, e->pos - o->st.pos);
+                o->at = o->st;
+                x = mpc_state_copy(o->st);
+                break;
+
+            case MPC_CAP_SLICE:
+                x = mpc_slice(i->string + e->pos, caps[j+1].pos - e->pos);
+                j++;
+                break;
+
+            case MPC_CAP_VAL: x = in->p->data.lift.x; break;
+            default:          x = NULL; break;
+        }
+
+        if (o->vals_num == o->vals_slots) {
+            o->vals_slots = o->vals_slots ? o->vals_slots * 2 : 64;
+            o->vals = realloc(o->vals, sizeof(mpc_val_t*) * o->vals_slots);
+        }
+        o->vals[o->vals_num++] = x;
+    }
 }
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-    mpc_parser_t *p = mpc_undefined();
-    p->type = MPC_TYPE_COUNT;
-    p->data.repeat.n = n;
-    p->data.repeat.f = f;
-    p->data.repeat.x = a;
-    p->data.repeat.dx = da;
-    return p;
+static mpc_val_t *mpc_vm_output(mpc_vm_t *vm, mpc_prog_t *prog, mpc_input_t *i) {
+
+    mpc_vm_out_t o;
+    mpc_val_t *x;
+
+    mpc_vm_out_init(&o, prog, i, NULL, NULL);
+    mpc_vm_emit(&o, vm->caps, vm->caps_num);
+
+    x = o.vals[0];
+    free(o.vals);
+    free(o.opens);
+    return x;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
+/*
+ ** When reporting events, the captures the parse
+ ** has committed to are handed over whenever the
+ ** list fills up. Those are all the captures made
+ ** before the lowest choice on the stack, so the
+ ** list only holds what could still be undone.
+ */
 
-    int i;
-    va_list va;
+static void mpc_vm_flush(mpc_vm_t *vm) {
 
-    mpc_parser_t *p = mpc_undefined();
+    mpc_inst_t *in;
+    int j, n = vm->caps_num;
 
-    p->type = MPC_TYPE_OR;
-    p->data.or.n = n;
-    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    for (j = 0; j < vm->stack_num; j++) {
+        if (vm->stack[j].pos >= 0) { n = vm->stack[j].caps; break; }
+    }
 
-    va_start(va, n);  
-    for (i = 0; i < n; i++) {
-        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    /* The start of a slice needs its end */
+    if (n > 0) {
+        in = &vm->out->prog->code[vm->caps[n-1].pc];
+        if (in->op == MPC_OP_CAPTURE && in->x == MPC_CAP_SLICE) { n--; }
     }
-    va_end(va);
 
-    return p;
+    if (n == 0) { return; }
+
+    mpc_vm_emit(vm->out, vm->caps, n);
+    memmove(vm->caps, vm->caps + n, sizeof(mpc_vm_cap_t) * (vm->caps_num - n));
+    vm->caps_num -= n;
+
+    for (j = 0; j < vm->stack_num; j++) {
+        if (vm->stack[j].pos >= 0) { vm->stack[j].caps -= n; }
+    }
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+/*
+ ** With `events` set the output is reported as it
+ ** is committed to rather than returned. Values of
+ ** an `mpca` grammar are all plain allocations, so
+ ** any left part built when the parse fails are
+ ** just freed.
+ */
 
-    int i;
-    va_list va;
+static int mpc_vm_parse(mpc_prog_t *prog, mpc_input_t *i, mpc_result_t *r, const mpc_events_t *events, void *data) {
 
-    mpc_parser_t *p = mpc_undefined();
+    mpc_vm_t vm;
+    mpc_vm_out_t out;
+    int end, j;
 
-    p->type = MPC_TYPE_AND;
-    p->data.and.n = n;
-    p->data.and.f = f;
-    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+    vm.stack = i->trail;
+    vm.stack_num = 0;
+    vm.stack_slots = i->trail_slots;
+    vm.caps = i->caps;
+    vm.caps_num = 0;
+    vm.caps_slots = i->caps_slots;
+    vm.out = NULL;
 
-    va_start(va, f);  
-    for (i = 0; i < n; i++) {
-        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    if (events) {
+        mpc_vm_out_init(&out, prog, i, events, data);
+        vm.out = &out;
     }
-    for (i = 0; i < (n-1); i++) {
-        p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-    }  
-    va_end(va);
 
-    return p;
+    end = mpc_vm_run(&vm, prog, i);
+
+    if (end >= 0) {
+        if (events) {
+            mpc_vm_emit(&out, vm.caps, vm.caps_num);
+            r->output = NULL;
+        } else {
+            r->output = mpc_vm_output(&vm, prog, i);
+        }
+        mpc_input_advance(i, end - i->state.pos);
+    }
+
+    i->trail = vm.stack;
+    i->trail_slots = vm.stack_slots;
+    i->caps = vm.caps;
+    i->caps_slots = vm.caps_slots;
+
+    if (events) {
+        for (j = 0; end < 0 && j < out.vals_num; j++) { free(out.vals[j]); }
+        free(out.vals);
+        free(out.opens);
+    }
+
+    return end >= 0;
 }
 
 /*
- ** Common Parsers
+ ** Stack Type
+ **
+ ** The stacks grow geometrically and never shrink
+ ** during a parse. Once done, a stack is kept by
+ ** its input as a spare for the next parse.
  */
 
-static int mpc_soi_anchor(char prev, char next) { return (prev == '\0'); }
-static int mpc_eoi_anchor(char prev, char next) { return (next == '\0'); }
+typedef struct mpc_stack_t {
 
-mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
-mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
+    int parsers_num;
+    int parsers_slots;
+    mpc_parser_t **parsers;
+    int *states;
 
-static int mpc_boundary_anchor(char prev, char next) {
-    char* word = "abcdefghijklmnopqrstuvwxyz"
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-        "0123456789_";
-    if ( strchr(word, next) &&  prev == '\0') { return 1; }
-    if ( strchr(word, prev) &&  next == '\0') { return 1; }
-    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-    return 0;
-}
+    int results_num;
+    int results_slots;
+    mpc_result_t *results;
+    int *returns;
 
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
+    int memos_num;
+    int memos_slots;
+    mpc_memo_t **memos;
 
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+    mpc_input_t *input;
+    mpc_pending_t pend;
+    mpc_err_t *err;
+    int quiet;
 
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+    int span;
+    int span_start;
 
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+#ifdef MPC_PROFILE
+    struct mpc_profile_frame_t *frames;
+#endif
 
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+} mpc_stack_t;
 
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+#ifdef MPC_PROFILE
 
-mpc_parser_t *mpc_real(void) {
+/*
+ ** Where the input and clock stood when a named
+ ** parser on the stack started.
+ */
 
-    /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+typedef struct mpc_profile_frame_t {
+    int entry;
+    double cycles;
+    unsigned long rewinds;
+    long pos;
+} mpc_profile_frame_t;
 
-    mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+#endif
 
-    p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-    p1 = mpc_digits();
-    p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-    p30 = mpc_oneof("eE");
-    p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-    p32 = mpc_digits();
-    p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, mpc_err_t **side, int quiet);
 
-    return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+static mpc_stack_t *mpc_stack_new(mpc_input_t *i, int quiet) {
 
-}
+    mpc_stack_t *s = i->spare;
 
-mpc_parser_t *mpc_float(void) {
-    return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
-}
+    if (s) {
+        i->spare = NULL;
+    } else {
+        s = malloc(sizeof(mpc_stack_t));
+        s->parsers_slots = 0;
+        s->parsers = NULL;
+        s->states = NULL;
+        s->results_slots = 0;
+        s->results = NULL;
+        s->returns = NULL;
+        s->memos_slots = 0;
+        s->memos = NULL;
+#ifdef MPC_PROFILE
+        s->frames = NULL;
+#endif
+    }
 
-mpc_parser_t *mpc_char_lit(void) {
-    return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
-}
+    s->parsers_num = 0;
+    s->results_num = 0;
+    s->memos_num = 0;
 
-mpc_parser_t *mpc_string_lit(void) {
-    mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
-}
+    s->input = i;
+    s->pend.p = NULL;
+    s->err = quiet ? NULL : mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+    s->quiet = quiet;
 
-mpc_parser_t *mpc_regex_lit(void) {  
-    mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+    return s;
 }
 
-mpc_parser_t *mpc_ident(void) {
-    mpc_parser_t *p0, *p1; 
-    p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-    p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-    return mpc_and(2, mpcf_strfold, p0, p1, free);
+static void mpc_stack_err_merge(mpc_stack_t *s, mpc_err_t* e) {
+    mpc_err_t *errs[2];
+    errs[0] = s->err;
+    errs[1] = e;
+    s->err = mpc_err_or(errs, 2);
 }
 
 /*
- ** Useful Parsers
+ ** When a regex is matched by its DFA the errors
+ ** its combinators would have merged along the
+ ** way are not known. They are left pending, and
+ ** are only worked out by running the combinators
+ ** over the same input if something could still
+ ** see them. Every one of them is at or before
+ ** `end`, so once an error further on is merged
+ ** they would all have been dropped anyway.
  */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+static void mpc_stack_resolve(mpc_stack_t *s) {
 
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+    mpc_input_t *i = s->input;
+    mpc_state_t state = i->state;
+    char last = i->last;
+    int floor = i->marks_floor;
+    int committed = i->committed;
+    int cut = i->cut;
+    mpc_pending_t pend = s->pend;
+    mpc_result_t r;
+    mpc_err_t *side;
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+    s->pend.p = NULL;
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-    return mpc_and(3, mpcf_snd_free,
-            mpc_string(o), a, mpc_string(c),
-            free, ad);
+    mpc_input_jump(i, pend.state, pend.last);
+
+    if (mpc_parse_run(i, pend.p, &r, &side, 0)) {
+        free(r.output);
+        if (side->state.pos >= 0) {
+            mpc_stack_err_merge(s, side);
+        } else {
+            mpc_err_delete(side);
+        }
+    } else {
+        mpc_err_delete(r.error);
+    }
+
+    /* The run above is nested in another, whose commits must be kept */
+    i->marks_floor = floor;
+    i->committed = committed;
+    i->cut = cut;
+
+    mpc_input_jump(i, state, last);
 }
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+static void mpc_stack_pend(mpc_stack_t *s, mpc_pending_t pend) {
+    if (s->pend.p) { mpc_stack_resolve(s); }
+    s->pend = pend;
+}
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-    return mpc_and(3, mpcf_snd_free,
-            mpc_sym(o), mpc_tok(a), mpc_sym(c),
-            free, ad);
+static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
+    if (s->quiet) { return; }
+    if (s->pend.p) {
+        if (e->state.pos > s->pend.end) {
+            s->pend.p = NULL;
+        } else {
+            mpc_stack_resolve(s);
+        }
+    }
+    mpc_stack_err_merge(s, e);
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+/* Stack Memo Stuff */
 
 /*
- ** Regular Expression Parsers
+ ** Memos live in an open addressing hash table
+ ** keyed on parser and position. The table is
+ ** never more than half full. When it would be,
+ ** it is rebuilt without the memos for positions
+ ** before the oldest mark and the cursor, which
+ ** the parse can never return to, and is only
+ ** grown if enough memos are still live.
  */
 
-/*
- ** So here is a cute bootstrapping.
- **
- ** I'm using the previously defined
- ** mpc constructs and functions to
- ** parse the user regex string and
- ** construct a parser from it.
- **
- ** As it turns out lots of the standard
- ** mpc functions look a lot like `fold`
- ** functions and so can be used indirectly
- ** by many of the parsing functions to build
- ** a parser directly - as we are parsing.
- **
- ** This is certainly something that
- ** would be less elegant/interesting 
- ** in a two-phase parser which first
- ** builds an AST and then traverses it
- ** to generate the object.
- **
- ** This whole thing acts as a great
- ** case study for how trivial it can be
- ** to write a great parser in a few
- ** lines of code using mpc.
- */
+static unsigned long mpc_memo_hash(mpc_parser_t *p, int pos) {
+    return ((unsigned long)p >> 4) * 31 + (unsigned long)pos * 2654435761UL;
+}
 
-/*
- **
- **  ### Regular Expression Grammar
- **
- **      <regex> : <term> | (<term> "|" <regex>)
- **     
- **      <term> : <factor>*
- **
- **      <factor> : <base>
- **               | <base> "*"
- **               | <base> "+"
- **               | <base> "?"
- **               | <base> "{" <digits> "}"
- **           
- **      <base> : <char>
- **             | "\" <char>
- **             | "(" <regex> ")"
- **             | "[" <range> "]"
- */
+static mpc_memo_t *mpc_stack_memos_find(mpc_stack_t *s, mpc_parser_t *p, int pos) {
 
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-    if (xs[1] == NULL) { return xs[0]; }
-    else { return mpc_or(2, xs[0], xs[1]); }
-}
+    unsigned long j;
+    mpc_memo_t *m;
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-    int i;
-    mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-    for (i = 0; i < n; i++) {
-        p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+    if (s->memos_num == 0) { return NULL; }
+
+    j = mpc_memo_hash(p, pos) & (s->memos_slots - 1);
+    while ((m = s->memos[j])) {
+        if (m->p == p && m->pos == pos) { return m; }
+        j = (j + 1) & (s->memos_slots - 1);
     }
-    return p;
+
+    return NULL;
 }
 
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+static void mpc_stack_memos_put(mpc_stack_t *s, mpc_memo_t *m) {
+    unsigned long j = mpc_memo_hash(m->p, m->pos) & (s->memos_slots - 1);
+    while (s->memos[j]) { j = (j + 1) & (s->memos_slots - 1); }
+    s->memos[j] = m;
+    s->memos_num++;
+}
 
-    int num;
-    if (xs[1] == NULL) { return xs[0]; }
-    if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
-    if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
-    if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
-    num = *(int*)xs[1];
-    free(xs[1]);
+static void mpc_stack_memos_rebuild(mpc_stack_t *s, mpc_input_t *i) {
 
-    return mpc_count(num, mpcf_strfold, xs[0], free);
-}
+    int j, live = 0, slots = 64;
+    int keep = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+    int old_slots = s->memos_slots;
+    mpc_memo_t **old = s->memos;
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-    switch (c) {
-        case 'a': return mpc_char('\a');
-        case 'f': return mpc_char('\f');
-        case 'n': return mpc_char('\n');
-        case 'r': return mpc_char('\r');
-        case 't': return mpc_char('\t');
-        case 'v': return mpc_char('\v');
-        case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-        case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-        case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-        case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-        case 'd': return mpc_digit();
-        case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-        case 's': return mpc_whitespace();
-        case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-        case 'w': return mpc_alphanum();
-        case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-        default: return NULL;
+    for (j = 0; j < old_slots; j++) {
+        if (old[j] && old[j]->pos >= keep) { live++; }
     }
-}
-
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
 
-    char *s = x;
-    mpc_parser_t *p;
+    while (slots < live * 4) { slots *= 2; }
 
-    /* Regex Special Characters */
-    if (s[0] == '.') { free(s); return mpc_any(); }
-    if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-    if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+    s->memos_num = 0;
+    s->memos_slots = slots;
+    s->memos = calloc(slots, sizeof(mpc_memo_t*));
 
-    /* Regex Escape */
-    if (s[0] == '\\') {
-        p = mpc_re_escape_char(s[1]);
-        p = (p == NULL) ? mpc_char(s[1]) : p;
-        free(s);
-        return p;
+    for (j = 0; j < old_slots; j++) {
+        if (!old[j]) { continue; }
+        if (old[j]->pos >= keep) {
+            mpc_stack_memos_put(s, old[j]);
+        } else {
+            mpc_memo_delete(old[j]);
+        }
     }
 
-    /* Regex Standard */
-    p = mpc_char(s[0]);
-    free(s);
-    return p;
+    free(old);
 }
 
-static char *mpc_re_range_escape_char(char c) {
-    switch (c) {
-        case '-': return "-";
-        case 'a': return "\a";
-        case 'f': return "\f";
-        case 'n': return "\n";
-        case 'r': return "\r";
-        case 't': return "\t";
-        case 'v': return "\v";
-        case 'b': return "\b";
-        case 'd': return "0123456789";
-        case 's': return " \f\n\r\t\v";
-        case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-        default: return NULL;
+static void mpc_stack_memos_add(mpc_stack_t *s, mpc_input_t *i, mpc_memo_t *m) {
+    if ((s->memos_num + 1) * 2 > s->memos_slots) {
+        mpc_stack_memos_rebuild(s, i);
     }
+    mpc_stack_memos_put(s, m);
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
-
-    mpc_parser_t *out;
-    char *range = calloc(1,1);
-    char *tmp = NULL;
-    char *s = x;
-    char start, end;
-    int i, j;
-    int comp = 0;
-
-    if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-    if (s[0] == '^' && 
-            s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
-
-    if (s[0] == '^') { comp = 1;}
+static void mpc_stack_memos_clear(mpc_stack_t *s) {
+    int j;
+    if (s->memos_num == 0) { return; }
+    for (j = 0; j < s->memos_slots; j++) {
+        if (s->memos[j]) {
+            mpc_memo_delete(s->memos[j]);
+            s->memos[j] = NULL;
+        }
+    }
+    s->memos_num = 0;
+}
 
-    for (i = comp; i < strlen(s); i++){
+static void mpc_stack_delete(mpc_stack_t *s) {
+    if (s == NULL) { return; }
+    free(s->memos);
+    free(s->parsers);
+    free(s->states);
+    free(s->results);
+    free(s->returns);
+#ifdef MPC_PROFILE
+    free(s->frames);
+#endif
+    free(s);
+}
 
-        /* Regex Range Escape */
-        if (s[i] == '\\') {
-            tmp = mpc_re_range_escape_char(s[i+1]);
-            if (tmp != NULL) {
-                range = realloc(range, strlen(range) + strlen(tmp) + 1);
-                strcat(range, tmp);
-            } else {
-                range = realloc(range, strlen(range) + 1 + 1);
-                range[strlen(range) + 1] = '\0';
-                range[strlen(range) + 0] = s[i+1];      
-            }
-            i++;
-        }
+static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r, mpc_err_t **side) {
+    int success = s->returns[0];
 
-        /* Regex Range...Range */
-        else if (s[i] == '-') {
-            if (s[i+1] == '\0' || i == 0) {
-                range = realloc(range, strlen(range) + strlen("-") + 1);
-                strcat(range, "-");
-            } else {
-                start = s[i-1]+1;
-                end = s[i+1]-1;
-                for (j = start; j <= end; j++) {
-                    range = realloc(range, strlen(range) + 1 + 1);
-                    range[strlen(range) + 1] = '\0';
-                    range[strlen(range) + 0] = j;
-                }        
-            }
+    if (success) {
+        r->output = s->results[0].output;
+        if (side) {
+            if (s->pend.p) { mpc_stack_resolve(s); }
+            *side = s->err;
+        } else {
+            mpc_err_delete(s->err);
         }
+    } else {
+        mpc_stack_err(s, s->results[0].error);
+        r->error = s->err;
+        if (r->error) { mpc_input_locate(s->input, &r->error->state); }
+    }
 
-        /* Regex Range Normal */
-        else {
-            range = realloc(range, strlen(range) + 1 + 1);
-            range[strlen(range) + 1] = '\0';
-            range[strlen(range) + 0] = s[i];
-        }
+    mpc_stack_memos_clear(s);
 
+    if (s->input->spare) {
+        mpc_stack_delete(s);
+    } else {
+        s->input->spare = s;
     }
 
-    out = comp ? mpc_noneof(range) : mpc_oneof(range);
+    return success;
+}
 
-    free(x);
-    free(range);
+/* Stack Parser Stuff */
 
-    return out;
+static void mpc_stack_set_state(mpc_stack_t *s, int x) {
+    s->states[s->parsers_num-1] = x;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
+    if (s->parsers_num == s->parsers_slots) {
+        s->parsers_slots = s->parsers_slots ? s->parsers_slots * 2 : 64;
+        s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
+        s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
+#ifdef MPC_PROFILE
+        s->frames = realloc(s->frames, sizeof(struct mpc_profile_frame_t) * s->parsers_slots);
+#endif
+    }
+}
 
-    char *err_msg;
-    mpc_parser_t *err_out;
-    mpc_result_t r;
-    mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+static void mpc_stack_pushp(mpc_stack_t *s, mpc_parser_t *p) {
+    mpc_stack_parsers_reserve_more(s);
+    s->parsers[s->parsers_num] = p;
+    s->states[s->parsers_num] = 0;
+#ifdef MPC_PROFILE
+    if (p->name && s->input->counts) {
+        mpc_profile_frame_t *f = &s->frames[s->parsers_num];
+        f->entry = mpc_profile_entry(s->input->counts, p);
+        s->input->counts->entries[f->entry].active++;
+        f->cycles = mpc_profile_clock();
+        f->rewinds = s->input->rewinds;
+        f->pos = s->input->state.pos;
+    }
+#endif
+    s->parsers_num++;
+}
 
-    Regex  = mpc_new("regex");
-    Term   = mpc_new("term");
-    Factor = mpc_new("factor");
-    Base   = mpc_new("base");
-    Range  = mpc_new("range");
+static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+    *p = s->parsers[s->parsers_num-1];
+    *st = s->states[s->parsers_num-1];
+    s->parsers_num--;
+}
 
-    mpc_define(Regex, mpc_and(2, mpcf_re_or,
-                Term, 
-                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-                (mpc_dtor_t)mpc_delete
-                ));
+static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
+    *p = s->parsers[s->parsers_num-1];
+    *st = s->states[s->parsers_num-1];
+}
 
-    mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+#ifdef MPC_PROFILE
 
-    mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-                Base,
-                mpc_or(5,
-                    mpc_char('*'), mpc_char('+'), mpc_char('?'),
-                    mpc_brackets(mpc_int(), free),
-                    mpc_pass()),
-                (mpc_dtor_t)mpc_delete
-                ));
+/*
+ ** Counts the parser on top of the stack as it
+ ** finishes. Backtracks, bytes and cycles include
+ ** those of the parsers it ran, and are only added
+ ** by the outermost of any recursive runs so they
+ ** are not counted twice.
+ */
 
-    mpc_define(Base, mpc_or(4,
-                mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-                mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-                mpc_apply(mpc_escape(), mpcf_re_escape),
-                mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
-                ));
+static void mpc_stack_profile(mpc_stack_t *s, int success) {
 
-    mpc_define(Range, mpc_apply(
-                mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-                mpcf_re_range
-                ));
+    mpc_parser_t *p = s->parsers[s->parsers_num-1];
+    mpc_profile_frame_t *f = &s->frames[s->parsers_num-1];
+    mpc_profile_entry_t *e;
 
-    RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+    if (p->name == NULL || s->input->counts == NULL) { return; }
 
-    if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-        err_msg = mpc_err_string(r.error);
-        err_out = mpc_failf("Invalid Regex: %s", err_msg);
-        mpc_err_delete(r.error);  
-        free(err_msg);
-        r.output = err_out;
+    e = &s->input->counts->entries[f->entry];
+    e->calls++;
+    e->active--;
+
+    if (success) {
+        e->successes++;
+    } else {
+        e->failures++;
     }
 
-    mpc_delete(RegexEnclose);
-    mpc_cleanup(5, Regex, Term, Factor, Base, Range);
+    if (e->active == 0) {
+        e->backtracks += s->input->rewinds - f->rewinds;
+        e->cycles += mpc_profile_clock() - f->cycles;
+        if (success) { e->bytes += s->input->state.pos - f->pos; }
+    }
+}
 
-    return r.output;
+#define MPC_PROFILE_LEAVE(x) mpc_stack_profile(stk, x)
+#else
+#define MPC_PROFILE_LEAVE(x)
+#endif
 
+static int mpc_stack_empty(mpc_stack_t *s) {
+    return s->parsers_num == 0;
 }
 
-/*
- ** Common Fold Functions
- */
+/* Stack Result Stuff */
 
-void mpcf_dtor_null(mpc_val_t *x) { return; }
+static mpc_result_t mpc_result_err(mpc_err_t *e) {
+    mpc_result_t r;
+    r.error = e;
+    return r;
+}
 
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+static mpc_result_t mpc_result_out(mpc_val_t *x) {
+    mpc_result_t r;
+    r.output = x;
+    return r;
+}
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 10);
-    free(x);
-    return y;
+static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
+    if (s->results_num == s->results_slots) {
+        s->results_slots = s->results_slots ? s->results_slots * 2 : 64;
+        s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
+        s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
+    }
 }
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 16);
-    free(x);
-    return y;
+static void mpc_stack_pushr(mpc_stack_t *s, mpc_result_t x, int r) {
+    mpc_stack_results_reserve_more(s);
+    s->results[s->results_num] = x;
+    s->returns[s->results_num] = r;
+    s->results_num++;
 }
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-    int *y = malloc(sizeof(int));
-    *y = strtol(x, NULL, 8);
-    free(x);
-    return y;
+static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
+    int r;
+    *x = s->results[s->results_num-1];
+    r = s->returns[s->results_num-1];
+    s->results_num--;
+    return r;
 }
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-    float* y = malloc(sizeof(float));
-    *y = strtod(x, NULL);
-    free(x);
-    return y;
+static int mpc_stack_peekr(mpc_stack_t *s, mpc_result_t *x) {
+    *x = s->results[s->results_num-1];
+    return s->returns[s->results_num-1];
 }
 
-static char mpc_escape_input_c[]  = {
-    '\a', '\b', '\f', '\n', '\r',
-    '\t', '\v', '\\', '\'', '\"', '\0'};
+static void mpc_stack_popr_err(mpc_stack_t *s, int n) {
+    mpc_result_t x;
+    while (n) {
+        mpc_stack_popr(s, &x);
+        mpc_stack_err(s, x.error);
+        n--;
+    }
+}
 
-static char *mpc_escape_output_c[] = {
-    "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
-    "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+static void mpc_stack_popr_out(mpc_stack_t *s, int n, mpc_dtor_t *ds) {
+    mpc_result_t x;
+    while (n) {
+        mpc_stack_popr(s, &x);
+        ds[n-1](x.output);
+        n--;
+    }
+}
 
-static char mpc_escape_input_raw_re[] = { '/' };
-static char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+static void mpc_stack_popr_out_single(mpc_stack_t *s, int n, mpc_dtor_t dx) {
+    mpc_result_t x;
+    while (n) {
+        mpc_stack_popr(s, &x);
+        dx(x.output);
+        n--;
+    }
+}
 
-static char mpc_escape_input_raw_cstr[] = { '"' };
-static char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+static void mpc_stack_popr_n(mpc_stack_t *s, int n) {
+    mpc_result_t x;
+    while (n) {
+        mpc_stack_popr(s, &x);
+        n--;
+    }
+}
 
-static char mpc_escape_input_raw_cchar[] = { '\'' };
-static char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+static mpc_val_t *mpc_stack_merger_out(mpc_stack_t *s, int n, mpc_fold_t f) {
+    mpc_val_t *x = f(n, (mpc_val_t**)(&s->results[s->results_num-n]));
+    mpc_stack_popr_n(s, n);
+    return x;
+}
 
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
+/*
+ ** A repeat cut short by a failed commit frees the
+ ** values it holds. Only `count` is given their
+ ** destructor, so for `many` and `many1` it is
+ ** known only for the library's own folds, and
+ ** anything else is folded and then leaked.
+ */
 
-    int i;
-    int found;
-    char *s = x;
-    char *y = calloc(1, 1);
-    char buff[2];
+static void mpc_stack_popr_repeat(mpc_stack_t *s, int n, mpc_parser_t *p, int span) {
 
-    while (*s) {
+    mpc_fold_t f = p->data.repeat.f;
 
-        i = 0;
-        found = 0;
+    if (span || f == mpcf_null) {
+        mpc_stack_popr_n(s, n);
+    } else if (p->data.repeat.dx) {
+        mpc_stack_popr_out_single(s, n, p->data.repeat.dx);
+    } else if (f == mpcf_strfold) {
+        mpc_stack_popr_out_single(s, n, free);
+    } else if (f == mpcf_fold_ast) {
+        mpc_stack_popr_out_single(s, n, (mpc_dtor_t)mpc_ast_delete);
+    } else {
+        mpc_stack_merger_out(s, n, f);
+    }
+}
 
-        while (output[i]) {
-            if (*s == input[i]) {
-                y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-                strcat(y, output[i]);
-                found = 1;
-                break;
-            }
-            i++;
-        }
+static mpc_err_t *mpc_stack_merger_err(mpc_stack_t *s, int n) {
+    mpc_err_t *x = s->quiet ? NULL : mpc_err_or((mpc_err_t**)(&s->results[s->results_num-n]), n);
+    mpc_stack_popr_n(s, n);
+    return x;
+}
 
-        if (!found) {
-            y = realloc(y, strlen(y) + 2);
-            buff[0] = *s; buff[1] = '\0';
-            strcat(y, buff);
-        }
+/*
+ ** This is rather pleasant. The core parsing routine
+ ** is written in about 200 lines of C.
+ **
+ ** I also love the way in which each parsing type
+ ** concisely matches some construct or pattern.
+ **
+ ** Particularly nice are the `or` and `and`
+ ** types which have a broken but mirrored structure
+ ** with return value and error reflected.
+ **
+ ** When this function was written in recursive form
+ ** it looked pretty nice. But I've since switched
+ ** it around to an awkward while loop. It was an
+ ** unfortunate change for code simplicity but it
+ ** is noble in the name of performance (and 
+ ** not smashing the stack).
+ **
+ ** But it is now a pretty ugly beast...
+ */
 
-        s++;
-    }
+#define MPC_CONTINUE(st, x) mpc_stack_set_state(stk, st); mpc_stack_pushp(stk, x); continue
+#define MPC_SUCCESS(x) MPC_PROFILE_LEAVE(1); mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_out(x), 1); continue
+#define MPC_FAILURE(x) MPC_PROFILE_LEAVE(0); mpc_stack_popp(stk, &p, &st); mpc_stack_pushr(stk, mpc_result_err(stk->quiet ? NULL : (x)), 0); continue
+#define MPC_PRIMATIVE(x, f) if (f) { MPC_SUCCESS(x); } else { MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input")); }
+
+/*
+ ** Parsers whose output is always exactly the
+ ** text they consumed are marked as spans when
+ ** they are built. The outermost span reached
+ ** during a parse runs with every output switched
+ ** off, so nothing is allocated per character and
+ ** nothing is folded, and on success its result
+ ** is copied out of the input in one go.
+ */
 
+static void mpc_stack_span_end(mpc_stack_t *s, mpc_input_t *i, int start) {
 
-    return y;
+    if (s->returns[s->results_num-1]) {
+        s->results[s->results_num-1].output = mpc_input_slice(i, start);
+    }
+
+    if (i->type == MPC_INPUT_PIPE) { mpc_input_unmark(i); }
 }
 
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
+/*
+ ** Some parsers, when the next character is not
+ ** one they can start with, always fail straight
+ ** away with an error that only depends on the
+ ** parser and the input state, and without merging
+ ** any other errors. `mpc_first` finds the bytes
+ ** such a parser can start with, and `mpc_first_err`
+ ** builds the error it would fail with. Leading
+ ** parsers that consume nothing and cannot fail
+ ** are looked through.
+ */
 
-    int i;
-    int found = 0;
-    char *s = x;
-    char *y = calloc(1, 1);
-    char buff[2];
+static int mpc_first(mpc_parser_t *p, unsigned char *set, int depth) {
 
-    while (*s) {
+    unsigned char x[32];
+    int j;
 
-        i = 0;
-        found = 0;
+    if (depth > 64) { return 0; }
 
-        while (output[i]) {
-            if ((*(s+0)) == output[i][0] &&
-                    (*(s+1)) == output[i][1]) {
-                y = realloc(y, strlen(y) + 2);
-                buff[0] = input[i]; buff[1] = '\0';
-                strcat(y, buff);
-                found = 1;
-                s++;
-                break;
+    switch (p->type) {
+
+        case MPC_TYPE_ANY:    memset(set, 0xFF, 32); return 1;
+        case MPC_TYPE_CLASS:  memcpy(set, p->data.class.x, 32); return 1;
+        case MPC_TYPE_SINGLE:
+            memset(set, 0, 32);
+            mpc_set_add(set, (unsigned char)p->data.single.x);
+            return 1;
+        case MPC_TYPE_STRING:
+            memset(set, 0, 32);
+            mpc_set_add(set, (unsigned char)p->data.string.x[0]);
+            return p->data.string.x[0] != '\0';
+
+        case MPC_TYPE_EXPECT:   return mpc_first(p->data.expect.x, set, depth+1);
+        case MPC_TYPE_APPLY:    return mpc_first(p->data.apply.x, set, depth+1);
+        case MPC_TYPE_APPLY_TO: return mpc_first(p->data.apply_to.x, set, depth+1);
+        case MPC_TYPE_MEMO:     return mpc_first(p->data.memo.x, set, depth+1);
+        case MPC_TYPE_COMMIT:   return mpc_first(p->data.predict.x, set, depth+1);
+        case MPC_TYPE_DFA:      return mpc_first(p->data.dfa.x, set, depth+1);
+        case MPC_TYPE_MANY1:    return mpc_first(p->data.repeat.x, set, depth+1);
+
+        case MPC_TYPE_OR:
+            memset(set, 0, 32);
+            if (p->data.or.n == 0) { return 0; }
+            for (j = 0; j < p->data.or.n; j++) {
+                if (!mpc_first(p->data.or.xs[j], x, depth+1)) { return 0; }
+                mpc_set_union(set, x);
             }
-            i++;
-        }
+            return 1;
 
-        if (!found) {
-            y = realloc(y, strlen(y) + 2);
-            buff[0] = *s; buff[1] = '\0';
-            strcat(y, buff);
-        }
+        case MPC_TYPE_AND:
+            for (j = 0; j < p->data.and.n; j++) {
+                switch (p->data.and.xs[j]->type) {
+                    case MPC_TYPE_PASS:
+                    case MPC_TYPE_LIFT:
+                    case MPC_TYPE_LIFT_VAL:
+                    case MPC_TYPE_STATE: continue;
+                    default: return mpc_first(p->data.and.xs[j], set, depth+1);
+                }
+            }
+            return 0;
 
-        if (*s == '\0') { break; }
-        else { s++; }
+        default: return 0;
     }
+}
 
-    return y;
+static mpc_err_t *mpc_first_err(mpc_input_t *i, mpc_parser_t *p) {
 
-}
+    int j;
+    mpc_err_t **errs;
+    mpc_err_t *e;
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-    free(x);
-    return y;
-}
+    switch (p->type) {
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-    free(x);
-    return y;
+        case MPC_TYPE_EXPECT:   return mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i));
+        case MPC_TYPE_APPLY:    return mpc_first_err(i, p->data.apply.x);
+        case MPC_TYPE_APPLY_TO: return mpc_first_err(i, p->data.apply_to.x);
+        case MPC_TYPE_MEMO:     return mpc_first_err(i, p->data.memo.x);
+        case MPC_TYPE_COMMIT:   return mpc_first_err(i, p->data.predict.x);
+        case MPC_TYPE_DFA:      return mpc_first_err(i, p->data.dfa.x);
+        case MPC_TYPE_MANY1:    return mpc_err_many1(mpc_first_err(i, p->data.repeat.x));
+
+        case MPC_TYPE_OR:
+            errs = malloc(sizeof(mpc_err_t*) * p->data.or.n);
+            for (j = 0; j < p->data.or.n; j++) {
+                errs[j] = mpc_first_err(i, p->data.or.xs[j]);
+            }
+            e = mpc_err_or(errs, p->data.or.n);
+            free(errs);
+            return e;
+
+        case MPC_TYPE_AND:
+            for (j = 0; j < p->data.and.n; j++) {
+                switch (p->data.and.xs[j]->type) {
+                    case MPC_TYPE_PASS:
+                    case MPC_TYPE_LIFT:
+                    case MPC_TYPE_LIFT_VAL:
+                    case MPC_TYPE_STATE: continue;
+                    default: return mpc_first_err(i, p->data.and.xs[j]);
+                }
+            }
+            return NULL;
+
+        default: return mpc_err_fail(i->filename, i->state, "Incorrect Input");
+    }
 }
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-    free(x);
-    return y;  
+/*
+ ** Alternatives of an optimised `or` which cannot
+ ** start with the next byte are not run. They are
+ ** given the error they would have failed with so
+ ** the result is exactly the same. A zero byte may
+ ** be the end of the input, so every alternative
+ ** is run for it.
+ */
+
+static void mpc_stack_skip_alternatives(mpc_stack_t *stk, mpc_input_t *i, mpc_parser_t *p, int *st) {
+
+    unsigned long mask = p->data.or.table[(unsigned char)mpc_input_peekc(i)];
+
+    while (*st < p->data.or.n && !((mask >> *st) & 1)) {
+        mpc_stack_pushr(stk, mpc_result_err(stk->quiet ? NULL : mpc_first_err(i, p->data.or.xs[*st])), 0);
+        (*st)++;
+    }
 }
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-    free(x);
-    return y;
+/*
+ ** When outputs are off, `many` and `many1` of a
+ ** character class just skip over the run of the
+ ** class, and merge the error its next attempt
+ ** would have failed with. `many` of a string body
+ ** skips what it can and leaves the rest, and the
+ ** error, to the usual loop.
+ */
+
+static mpc_err_t *mpc_class_err(mpc_input_t *i, mpc_parser_t *x) {
+    if (x->type == MPC_TYPE_EXPECT) {
+        return mpc_err_new(i->filename, i->state, x->data.expect.m, mpc_input_peekc(i));
+    } else {
+        return mpc_err_fail(i->filename, i->state, "Incorrect Input");
+    }
 }
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-    free(x);
-    return y;
+/*
+ ** A fed input which has not ended cannot yet
+ ** decide a primitive that reads past what it has
+ ** been fed, so the parse must wait for more. A
+ ** string is only waited on if what has arrived
+ ** of it so far matches.
+ */
+
+static int mpc_input_waits(mpc_input_t *i, mpc_parser_t *p) {
+
+    int n;
+
+    if (i->type != MPC_INPUT_PIPE || i->file || i->ended) { return 0; }
+
+    n = mpc_input_buffer_end(i) - i->state.pos;
+
+    switch (p->type) {
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_SINGLE:
+        case MPC_TYPE_CLASS:
+        case MPC_TYPE_SATISFY:
+        case MPC_TYPE_ANCHOR:
+            return n < 1;
+        case MPC_TYPE_STRING:
+            if ((int)strlen(p->data.string.x) <= n) { return 0; }
+            return memcmp(p->data.string.x, i->buffer + (i->state.pos - i->buffer_start), n) == 0;
+        default:
+            return 0;
+    }
 }
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-    free(x);
+/*
+ ** A parse waiting on the whitespace of a blank
+ ** (its output thrown away) which can only finish
+ ** once the blank stops will give the same result
+ ** whatever comes next, apart from how far along
+ ** it stops. This is how a token ends a match.
+ */
+
+static int mpc_class_blank(const unsigned char *x) {
+
+    int c;
+    for (c = 0; c < 256; c++) {
+        if (((x[c >> 3] >> (c & 7)) & 1) != (c != '\0' && strchr(" \f\n\r\t\v", c) != NULL)) { return 0; }
+    }
+    return 1;
+}
+
+static int mpc_stack_trails_blank(mpc_stack_t *s) {
+
+    int j = s->parsers_num - 1;
+    mpc_parser_t *p;
+
+    if (j < 0 || s->parsers[j]->type != MPC_TYPE_CLASS
+    || !mpc_class_blank(s->parsers[j]->data.class.x)) { return 0; }
+
+    for (j--; j >= 0 && s->parsers[j]->type == MPC_TYPE_EXPECT; j--);
+    if (j < 0 || s->parsers[j]->type != MPC_TYPE_MANY) { return 0; }
+
+    for (j--; j >= 0 && s->parsers[j]->type == MPC_TYPE_EXPECT; j--);
+    if (j < 0 || s->parsers[j]->type != MPC_TYPE_APPLY
+    || s->parsers[j]->data.apply.f != mpcf_free) { return 0; }
+
+    /* A span begun outside the blank would take its whitespace in */
+    if (s->span && s->span <= j + 1) { return 0; }
+
+    for (j--; j >= 0; j--) {
+        p = s->parsers[j];
+        switch (p->type) {
+            case MPC_TYPE_EXPECT:
+            case MPC_TYPE_APPLY:
+            case MPC_TYPE_APPLY_TO:
+            case MPC_TYPE_PREDICT:
+            case MPC_TYPE_MAYBE:
+            case MPC_TYPE_OR:
+            case MPC_TYPE_MEMO:
+            case MPC_TYPE_COMMIT:
+                break;
+            case MPC_TYPE_AND:
+                if (s->states[j] != p->data.and.n) { return 0; }
+                break;
+            default:
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+static mpc_stack_t *mpc_parse_start(mpc_input_t *i, mpc_parser_t *init, int quiet) {
+
+    mpc_stack_t *stk = mpc_stack_new(i, quiet);
+
+    i->marks_floor = i->marks_num;
+    i->committed = 0;
+    i->cut = 0;
+
+    stk->span = 0;
+    stk->span_start = 0;
+    mpc_stack_pushp(stk, init);
+
+    return stk;
+}
+
+/*
+ ** Runs the parse on `stk` until it is over, or
+ ** returns -1 with everything needed to carry on
+ ** left in `stk` if the input has to wait.
+ */
+
+static int mpc_parse_resume(mpc_input_t *i, mpc_stack_t *stk, mpc_result_t *final, mpc_err_t **side) {
+
+    /* Stack */
+    int st = 0;
+    mpc_parser_t *p = NULL;
+    int quiet = stk->quiet;
+
+    /* Spans */
+    int span = stk->span;
+    int span_start = stk->span_start;
+
+    /* Variables */
+    char *s;
+    char **o;
+    mpc_result_t r;
+    mpc_memo_t *m;
+    mpc_err_t *e;
+    mpc_pending_t pend;
+    mpc_parser_t *c;
+    int n, scan;
+
+    /* Go! */
+    while (!mpc_stack_empty(stk)) {
+
+        if (span > stk->parsers_num) {
+            mpc_stack_span_end(stk, i, span_start);
+            span = 0;
+        }
+
+        mpc_stack_peepp(stk, &p, &st);
+
+        if (mpc_input_waits(i, p)) {
+            stk->span = span;
+            stk->span_start = span_start;
+            return -1;
+        }
+
+        if (!span && st == 0 && p->span && mpc_input_spans(i)) {
+            span = stk->parsers_num;
+            span_start = i->state.pos;
+            if (i->type == MPC_INPUT_PIPE) { mpc_input_mark(i); }
+        }
+
+        s = NULL;
+        o = span ? NULL : &s;
+
+        switch (p->type) {
+
+            /* Basic Parsers */
+
+            case MPC_TYPE_ANY:       MPC_PRIMATIVE(s, mpc_input_any(i, o));
+            case MPC_TYPE_SINGLE:    MPC_PRIMATIVE(s, mpc_input_char(i, p->data.single.x, o));
+            case MPC_TYPE_CLASS:     MPC_PRIMATIVE(s, mpc_input_class(i, p->data.class.x, o));
+            case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, o));
+            case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, o));
+
+                                     /* Other parsers */
+
+            case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Parser Undefined!"));      
+            case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+            case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i->filename, i->state, p->data.fail.m));
+            case MPC_TYPE_LIFT:      MPC_SUCCESS(span ? NULL : p->data.lift.lf());
+            case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+            case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_state_copy(mpc_input_state(i)));
+
+            case MPC_TYPE_ANCHOR:
+                                     if (mpc_input_anchor(i, p->data.anchor.f)) {
+                                         MPC_SUCCESS(NULL);
+                                     } else {
+                                         MPC_FAILURE(mpc_err_new(i->filename, i->state, "anchor", mpc_input_peekc(i)));
+                                     }
+
+                                     /* Application Parsers */
+
+            case MPC_TYPE_EXPECT:
+                                     if (st == 0) { MPC_CONTINUE(1, p->data.expect.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             mpc_err_delete(r.error); 
+                                             MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.expect.m, mpc_input_peekc(i)));
+                                         }
+                                     }
+
+            case MPC_TYPE_APPLY:
+                                     if (st == 0) { MPC_CONTINUE(1, p->data.apply.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(p->data.apply.f(r.output));
+                                         } else {
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+
+            case MPC_TYPE_APPLY_TO:
+                                     if (st == 0) { MPC_CONTINUE(1, p->data.apply_to.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(p->data.apply_to.f(r.output, p->data.apply_to.d));
+                                         } else {
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+
+            case MPC_TYPE_PREDICT:
+                                     if (st == 0) { mpc_input_backtrack_disable(i); MPC_CONTINUE(1, p->data.predict.x); }
+                                     if (st == 1) {
+                                         mpc_input_backtrack_enable(i);
+                                         MPC_PROFILE_LEAVE(mpc_stack_peekr(stk, &r));
+                                         mpc_stack_popp(stk, &p, &st);
+                                         continue;
+                                     }
+
+            /* Memos before the commit can never be reached again */
+            case MPC_TYPE_COMMIT:
+                                     if (st == 0) { MPC_CONTINUE(1, p->data.predict.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             mpc_input_commit(i);
+                                             mpc_stack_memos_clear(stk);
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+
+            case MPC_TYPE_MEMO:
+                                     if (st == 0) {
+                                         if (i->backtrack < 1) { MPC_CONTINUE(2, p->data.memo.x); }
+                                         m = mpc_stack_memos_find(stk, p, i->state.pos);
+                                         if (m) {
+                                             mpc_input_jump(i, m->state, m->last);
+                                             if (m->err && m->err->state.pos >= 0) { mpc_stack_err(stk, mpc_err_copy(m->err)); }
+                                             if (m->pend.p) { mpc_stack_pend(stk, m->pend); }
+                                             if (m->success) {
+                                                 MPC_SUCCESS(p->data.memo.c(m->result.output));
+                                             } else {
+                                                 MPC_FAILURE(mpc_err_copy(m->result.error));
+                                             }
+                                         }
+                                         mpc_stack_pushr(stk, mpc_result_out(mpc_memo_new(p, i->state.pos, stk->err, stk->pend)), 1);
+                                         stk->err = quiet ? NULL : mpc_err_fail(i->filename, mpc_state_invalid(), "Unknown Error");
+                                         stk->pend.p = NULL;
+                                         MPC_CONTINUE(1, p->data.memo.x);
+                                     }
+                                     if (st == 1) {
+                                         m = stk->results[stk->results_num-2].output;
+                                         m->success = stk->returns[stk->results_num-1];
+                                         m->state = i->state;
+                                         m->last = i->last;
+
+                                         e = stk->err;
+                                         pend = stk->pend;
+                                         stk->err = m->err;
+                                         stk->pend = m->pend;
+                                         m->err = e;
+                                         m->pend = pend;
+                                         if (e && e->state.pos >= 0) { mpc_stack_err(stk, mpc_err_copy(e)); }
+                                         if (pend.p) { mpc_stack_pend(stk, pend); }
+
+                                         mpc_stack_popr(stk, &r);
+                                         mpc_stack_popr_n(stk, 1);
+
+                                         if (m->success) {
+                                             m->result.output = p->data.memo.c(r.output);
+                                             mpc_stack_memos_add(stk, i, m);
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             m->result.error = quiet ? NULL : mpc_err_copy(r.error);
+                                             mpc_stack_memos_add(stk, i, m);
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+                                     if (st == 2) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+
+            case MPC_TYPE_DFA:
+                                     if (st == 0) {
+                                         if (mpc_input_contiguous(i) && i->backtrack > 0) {
+                                             n = mpc_dfa_match(p->data.dfa.d, i->string + i->state.pos, i->length - i->state.pos, &scan);
+                                             if (n >= 0) {
+                                                 pend.p = p->data.dfa.x;
+                                                 pend.state = i->state;
+                                                 pend.last = i->last;
+                                                 pend.end = i->state.pos + scan;
+                                                 if (!quiet) { mpc_stack_pend(stk, pend); }
+                                                 mpc_input_advance(i, n);
+                                                 MPC_SUCCESS(span ? NULL : mpc_input_slice(i, pend.state.pos));
+                                             }
+                                         }
+                                         MPC_CONTINUE(1, p->data.dfa.x);
+                                     }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             MPC_FAILURE(r.error);
+                                         }
+                                     }
+
+                                     /* Optional Parsers */
+
+                                     /* TODO: Update Not Error Message */
+
+            case MPC_TYPE_NOT:
+                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(1, p->data.not.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             mpc_input_rewind(i);
+                                             if (!span) { p->data.not.dx(r.output); }
+                                             MPC_FAILURE(mpc_err_new(i->filename, i->state, "opposite", mpc_input_peekc(i)));
+                                         } else {
+                                             mpc_input_unmark(i);
+                                             if (i->cut) { MPC_FAILURE(r.error); }
+                                             mpc_stack_err(stk, r.error);
+                                             MPC_SUCCESS(span ? NULL : p->data.not.lf());
+                                         }
+                                     }
+
+            case MPC_TYPE_MAYBE:
+                                     if (st == 0) { MPC_CONTINUE(1, p->data.not.x); }
+                                     if (st == 1) {
+                                         if (mpc_stack_popr(stk, &r)) {
+                                             MPC_SUCCESS(r.output);
+                                         } else {
+                                             if (i->cut) { MPC_FAILURE(r.error); }
+                                             mpc_stack_err(stk, r.error);
+                                             MPC_SUCCESS(span ? NULL : p->data.not.lf());
+                                         }
+                                     }
+
+                                     /* Repeat Parsers */
+
+            case MPC_TYPE_MANY:
+                                     if (st == 0 && span && (c = mpc_class_of(p->data.repeat.x)) && mpc_input_contiguous(i)) {
+                                         mpc_input_advance(i, mpc_class_run(&c->data.class, -1, i->string + i->state.pos, i->length - i->state.pos));
+                                         if (!quiet) { mpc_stack_err(stk, mpc_class_err(i, p->data.repeat.x)); }
+                                         MPC_SUCCESS(NULL);
+                                     }
+                                     if (st == 0 && span && (c = mpc_escaped_of(p->data.repeat.x)) && mpc_input_contiguous(i)) {
+                                         mpc_input_advance(i, mpc_escaped_run(&c->data.class, i->string + i->state.pos, i->length - i->state.pos));
+                                     }
+                                     if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+                                     if (st >  0) {
+                                         if (mpc_stack_peekr(stk, &r)) {
+                                             MPC_CONTINUE(st+1, p->data.repeat.x);
+                                         } else {
+                                             mpc_stack_popr(stk, &r);
+                                             if (i->cut) {
+                                                 mpc_stack_popr_repeat(stk, st-1, p, span);
+                                                 MPC_FAILURE(r.error);
+                                             }
+                                             mpc_stack_err(stk, r.error);
+                                             MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? mpcf_null : p->data.repeat.f));
+                                         }
+                                     }
+
+            case MPC_TYPE_MANY1:
+                                     if (st == 0 && span && (c = mpc_class_of(p->data.repeat.x)) && mpc_input_contiguous(i)) {
+                                         n = mpc_class_run(&c->data.class, -1, i->string + i->state.pos, i->length - i->state.pos);
+                                         mpc_input_advance(i, n);
+                                         if (n == 0) { MPC_FAILURE(mpc_err_many1(mpc_class_err(i, p->data.repeat.x))); }
+                                         if (!quiet) { mpc_stack_err(stk, mpc_class_err(i, p->data.repeat.x)); }
+                                         MPC_SUCCESS(NULL);
+                                     }
+                                     if (st == 0) { MPC_CONTINUE(st+1, p->data.repeat.x); }
+                                     if (st >  0) {
+                                         if (mpc_stack_peekr(stk, &r)) {
+                                             MPC_CONTINUE(st+1, p->data.repeat.x);
+                                         } else {
+                                             if (st == 1) {
+                                                 mpc_stack_popr(stk, &r);
+                                                 MPC_FAILURE(mpc_err_many1(r.error));
+                                             } else if (i->cut) {
+                                                 mpc_stack_popr(stk, &r);
+                                                 mpc_stack_popr_repeat(stk, st-1, p, span);
+                                                 MPC_FAILURE(r.error);
+                                             } else {
+                                                 mpc_stack_popr(stk, &r);
+                                                 mpc_stack_err(stk, r.error);
+                                                 MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? mpcf_null : p->data.repeat.f));
+                                             }
+                                         }
+                                     }
+
+            case MPC_TYPE_COUNT:
+                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.repeat.x); }
+                                     if (st >  0) {
+                                         if (mpc_stack_peekr(stk, &r)) {
+                                             MPC_CONTINUE(st+1, p->data.repeat.x);
+                                         } else {
+                                             if (st != (p->data.repeat.n+1)) {
+                                                 mpc_stack_popr(stk, &r);
+                                                 mpc_stack_popr_out_single(stk, st-1, span ? mpcf_dtor_null : p->data.repeat.dx);
+                                                 mpc_input_rewind(i);
+                                                 MPC_FAILURE(mpc_err_count(r.error, p->data.repeat.n));
+                                             } else {
+                                                 mpc_stack_popr(stk, &r);
+                                                 mpc_stack_err(stk, r.error);
+                                                 mpc_input_unmark(i);
+                                                 MPC_SUCCESS(mpc_stack_merger_out(stk, st-1, span ? mpcf_null : p->data.repeat.f));
+                                             }
+                                         }
+                                     }
+
+                                     /* Combinatory Parsers */
+
+            case MPC_TYPE_OR:
+
+                                     if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+                                     if (st > 0 && mpc_stack_peekr(stk, &r)) {
+                                         mpc_stack_popr(stk, &r);
+                                         mpc_stack_popr_err(stk, st-1);
+                                         MPC_SUCCESS(r.output);
+                                     }
+                                     if (st > 0 && i->cut) { r.error = mpc_stack_merger_err(stk, st); MPC_FAILURE(r.error); }
+                                     if (p->data.or.table) { mpc_stack_skip_alternatives(stk, i, p, &st); }
+                                     if (st <  p->data.or.n) { MPC_CONTINUE(st+1, p->data.or.xs[st]); }
+                                     if (st == p->data.or.n) { r.error = mpc_stack_merger_err(stk, p->data.or.n); MPC_FAILURE(r.error); }
+
+            case MPC_TYPE_AND:
+
+                                     if (p->data.or.n == 0) { MPC_SUCCESS(span ? NULL : p->data.and.f(0, NULL)); }
+
+                                     if (st == 0) { mpc_input_mark(i); MPC_CONTINUE(st+1, p->data.and.xs[st]); }
+                                     if (st <= p->data.and.n) {
+                                         if (!mpc_stack_peekr(stk, &r)) {
+                                             mpc_input_rewind(i);
+                                             mpc_stack_popr(stk, &r);
+                                             if (span) {
+                                                 mpc_stack_popr_n(stk, st-1);
+                                             } else {
+                                                 mpc_stack_popr_out(stk, st-1, p->data.and.dxs);
+                                             }
+                                             MPC_FAILURE(r.error);
+                                         }
+                                         if (st <  p->data.and.n) { MPC_CONTINUE(st+1, p->data.and.xs[st]); }
+                                         if (st == p->data.and.n) { mpc_input_unmark(i); MPC_SUCCESS(mpc_stack_merger_out(stk, p->data.and.n, span ? mpcf_null : p->data.and.f)); }
+                                     }
+
+                                     /* End */
+
+            default:
+
+                                     MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Unknown Parser Type Id!"));
+        }
+    }
+
+    if (span) { mpc_stack_span_end(stk, i, span_start); }
+
+    return mpc_stack_terminate(stk, final, side);
+
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final, mpc_err_t **side, int quiet) {
+    return mpc_parse_resume(i, mpc_parse_start(i, init, quiet), final, side);
+}
+
+/*
+ ** The machine has no rules to count, so inputs
+ ** being profiled never use it.
+ */
+
+static int mpc_vm_usable(mpc_input_t *i, mpc_parser_t *p) {
+#ifdef MPC_PROFILE
+    if (i->counts) { return 0; }
+#endif
+    return p->prog && mpc_input_contiguous(i) && i->backtrack > 0;
+}
+
+/*
+ ** Most errors built during a parse are thrown
+ ** away, and all of them are if it succeeds. So
+ ** inputs which can be read again are first parsed
+ ** quietly, with every error left as NULL, and
+ ** only if that fails is the parse run again to
+ ** build the error. The machine is quiet already.
+ */
+
+static int mpc_parse_input_run(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+
+    mpc_state_t state = i->state;
+    char last = i->last;
+
+    if (mpc_vm_usable(i, init)) {
+        if (mpc_vm_parse(init->prog, i, final, NULL, NULL)) { return 1; }
+    } else if (i->type != MPC_INPUT_PIPE) {
+        if (mpc_parse_run(i, init, final, NULL, 1)) { return 1; }
+        mpc_input_jump(i, state, last);
+    }
+
+    return mpc_parse_run(i, init, final, NULL, 0);
+}
+
+/*
+ ** When profiling, the counts of each parse are
+ ** kept in the input and added to its report once
+ ** the parse is over.
+ */
+
+#ifdef MPC_PROFILE
+static void mpc_profile_flush(mpc_input_t *i) {
+    if (i->counts) {
+        mpc_profile_merge(i->profile, i->counts);
+        mpc_profile_clear(i->counts);
+    }
+}
+#endif
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
+#ifdef MPC_PROFILE
+    int x = mpc_parse_input_run(i, init, final);
+    mpc_profile_flush(i);
+    return x;
+#else
+    return mpc_parse_input_run(i, init, final);
+#endif
+}
+
+#undef MPC_CONTINUE
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMATIVE
+#undef MPC_PROFILE_LEAVE
+
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+    return mpc_parse_n(filename, string, strlen(string), p, r);
+}
+
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i;
+
+    if (length > 0x7FFFFFFF) {
+        r->output = NULL;
+        r->error = mpc_err_fail(filename, mpc_state_new(), "Input too large!");
+        return 0;
+    }
+
+    i = mpc_input_new_string(filename, string, (int)length);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_file(filename, file);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+    int x;
+    mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+    x = mpc_parse_input(i, p, r);
+    mpc_input_delete(i);
+    return x;
+}
+
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+
+    FILE *f = fopen(filename, "rb");
+    int res;
+
+    if (f == NULL) {
+        r->output = NULL;
+        r->error = mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+        return 0;
+    }
+
+    res = mpc_parse_file(filename, f, p, r);
+    fclose(f);
+    return res;
+}
+
+/*
+ ** A parse context keeps one string input around
+ ** for any number of parses, and with it all the
+ ** stacks used by the parsing loop and machine.
+ */
+
+struct mpc_ctx_t {
+    mpc_input_t *input;
+    mpc_parser_t *parser;
+    mpc_dtor_t destructor;
+    mpc_feed_t feed;
+    void *data;
+    int failed;
+    mpc_stack_t *stack;
+    int start;
+    int blank;
+};
+
+mpc_ctx_t *mpc_ctx_new(void) {
+    mpc_ctx_t *c = malloc(sizeof(mpc_ctx_t));
+    c->input = mpc_input_new_string("", "", 0);
+    c->parser = NULL;
+    c->destructor = NULL;
+    c->feed = NULL;
+    c->data = NULL;
+    c->failed = 0;
+    c->stack = NULL;
+    c->start = 0;
+    c->blank = 0;
+    return c;
+}
+
+mpc_ctx_t *mpc_ctx_new_feed(const char *filename, mpc_parser_t *p, mpc_dtor_t da, mpc_feed_t f, void *d) {
+    mpc_ctx_t *c = malloc(sizeof(mpc_ctx_t));
+    c->input = mpc_input_new_pipe(filename, NULL);
+    c->parser = p;
+    c->destructor = da;
+    c->feed = f;
+    c->data = d;
+    c->failed = 0;
+    c->stack = NULL;
+    c->start = 0;
+    c->blank = 0;
+    return c;
+}
+
+/*
+ ** A match still waiting for input when a fed
+ ** context is done with is run to the end of what
+ ** it has, so everything it holds is freed.
+ */
+
+static void mpc_ctx_abandon(mpc_ctx_t *c) {
+
+    mpc_result_t r;
+
+    if (c->stack == NULL) { return; }
+
+    c->input->ended = 1;
+    if (mpc_parse_resume(c->input, c->stack, &r, NULL)) {
+        if (c->destructor) { c->destructor(r.output); }
+    } else {
+        mpc_err_delete(r.error);
+    }
+    c->stack = NULL;
+}
+
+void mpc_ctx_delete(mpc_ctx_t *c) {
+    mpc_ctx_abandon(c);
+    mpc_input_delete(c->input);
+    free(c);
+}
+
+int mpc_parse_ctx(mpc_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
+
+    mpc_input_t *i = c->input;
+
+    if (length > 0x7FFFFFFF) {
+        r->output = NULL;
+        r->error = mpc_err_fail(filename, mpc_state_new(), "Input too large!");
+        return 0;
+    }
+
+    if (strcmp(i->filename, filename) != 0) {
+        i->filename = realloc(i->filename, strlen(filename) + 1);
+        strcpy(i->filename, filename);
+    }
+
+    i->state = mpc_state_new();
+    i->string = string;
+    i->length = (int)length;
+    i->backtrack = 1;
+    i->marks_num = 0;
+    i->last = '\0';
+#ifdef MPC_LAZY_ROWS
+    i->lines_num = 0;
+    i->lines_scanned = 0;
+#endif
+
+    return mpc_parse_input(i, p, r);
+}
+
+/*
+ ** Each match is parsed under a mark which keeps
+ ** its input in the buffer. When the parse needs
+ ** input that has not been fed yet it stops where
+ ** it is, and the next chunk carries it on, so
+ ** every byte is only parsed once and each result
+ ** is passed on as soon as its last byte arrives.
+ ** A match left waiting only on its trailing blank
+ ** is finished there, and what follows of the blank
+ ** is skipped before the next match begins, just as
+ ** the blank would have taken it.
+ */
+
+int mpc_feed(mpc_ctx_t *c, const char *buf, size_t len) {
+
+    mpc_input_t *i = c->input;
+    mpc_result_t r;
+    int x;
+
+    if (c->failed) { return 0; }
+
+    if (len > (size_t)(0x7FFFFFFF - mpc_input_buffer_end(i))) {
+        mpc_ctx_abandon(c);
+        r.error = mpc_err_fail(i->filename, i->state, "Input too large!");
+        c->feed(0, &r, c->data);
+        c->failed = 1;
+        return 0;
+    }
+
+    if (len == 0) {
+        i->ended = 1;
+    } else {
+        mpc_input_buffer_write(i, buf, (int)len);
+    }
+
+    while (c->stack || !i->ended || i->state.pos < mpc_input_buffer_end(i)) {
+
+        if (c->stack == NULL) {
+            while (c->blank && i->state.pos < mpc_input_buffer_end(i)
+            && strchr(" \f\n\r\t\v", i->buffer[i->state.pos - i->buffer_start])) {
+                mpc_input_any(i, NULL);
+            }
+            if (c->blank && i->state.pos == mpc_input_buffer_end(i) && !i->ended) { return 1; }
+            c->blank = 0;
+            if (i->state.pos == mpc_input_buffer_end(i) && i->ended) { break; }
+            c->start = i->state.pos;
+            mpc_input_mark(i);
+            c->stack = mpc_parse_start(i, c->parser, 0);
+        }
+
+        x = mpc_parse_resume(i, c->stack, &r, NULL);
+
+        if (x < 0 && mpc_stack_trails_blank(c->stack)) {
+            i->ended = 1;
+            x = mpc_parse_resume(i, c->stack, &r, NULL);
+            i->ended = 0;
+            c->blank = 1;
+        }
+
+        if (x < 0) { return 1; }
+        c->stack = NULL;
+
+#ifdef MPC_PROFILE
+        mpc_profile_flush(i);
+#endif
+
+        /* Matches of nothing wait for the end, so they are not repeated */
+        if (x && i->state.pos == c->start && !i->ended) {
+            if (c->destructor) { c->destructor(r.output); }
+            mpc_input_rewind(i);
+            return 1;
+        }
+
+        mpc_input_unmark(i);
+        c->feed(x, &r, c->data);
+
+        if (!x) {
+            c->failed = 1;
+            return 0;
+        }
+
+        if (i->state.pos == c->start) { break; }
+    }
+
+    return 1;
+}
+
+/*
+ ** Events come from the machine, so need a compiled
+ ** parser. If it fails the parsing loop is run to
+ ** find the error, after the events of everything
+ ** before the failure have been reported.
+ */
+
+int mpc_parse_events(const char *filename, const char *string, size_t length, mpc_parser_t *p,
+    const mpc_events_t *e, void *d, mpc_result_t *r) {
+
+    int x;
+    mpc_input_t *i;
+
+    r->output = NULL;
+
+    if (p->prog == NULL) {
+        r->error = mpc_err_fail(filename, mpc_state_new(), "Parser not compiled!");
+        return 0;
+    }
+
+    if (length > 0x7FFFFFFF) {
+        r->error = mpc_err_fail(filename, mpc_state_new(), "Input too large!");
+        return 0;
+    }
+
+    i = mpc_input_new_string(filename, string, (int)length);
+    x = mpc_vm_parse(p->prog, i, r, e, d) || mpc_parse_run(i, p, r, NULL, 0);
+    mpc_input_delete(i);
+    return x;
+}
+
+/*
+ ** Building a Parser
+ */
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+
+static void mpc_undefine_or(mpc_parser_t *p) {
+
+    int i;
+    for (i = 0; i < p->data.or.n; i++) {
+        mpc_undefine_unretained(p->data.or.xs[i], 0);
+    }
+    free(p->data.or.xs);
+    free(p->data.or.table);
+
+}
+
+static void mpc_undefine_and(mpc_parser_t *p) {
+
+    int i;
+    for (i = 0; i < p->data.and.n; i++) {
+        mpc_undefine_unretained(p->data.and.xs[i], 0);
+    }
+    free(p->data.and.xs);
+    free(p->data.and.dxs);
+
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+
+    if (p->retained && !force) { return; }
+
+    mpc_prog_delete(p->prog);
+    p->prog = NULL;
+
+    switch (p->type) {
+
+        case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+
+        case MPC_TYPE_STRING:
+                            free(p->data.string.x); 
+                            break;
+
+        case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+        case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT:   mpc_undefine_unretained(p->data.predict.x, 0);  break;
+        case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+
+        case MPC_TYPE_DFA:
+                                mpc_undefine_unretained(p->data.dfa.x, 0);
+                                mpc_dfa_delete(p->data.dfa.d);
+                                break;
+
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_NOT:
+                                mpc_undefine_unretained(p->data.not.x, 0);
+                                break;
+
+        case MPC_TYPE_EXPECT:
+                                mpc_undefine_unretained(p->data.expect.x, 0);
+                                free(p->data.expect.m);
+                                break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+                                mpc_undefine_unretained(p->data.repeat.x, 0);
+                                break;
+
+        case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+        case MPC_TYPE_AND: mpc_undefine_and(p); break;
+
+        default: break;
+    }
+
+    if (!force) {
+        free(p->name);
+        free(p);
+    }
+
+}
+
+void mpc_delete(mpc_parser_t *p) {
+    if (p->retained) {
+
+        if (p->type != MPC_TYPE_UNDEFINED) {
+            mpc_undefine_unretained(p, 0);
+        } 
+
+        mpc_prog_delete(p->prog);
+        free(p->name);
+        free(p);
+
+    } else {
+        mpc_undefine_unretained(p, 0);  
+    }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+    mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+    mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+    p->retained = 0;
+    p->type = MPC_TYPE_UNDEFINED;
+    p->name = NULL;
+    return p;
+}
+
+/*
+ ** Retained parsers can be redefined at any time
+ ** so they never count as spans inside others.
+ */
+
+static int mpc_spans(mpc_parser_t *p) {
+    return !p->retained && p->span;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+    mpc_parser_t *p = mpc_undefined();
+    p->retained = 1;
+    p->name = realloc(p->name, strlen(name) + 1);
+    strcpy(p->name, name);
+    return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+    mpc_undefine_unretained(p, 1);
+    p->type = MPC_TYPE_UNDEFINED;
+    p->span = 0;
+    return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
+
+    if (p->retained) {
+        mpc_prog_delete(p->prog);
+        p->prog = NULL;
+        p->type = a->type;
+        p->span = a->span;
+        p->data = a->data;
+    } else {
+        mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+        p->type = a2->type;
+        p->data = a2->data;
+        free(a2);
+    }
+
+    mpc_prog_delete(a->prog);
+    free(a);
+    return p;  
+}
+
+void mpc_cleanup(int n, ...) {
+    int i;
+    mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_list va;
+    va_start(va, n);
+    for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+    for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+    for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
+    va_end(va);  
+
+    free(list);
+}
+
+/*
+ ** Optimising gives every `or` reachable from `p`
+ ** a table from the next byte to the alternatives
+ ** which might match it. The tables are worked out
+ ** from the parsers as they are defined now, so it
+ ** should be run again if any of them is redefined.
+ */
+
+static void mpc_optimise_or(mpc_parser_t *p) {
+
+    unsigned char set[32];
+    unsigned long *t;
+    int j, c, skips = 0;
+
+    free(p->data.or.table);
+    p->data.or.table = NULL;
+
+    if (p->data.or.n > 32) { return; }
+
+    t = calloc(256, sizeof(unsigned long));
+
+    for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_first(p->data.or.xs[j], set, 0)) {
+            skips++;
+            for (c = 1; c < 256; c++) {
+                if (mpc_set_has(set, c)) { t[c] |= 1UL << j; }
+            }
+        } else {
+            for (c = 1; c < 256; c++) { t[c] |= 1UL << j; }
+        }
+        t[0] |= 1UL << j;
+    }
+
+    if (skips) {
+        p->data.or.table = t;
+    } else {
+        free(t);
+    }
+}
+
+static void mpc_optimise_unretained(mpc_parser_t *p, mpc_parser_t ***seen, int *seen_num) {
+
+    int j;
+
+    if (p->retained) {
+        for (j = 0; j < *seen_num; j++) {
+            if ((*seen)[j] == p) { return; }
+        }
+        *seen = realloc(*seen, sizeof(mpc_parser_t*) * (*seen_num + 1));
+        (*seen)[(*seen_num)++] = p;
+    }
+
+    switch (p->type) {
+
+        case MPC_TYPE_EXPECT:   mpc_optimise_unretained(p->data.expect.x, seen, seen_num);   break;
+        case MPC_TYPE_APPLY:    mpc_optimise_unretained(p->data.apply.x, seen, seen_num);    break;
+        case MPC_TYPE_APPLY_TO: mpc_optimise_unretained(p->data.apply_to.x, seen, seen_num); break;
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT:   mpc_optimise_unretained(p->data.predict.x, seen, seen_num);  break;
+        case MPC_TYPE_MEMO:     mpc_optimise_unretained(p->data.memo.x, seen, seen_num);     break;
+        case MPC_TYPE_DFA:      mpc_optimise_unretained(p->data.dfa.x, seen, seen_num);      break;
+
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+                                mpc_optimise_unretained(p->data.not.x, seen, seen_num);
+                                break;
+
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+                                mpc_optimise_unretained(p->data.repeat.x, seen, seen_num);
+                                break;
+
+        case MPC_TYPE_OR:
+                                for (j = 0; j < p->data.or.n; j++) {
+                                    mpc_optimise_unretained(p->data.or.xs[j], seen, seen_num);
+                                }
+                                mpc_optimise_or(p);
+                                break;
+
+        case MPC_TYPE_AND:
+                                for (j = 0; j < p->data.and.n; j++) {
+                                    mpc_optimise_unretained(p->data.and.xs[j], seen, seen_num);
+                                }
+                                break;
+
+        default: break;
+    }
+}
+
+void mpc_optimise(mpc_parser_t *p) {
+    mpc_parser_t **seen = NULL;
+    int seen_num = 0;
+    mpc_optimise_unretained(p, &seen, &seen_num);
+    free(seen);
+}
+
+/*
+ ** Compiling gives `p` a program for the PEG
+ ** machine, which is then used in place of the
+ ** parsing loop whenever `p` parses a string or
+ ** map with backtracking on. Like optimising, it
+ ** works from the parsers as they are defined now,
+ ** so should be run again if any is redefined.
+ ** Returns 0 if `p` uses `mpc_predictive` or
+ ** `mpc_commit`, which the machine cannot run.
+ */
+
+int mpc_compile(mpc_parser_t *p) {
+    mpc_prog_delete(p->prog);
+    p->prog = mpc_prog_new(p);
+    return p->prog != NULL;
+}
+
+mpc_parser_t *mpc_pass(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_PASS;
+    return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_FAIL;
+    p->data.fail.m = malloc(strlen(m) + 1);
+    strcpy(p->data.fail.m, m);
+    return p;
+}
+
+/*
+ ** As `snprintf` is not ANSI standard this 
+ ** function `mpc_failf` should be considered
+ ** unsafe.
+ **
+ ** You have a few options if this is going to be
+ ** trouble.
+ **
+ ** - Ensure the format string does not exceed
+ **   the buffer length using precision specifiers
+ **   such as `%.512s`.
+ **
+ ** - Patch this function in your code base to 
+ **   use `snprintf` or whatever variant your
+ **   system supports.
+ **
+ ** - Avoid it altogether.
+ **
+ */
+
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
+
+    va_list va;
+    char *buffer;
+
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_FAIL;
+
+    va_start(va, fmt);
+    buffer = malloc(2048);
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    buffer = realloc(buffer, strlen(buffer) + 1);
+    p->data.fail.m = buffer;
+    return p;
+
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_LIFT_VAL;
+    p->data.lift.x = x;
+    return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_LIFT;
+    p->span = lf == mpcf_ctor_str;
+    p->data.lift.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_ANCHOR;
+    p->data.anchor.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_state(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_STATE;
+    return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_EXPECT;
+    p->span = mpc_spans(a);
+    p->data.expect.x = a;
+    p->data.expect.m = malloc(strlen(expected) + 1);
+    strcpy(p->data.expect.m, expected);
+    return p;
+}
+
+/*
+ ** As `snprintf` is not ANSI standard this 
+ ** function `mpc_expectf` should be considered
+ ** unsafe.
+ **
+ ** You have a few options if this is going to be
+ ** trouble.
+ **
+ ** - Ensure the format string does not exceed
+ **   the buffer length using precision specifiers
+ **   such as `%.512s`.
+ **
+ ** - Patch this function in your code base to 
+ **   use `snprintf` or whatever variant your
+ **   system supports.
+ **
+ ** - Avoid it altogether.
+ **
+ */
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+    va_list va;
+    char *buffer;
+
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_EXPECT;
+
+    va_start(va, fmt);
+    buffer = malloc(2048);
+    vsprintf(buffer, fmt, va);
+    va_end(va);
+
+    buffer = realloc(buffer, strlen(buffer) + 1);
+    p->span = mpc_spans(a);
+    p->data.expect.x = a;
+    p->data.expect.m = buffer;
+    return p;
+}
+
+/*
+ ** Basic Parsers
+ */
+
+mpc_parser_t *mpc_any(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_ANY;
+    p->span = 1;
+    return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_SINGLE;
+    p->span = 1;
+    p->data.single.x = c;
+    return mpc_expectf(p, "'%c'", c);
+}
+
+static mpc_parser_t *mpc_class(void) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_CLASS;
+    p->span = 1;
+    memset(p->data.class.x, 0, 32);
+    return p;
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+    int c;
+    mpc_parser_t *p = mpc_class();
+    for (c = 0; c < 256; c++) {
+        if ((char)c >= s && (char)c <= e) { mpc_set_add(p->data.class.x, c); }
+    }
+    mpc_class_ranges(&p->data.class);
+    return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+    const char *c;
+    mpc_parser_t *p = mpc_class();
+    for (c = s; *c; c++) { mpc_set_add(p->data.class.x, (unsigned char)*c); }
+    mpc_class_ranges(&p->data.class);
+    return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+    const char *c;
+    mpc_parser_t *p = mpc_class();
+    memset(p->data.class.x, 0xFF, 32);
+    for (c = s; *c; c++) { p->data.class.x[(unsigned char)*c >> 3] &= (unsigned char)~(1 << (*c & 7)); }
+    mpc_class_ranges(&p->data.class);
+    return mpc_expectf(p, "one of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_SATISFY;
+    p->span = 1;
+    p->data.satisfy.f = f;
+    return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_STRING;
+    p->span = 1;
+    p->data.string.x = malloc(strlen(s) + 1);
+    strcpy(p->data.string.x, s);
+    return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+ ** Core Parsers
+ */
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_APPLY;
+    p->data.apply.x = a;
+    p->data.apply.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_APPLY_TO;
+    p->data.apply_to.x = a;
+    p->data.apply_to.f = f;
+    p->data.apply_to.d = x;
+    return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_PREDICT;
+    p->data.predict.x = a;
+    return p;
+}
+
+/*
+ ** Once `a` succeeds no parser will go back to
+ ** before where it stopped. A failure after it
+ ** which would have to go back further fails the
+ ** whole parse, as no alternative can be tried
+ ** from where it began.
+ */
+
+mpc_parser_t *mpc_commit(mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_COMMIT;
+    p->data.predict.x = a;
+    return p;
+}
+
+/*
+ ** The copy function `c` must return a copy of
+ ** its argument without consuming it. Memos keep
+ ** one copy and hand out another each time they
+ ** are replayed, releasing theirs with `da`.
+ */
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t c, mpc_dtor_t da) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MEMO;
+    p->data.memo.x = a;
+    p->data.memo.c = c;
+    p->data.memo.dx = da;
+    return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_NOT;
+    p->span = lf == mpcf_ctor_str && mpc_spans(a);
+    p->data.not.x = a;
+    p->data.not.dx = da;
+    p->data.not.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+    return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MAYBE;
+    p->span = lf == mpcf_ctor_str && mpc_spans(a);
+    p->data.not.x = a;
+    p->data.not.lf = lf;
+    return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+    return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MANY;
+    p->span = f == mpcf_strfold && mpc_spans(a);
+    p->data.repeat.x = a;
+    p->data.repeat.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_MANY1;
+    p->span = f == mpcf_strfold && mpc_spans(a);
+    p->data.repeat.x = a;
+    p->data.repeat.f = f;
+    return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+    mpc_parser_t *p = mpc_undefined();
+    p->type = MPC_TYPE_COUNT;
+    p->span = f == mpcf_strfold && mpc_spans(a);
+    p->data.repeat.n = n;
+    p->data.repeat.f = f;
+    p->data.repeat.x = a;
+    p->data.repeat.dx = da;
+    return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_OR;
+    p->span = n > 0;
+    p->data.or.n = n;
+    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_start(va, n);  
+    for (i = 0; i < n; i++) {
+        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+        p->span = p->span && mpc_spans(p->data.or.xs[i]);
+    }
+    va_end(va);
+
+    return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_AND;
+    p->span = f == mpcf_strfold;
+    p->data.and.n = n;
+    p->data.and.f = f;
+    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+    va_start(va, f);  
+    for (i = 0; i < n; i++) {
+        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+        p->span = p->span && mpc_spans(p->data.and.xs[i]);
+    }
+    for (i = 0; i < (n-1); i++) {
+        p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+    }  
+    va_end(va);
+
+    return p;
+}
+
+/*
+ ** Common Parsers
+ */
+
+static int mpc_soi_anchor(char prev, char next) { return (prev == '\0'); }
+static int mpc_eoi_anchor(char prev, char next) { return (next == '\0'); }
+
+mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
+mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
+
+static int mpc_boundary_anchor(char prev, char next) {
+    char* word = "abcdefghijklmnopqrstuvwxyz"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "0123456789_";
+    if ( strchr(word, next) &&  prev == '\0') { return 1; }
+    if ( strchr(word, prev) &&  next == '\0') { return 1; }
+    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+    return 0;
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+    /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+
+    mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+
+    p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+    p1 = mpc_digits();
+    p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+    p30 = mpc_oneof("eE");
+    p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+    p32 = mpc_digits();
+    p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+
+    return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+    return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+    return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+    mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {  
+    mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+    return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+    mpc_parser_t *p0, *p1; 
+    p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+    p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
+    return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+ ** Useful Parsers
+ */
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+    return mpc_and(3, mpcf_snd_free,
+            mpc_string(o), a, mpc_string(c),
+            free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+    return mpc_and(3, mpcf_snd_free,
+            mpc_sym(o), mpc_tok(a), mpc_sym(c),
+            free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+ ** Regular Expression Parsers
+ */
+
+/*
+ ** So here is a cute bootstrapping.
+ **
+ ** I'm using the previously defined
+ ** mpc constructs and functions to
+ ** parse the user regex string and
+ ** construct a parser from it.
+ **
+ ** As it turns out lots of the standard
+ ** mpc functions look a lot like `fold`
+ ** functions and so can be used indirectly
+ ** by many of the parsing functions to build
+ ** a parser directly - as we are parsing.
+ **
+ ** This is certainly something that
+ ** would be less elegant/interesting 
+ ** in a two-phase parser which first
+ ** builds an AST and then traverses it
+ ** to generate the object.
+ **
+ ** This whole thing acts as a great
+ ** case study for how trivial it can be
+ ** to write a great parser in a few
+ ** lines of code using mpc.
+ */
+
+/*
+ **
+ **  ### Regular Expression Grammar
+ **
+ **      <regex> : <term> | (<term> "|" <regex>)
+ **     
+ **      <term> : <factor>*
+ **
+ **      <factor> : <base>
+ **               | <base> "*"
+ **               | <base> "+"
+ **               | <base> "?"
+ **               | <base> "{" <digits> "}"
+ **           
+ **      <base> : <char>
+ **             | "\" <char>
+ **             | "(" <regex> ")"
+ **             | "[" <range> "]"
+ */
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+    if (xs[1] == NULL) { return xs[0]; }
+    else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+    int i;
+    mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+    for (i = 0; i < n; i++) {
+        p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+    }
+    return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+
+    int num;
+    if (xs[1] == NULL) { return xs[0]; }
+    if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
+    if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
+    if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
+    num = *(int*)xs[1];
+    free(xs[1]);
+
+    return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+    switch (c) {
+        case 'a': return mpc_char('\a');
+        case 'f': return mpc_char('\f');
+        case 'n': return mpc_char('\n');
+        case 'r': return mpc_char('\r');
+        case 't': return mpc_char('\t');
+        case 'v': return mpc_char('\v');
+        case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+        case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+        case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+        case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+        case 'd': return mpc_digit();
+        case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+        case 's': return mpc_whitespace();
+        case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+        case 'w': return mpc_alphanum();
+        case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+        default: return NULL;
+    }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+
+    char *s = x;
+    mpc_parser_t *p;
+
+    /* Regex Special Characters */
+    if (s[0] == '.') { free(s); return mpc_any(); }
+    if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
+    if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+
+    /* Regex Escape */
+    if (s[0] == '\\') {
+        p = mpc_re_escape_char(s[1]);
+        p = (p == NULL) ? mpc_char(s[1]) : p;
+        free(s);
+        return p;
+    }
+
+    /* Regex Standard */
+    p = mpc_char(s[0]);
+    free(s);
+    return p;
+}
+
+static char *mpc_re_range_escape_char(char c) {
+    switch (c) {
+        case '-': return "-";
+        case 'a': return "\a";
+        case 'f': return "\f";
+        case 'n': return "\n";
+        case 'r': return "\r";
+        case 't': return "\t";
+        case 'v': return "\v";
+        case 'b': return "\b";
+        case 'd': return "0123456789";
+        case 's': return " \f\n\r\t\v";
+        case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+        default: return NULL;
+    }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+
+    mpc_parser_t *out;
+    char *range = calloc(1,1);
+    char *tmp = NULL;
+    char *s = x;
+    char start, end;
+    int i, j;
+    int comp = 0;
+
+    if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+    if (s[0] == '^' && 
+            s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+
+    if (s[0] == '^') { comp = 1;}
+
+    for (i = comp; i < strlen(s); i++){
+
+        /* Regex Range Escape */
+        if (s[i] == '\\') {
+            tmp = mpc_re_range_escape_char(s[i+1]);
+            if (tmp != NULL) {
+                range = realloc(range, strlen(range) + strlen(tmp) + 1);
+                strcat(range, tmp);
+            } else {
+                range = realloc(range, strlen(range) + 1 + 1);
+                range[strlen(range) + 1] = '\0';
+                range[strlen(range) + 0] = s[i+1];      
+            }
+            i++;
+        }
+
+        /* Regex Range...Range */
+        else if (s[i] == '-') {
+            if (s[i+1] == '\0' || i == 0) {
+                range = realloc(range, strlen(range) + strlen("-") + 1);
+                strcat(range, "-");
+            } else {
+                start = s[i-1]+1;
+                end = s[i+1]-1;
+                for (j = start; j <= end; j++) {
+                    range = realloc(range, strlen(range) + 1 + 1);
+                    range[strlen(range) + 1] = '\0';
+                    range[strlen(range) + 0] = j;
+                }        
+            }
+        }
+
+        /* Regex Range Normal */
+        else {
+            range = realloc(range, strlen(range) + 1 + 1);
+            range[strlen(range) + 1] = '\0';
+            range[strlen(range) + 0] = s[i];
+        }
+
+    }
+
+    out = comp ? mpc_noneof(range) : mpc_oneof(range);
+
+    free(x);
+    free(range);
+
+    return out;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *x) {
+
+    mpc_parser_t *p;
+    mpc_dfa_t *d = mpc_dfa_new(x);
+
+    if (!d) { return x; }
+
+    p = mpc_undefined();
+    p->type = MPC_TYPE_DFA;
+    p->span = x->span;
+    p->data.dfa.x = x;
+    p->data.dfa.d = d;
+    return p;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+
+    char *err_msg;
+    mpc_parser_t *err_out;
+    mpc_result_t r;
+    mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+
+    Regex  = mpc_new("regex");
+    Term   = mpc_new("term");
+    Factor = mpc_new("factor");
+    Base   = mpc_new("base");
+    Range  = mpc_new("range");
+
+    mpc_define(Regex, mpc_and(2, mpcf_re_or,
+                Term, 
+                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+                (mpc_dtor_t)mpc_delete
+                ));
+
+    mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+    mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+                Base,
+                mpc_or(5,
+                    mpc_char('*'), mpc_char('+'), mpc_char('?'),
+                    mpc_brackets(mpc_int(), free),
+                    mpc_pass()),
+                (mpc_dtor_t)mpc_delete
+                ));
+
+    mpc_define(Base, mpc_or(4,
+                mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+                mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+                mpc_apply(mpc_escape(), mpcf_re_escape),
+                mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
+                ));
+
+    mpc_define(Range, mpc_apply(
+                mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+                mpcf_re_range
+                ));
+
+    RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+    if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+        err_msg = mpc_err_string(r.error);
+        err_out = mpc_failf("Invalid Regex: %s", err_msg);
+        mpc_err_delete(r.error);  
+        free(err_msg);
+        r.output = err_out;
+    }
+
+    mpc_delete(RegexEnclose);
+    mpc_cleanup(5, Regex, Term, Factor, Base, Range);
+
+    return mpc_re_dfa(r.output);
+
+}
+
+/*
+ ** Common Fold Functions
+ */
+
+void mpcf_dtor_null(mpc_val_t *x) { return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 10);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 16);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+    int *y = malloc(sizeof(int));
+    *y = strtol(x, NULL, 8);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+    float* y = malloc(sizeof(float));
+    *y = strtod(x, NULL);
+    free(x);
+    return y;
+}
+
+static char mpc_escape_input_c[]  = {
+    '\a', '\b', '\f', '\n', '\r',
+    '\t', '\v', '\\', '\'', '\"', '\0'};
+
+static char *mpc_escape_output_c[] = {
+    "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
+    "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static char mpc_escape_input_raw_re[] = { '/' };
+static char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static char mpc_escape_input_raw_cstr[] = { '"' };
+static char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static char mpc_escape_input_raw_cchar[] = { '\'' };
+static char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, char *input, char **output) {
+
+    int i;
+    int found;
+    char *s = x;
+    char *y = calloc(1, 1);
+    char buff[2];
+
+    while (*s) {
+
+        i = 0;
+        found = 0;
+
+        while (output[i]) {
+            if (*s == input[i]) {
+                y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+                strcat(y, output[i]);
+                found = 1;
+                break;
+            }
+            i++;
+        }
+
+        if (!found) {
+            y = realloc(y, strlen(y) + 2);
+            buff[0] = *s; buff[1] = '\0';
+            strcat(y, buff);
+        }
+
+        s++;
+    }
+
+
+    return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, char *input, char **output) {
+
+    int i;
+    int found = 0;
+    char *s = x;
+    char *y = calloc(1, 1);
+    char buff[2];
+
+    while (*s) {
+
+        i = 0;
+        found = 0;
+
+        while (output[i]) {
+            if ((*(s+0)) == output[i][0] &&
+                    (*(s+1)) == output[i][1]) {
+                y = realloc(y, strlen(y) + 2);
+                buff[0] = input[i]; buff[1] = '\0';
+                strcat(y, buff);
+                found = 1;
+                s++;
+                break;
+            }
+            i++;
+        }
+
+        if (!found) {
+            y = realloc(y, strlen(y) + 2);
+            buff[0] = *s; buff[1] = '\0';
+            strcat(y, buff);
+        }
+
+        if (*s == '\0') { break; }
+        else { s++; }
+    }
+
+    return y;
+
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+    free(x);
+    return y;  
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+    free(x);
+    return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (i != x) { free(xs[i]); }
+    }
+    return xs[x];
+}
+
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+    char *x;
+    size_t l = 0, k;
+    int i;
+    for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+    x = malloc(l + 1);
+    l = 0;
+    for (i = 0; i < n; i++) {
+        k = strlen(xs[i]);
+        memcpy(x + l, xs[i], k);
+        l += k;
+        free(xs[i]);
+    }
+    x[l] = '\0';
+    return x;
+}
+
+mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+
+    int **vs = (int**)xs;
+
+    if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
+    if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
+    if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
+    if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
+    if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+
+    free(xs[1]); free(xs[2]);
+
+    return xs[0];
+}
+
+/*
+ ** Printing
+ */
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+
+    /* TODO: Print Everything Escaped */
+
+    int i, j;
+    char *s, *e;
+    char buff[2];
+
+    if (p->retained && !force) {;
+        if (p->name) { printf("<%s>", p->name); }
+        else { printf("<anon>"); }
+        return;
+    }
+
+    if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+    if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+    if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+    if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+    if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+    if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+    if (p->type == MPC_TYPE_EXPECT) {
+        printf("%s", p->data.expect.m);
+        /*mpc_print_unretained(p->data.expect.x, 0);*/
+    }
+
+    if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+    if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+    if (p->type == MPC_TYPE_SINGLE) {
+        buff[0] = p->data.single.x; buff[1] = '\0';
+        s = mpcf_escape_new(
+                buff,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("'%s'", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_CLASS) {
+        printf("[");
+        for (i = 1; i < 256; i = j) {
+            for (j = i; j < 256 && mpc_set_has(p->data.class.x, j); j++);
+            if (j == i) { j++; continue; }
+            buff[0] = (char)i; buff[1] = '\0';
+            s = mpcf_escape_new(
+                    buff,
+                    mpc_escape_input_c,
+                    mpc_escape_output_c);
+            buff[0] = (char)(j-1); buff[1] = '\0';
+            e = mpcf_escape_new(
+                    buff,
+                    mpc_escape_input_c,
+                    mpc_escape_output_c);
+            if (j - i == 1) { printf("%s", s); } else { printf("%s-%s", s, e); }
+            free(s);
+            free(e);
+        }
+        printf("]");
+    }
+
+    if (p->type == MPC_TYPE_STRING) {
+        s = mpcf_escape_new(
+                p->data.string.x,
+                mpc_escape_input_c,
+                mpc_escape_output_c);
+        printf("\"%s\"", s);
+        free(s);
+    }
+
+    if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+    if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+    if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+    if (p->type == MPC_TYPE_COMMIT)   { mpc_print_unretained(p->data.predict.x, 0); printf("~"); }
+    if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+    if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+
+    if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+    if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+    if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+    if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+    if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+
+    if (p->type == MPC_TYPE_OR) {
+        printf("(");
+        for(i = 0; i < p->data.or.n-1; i++) {
+            mpc_print_unretained(p->data.or.xs[i], 0);
+            printf(" | ");
+        }
+        mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+        printf(")");
+    }
+
+    if (p->type == MPC_TYPE_AND) {
+        printf("(");
+        for(i = 0; i < p->data.and.n-1; i++) {
+            mpc_print_unretained(p->data.and.xs[i], 0);
+            printf(" ");
+        }
+        mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+        printf(")");
+    }
+
+}
+
+void mpc_print(mpc_parser_t *p) {
+    mpc_print_unretained(p, 1);
+    printf("\n");
+}
+
+/*
+ ** Profiling
+ */
+
+#ifdef MPC_PROFILE
+
+mpc_profile_t *mpc_profile_new(void) {
+    mpc_profile_t *r = malloc(sizeof(mpc_profile_t));
+    r->entries_num = 0;
+    r->entries_slots = 0;
+    r->entries = NULL;
+    r->index_slots = 0;
+    r->index = NULL;
+    return r;
+}
+
+void mpc_profile_delete(mpc_profile_t *r) {
+    free(r->entries);
+    free(r->index);
+    free(r);
+}
+
+void mpc_profile_clear(mpc_profile_t *r) {
+    int j;
+    for (j = 0; j < r->entries_num; j++) {
+        mpc_parser_t *p = r->entries[j].parser;
+        memset(&r->entries[j], 0, sizeof(mpc_profile_entry_t));
+        r->entries[j].parser = p;
+    }
+}
+
+void mpc_profile_merge(mpc_profile_t *r, mpc_profile_t *from) {
+
+    mpc_profile_entry_t *x, *y;
+    int j, k;
+
+    for (j = 0; j < from->entries_num; j++) {
+        y = &from->entries[j];
+        if (y->calls == 0) { continue; }
+        k = mpc_profile_entry(r, y->parser);
+        x = &r->entries[k];
+        x->calls += y->calls;
+        x->successes += y->successes;
+        x->failures += y->failures;
+        x->backtracks += y->backtracks;
+        x->bytes += y->bytes;
+        x->cycles += y->cycles;
+    }
+}
+
+static int mpc_profile_cmp(const void *a, const void *b) {
+    double x = ((mpc_profile_entry_t*)a)->cycles;
+    double y = ((mpc_profile_entry_t*)b)->cycles;
+    return (x < y) - (x > y);
+}
+
+void mpc_profile_print_to(mpc_profile_t *r, FILE *f) {
+
+    mpc_profile_entry_t *es = malloc(sizeof(mpc_profile_entry_t) * (r->entries_num + 1));
+    mpc_profile_entry_t *c;
+    int j;
+
+    memcpy(es, r->entries, sizeof(mpc_profile_entry_t) * r->entries_num);
+    qsort(es, r->entries_num, sizeof(mpc_profile_entry_t), mpc_profile_cmp);
+
+    fprintf(f, "%-24s %10s %10s %10s %10s %12s %16s\n",
+        "rule", "calls", "successes", "failures", "backtracks", "bytes", "cycles");
+
+    for (j = 0; j < r->entries_num; j++) {
+        c = &es[j];
+        fprintf(f, "%-24s %10lu %10lu %10lu %10lu %12lu %16.0f\n", c->parser->name,
+            c->calls, c->successes, c->failures, c->backtracks, c->bytes, c->cycles);
+    }
+
+    free(es);
+}
+
+void mpc_profile_print(mpc_profile_t *r) {
+    mpc_profile_print_to(r, stdout);
+}
+
+void mpc_ctx_profile(mpc_ctx_t *c, mpc_profile_t *r) {
+    mpc_input_t *i = c->input;
+    i->profile = r;
+    if (r && i->counts == NULL) { i->counts = mpc_profile_new(); }
+    if (r == NULL && i->counts) {
+        mpc_profile_delete(i->counts);
+        i->counts = NULL;
+    }
+}
+
+#endif
+
+/*
+ ** Testing
+ */
+
+/*
+ ** These functions are slightly unwieldy and
+ ** also the whole of the testing suite for mpc
+ ** mpc is pretty shaky.
+ **
+ ** It could do with a lot more tests and more
+ ** precision. Currently I am only really testing
+ ** changes off of the examples.
+ **
+ */
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, void *d,
+        int(*tester)(void*, void*),
+        mpc_dtor_t destructor,
+        void(*printer)(void*)) {
+
+    mpc_result_t r;  
+    if (mpc_parse("<test>", s, p, &r)) {
+
+        if (tester(r.output, d)) {
+            destructor(r.output);
+            return 0;
+        } else {
+            destructor(r.output);
+            return 1;
+        }
+
+    } else {
+        mpc_err_delete(r.error);
+        return 1;
+    }
+
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
+        int(*tester)(void*, void*), 
+        mpc_dtor_t destructor, 
+        void(*printer)(void*)) {
+
+    mpc_result_t r;  
+    if (mpc_parse("<test>", s, p, &r)) {
+
+        if (tester(r.output, d)) {
+            destructor(r.output);
+            return 1;
+        } else {
+            printf("Got "); printer(r.output); printf("\n");
+            printf("Expected "); printer(d); printf("\n");
+            destructor(r.output);
+            return 0;
+        }
+
+    } else {    
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return 0;
+
+    }
+
+}
+
+
+/*
+ ** AST
+ */
+
+void mpc_ast_delete(mpc_ast_t *a) {
+
+    int i;
+
+    if (a == NULL) { return; }
+    for (i = 0; i < a->children_num; i++) {
+        mpc_ast_delete(a->children[i]);
+    }
+
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+
+    mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+
+    a->tag = malloc(strlen(tag) + 1);
+    strcpy(a->tag, tag);
+
+    a->contents = malloc(strlen(contents) + 1);
+    strcpy(a->contents, contents);
+
+    a->state = mpc_state_new();
+
+    a->children_num = 0;
+    a->children = NULL;
+    return a;
+
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+
+    mpc_ast_t *a = mpc_ast_new(tag, "");
+
+    int i;
+    va_list va;
+    va_start(va, tag);
+
+    for (i = 0; i < n; i++) {
+        mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+    }
+
+    va_end(va);
+
+    return a;
+
+}
+
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+    mpc_ast_t *r;
+
+    if (a == NULL) { return a; }
+    if (a->children_num == 0) { return a; }
+    if (a->children_num == 1) { return a; }
+
+    r = mpc_ast_new(">", "");
+    mpc_ast_add_child(r, a);
+    return r;
+}
+
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+
+    int i;
+
+    if (strcmp(a->tag, b->tag) != 0) { return 0; }
+    if (strcmp(a->contents, b->contents) != 0) { return 0; }
+    if (a->children_num != b->children_num) { return 0; }
+
+    for (i = 0; i < a->children_num; i++) {
+        if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+    }
+
+    return 1;
+}
+
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+    r->children_num++;
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+    r->children[r->children_num-1] = a;
+    return r;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+    if (a == NULL) { return a; }
+    a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+    memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
+    memmove(a->tag, t, strlen(t));
+    memmove(a->tag + strlen(t), "|", 1);
+    return a;
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+    a->tag = realloc(a->tag, strlen(t) + 1);
+    strcpy(a->tag, t);
+    return a;
+}
+
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+    if (a == NULL) { return a; }
+    a->state = s;
+    return a;
+}
+
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+    int i;
+    mpc_ast_t *b;
+
+    if (a == NULL) { return a; }
+
+    b = mpc_ast_new(a->tag, a->contents);
+    b->state = a->state;
+    b->children_num = a->children_num;
+    b->children = malloc(sizeof(mpc_ast_t*) * a->children_num);
+
+    for (i = 0; i < a->children_num; i++) {
+        b->children[i] = mpc_ast_copy(a->children[i]);
+    }
+
+    return b;
+}
+
+static void mpc_ast_print_depth(mpc_ast_t *a, int d) {
+
+    int i;
+    for (i = 0; i < d; i++) { printf("  "); }
+
+    if (strlen(a->contents)) {
+        printf("%s:%i:%i '%s'\n", a->tag, a->state.row+1, a->state.col+1, a->contents);
+    } else {
+        printf("%s \n", a->tag);
+    }
+
+    for (i = 0; i < a->children_num; i++) {
+        mpc_ast_print_depth(a->children[i], d+1);
+    }
+
+}
+
+void mpc_ast_print(mpc_ast_t *a) {
+    mpc_ast_print_depth(a, 0);
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+
+    int i, j;
+    mpc_ast_t** as = (mpc_ast_t**)xs;
+    mpc_ast_t *r;
+
+    if (n == 0) { return NULL; }
+    if (n == 1) { return xs[0]; }
+    if (n == 2 && xs[1] == NULL) { return xs[0]; }
+    if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+    r = mpc_ast_new(">", "");
+
+    /* Count the children first to allocate them at once */
+    for (i = 0; i < n; i++) {
+        if (as[i] == NULL) { continue; }
+        r->children_num += as[i]->children_num > 0 ? as[i]->children_num : 1;
+    }
+
+    if (r->children_num) {
+        r->children = malloc(sizeof(mpc_ast_t*) * r->children_num);
+    }
+
+    for (i = 0, j = 0; i < n; i++) {
+
+        if (as[i] == NULL) { continue; }
+
+        if (as[i]->children_num > 0) {
+
+            memcpy(r->children + j, as[i]->children, sizeof(mpc_ast_t*) * as[i]->children_num);
+            j += as[i]->children_num;
+
+            mpc_ast_delete_no_children(as[i]);
+
+        } else {
+            r->children[j++] = as[i];
+        }
+
+    }
+
+    if (r->children_num) {
+        r->state = r->children[0]->state;
+    }
+
+    return r;
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+    mpc_ast_t *a = mpc_ast_new("", c);
+    free(c);
+    return a;
+}
+
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+    mpc_state_t *s = ((mpc_state_t**)xs)[0];
+    mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+    a = mpc_ast_state(a, *s);
+    free(s);
+    return a;
+}
+
+/*
+ ** Trees
+ **
+ ** Trees are built from nodes held in blocks by a
+ ** builder, each node keeping its children as a
+ ** list so folds can splice them in place. Tags are
+ ** kept as a list of the strings they are made from,
+ ** newest first, and only split and interned once
+ ** the tree is laid out.
+ */
+
+enum { MPC_TREE_BLOCK = 8192 };
+
+typedef union mpc_tree_align_t {
+    void *p;
+    long l;
+    double d;
+} mpc_tree_align_t;
+
+typedef struct mpc_tree_tags_t {
+    const char *tag;
+    struct mpc_tree_tags_t *next;
+} mpc_tree_tags_t;
+
+typedef struct mpc_tree_part_t {
+    const char *contents;
+    int length;
+    mpc_state_t state;
+    mpc_tree_tags_t *tags;
+    int children_num;
+    struct mpc_tree_part_t *first;
+    struct mpc_tree_part_t *last;
+    struct mpc_tree_part_t *next;
+} mpc_tree_part_t;
+
+struct mpc_tree_builder_t {
+    char *block;
+    size_t used;
+    size_t size;
+};
+
+mpc_tree_builder_t *mpc_tree_builder_new(void) {
+    mpc_tree_builder_t *b = malloc(sizeof(mpc_tree_builder_t));
+    b->block = NULL;
+    b->used = 0;
+    b->size = 0;
+    return b;
+}
+
+void mpc_tree_builder_delete(mpc_tree_builder_t *b) {
+    char *prev;
+    while (b->block) {
+        prev = *(char**)b->block;
+        free(b->block);
+        b->block = prev;
+    }
+    free(b);
+}
+
+static void *mpc_tree_alloc(mpc_tree_builder_t *b, size_t n) {
+
+    size_t a = sizeof(mpc_tree_align_t);
+    char *block;
+
+    n = (n + a - 1) / a * a;
+
+    /* Each block starts with the one before it */
+    if (b->used + n > b->size) {
+        b->size = n + a > MPC_TREE_BLOCK ? n + a : MPC_TREE_BLOCK;
+        block = malloc(b->size);
+        *(char**)block = b->block;
+        b->block = block;
+        b->used = a;
+    }
+
+    b->used += n;
+    return b->block + b->used - n;
+}
+
+static mpc_tree_part_t *mpc_tree_part(mpc_tree_builder_t *b, const char *contents, int length, const char *tag) {
+    mpc_tree_part_t *x = mpc_tree_alloc(b, sizeof(mpc_tree_part_t));
+    x->contents = contents;
+    x->length = length;
+    x->state = mpc_state_new();
+    x->tags = NULL;
+    x->children_num = 0;
+    x->first = NULL;
+    x->last = NULL;
+    x->next = NULL;
+    if (tag) { mpcf_tree_add_tag(b, x, tag); }
+    return x;
+}
+
+static void mpc_tree_child(mpc_tree_part_t *x, mpc_tree_part_t *y) {
+    if (x->last) { x->last->next = y; } else { x->first = y; }
+    x->last = y;
+    x->children_num++;
+}
+
+/*
+ ** These do what the AST folds of the same names do,
+ ** except that nodes emptied by splicing are left
+ ** in the builder rather than freed.
+ */
+
+mpc_val_t *mpcf_tree_fold(mpc_tree_builder_t *b, int n, mpc_val_t **xs) {
+
+    mpc_tree_part_t **ps = (mpc_tree_part_t**)xs;
+    mpc_tree_part_t *x, *y;
+    int i;
+
+    if (n == 0) { return NULL; }
+    if (n == 1) { return xs[0]; }
+    if (n == 2 && xs[1] == NULL) { return xs[0]; }
+    if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+    x = mpc_tree_part(b, "", 0, ">");
+
+    for (i = 0; i < n; i++) {
+        y = ps[i];
+        if (y == NULL) { continue; }
+        if (y->children_num > 0) {
+            if (x->last) { x->last->next = y->first; } else { x->first = y->first; }
+            x->last = y->last;
+            x->children_num += y->children_num;
+        } else {
+            mpc_tree_child(x, y);
+        }
+    }
+
+    if (x->first) { x->state = x->first->state; }
+
+    return x;
+}
+
+mpc_val_t *mpcf_tree_str(mpc_tree_builder_t *b, mpc_val_t *c) {
+    int n = (int)strlen(c);
+    char *s = mpc_tree_alloc(b, n + 1);
+    memcpy(s, c, n + 1);
+    free(c);
+    return mpc_tree_part(b, s, n, NULL);
+}
+
+mpc_val_t *mpcf_tree_state(mpc_tree_builder_t *b, int n, mpc_val_t **xs) {
+    mpc_state_t *s = ((mpc_state_t**)xs)[0];
+    mpc_tree_part_t *x = ((mpc_tree_part_t**)xs)[1];
+    (void)b; (void)n;
+    if (x) { x->state = *s; }
+    free(s);
+    return x;
+}
+
+mpc_val_t *mpcf_tree_root(mpc_tree_builder_t *b, mpc_val_t *x) {
+    mpc_tree_part_t *y = x, *r;
+    if (y == NULL || y->children_num <= 1) { return y; }
+    r = mpc_tree_part(b, "", 0, ">");
+    mpc_tree_child(r, y);
+    return r;
+}
+
+mpc_val_t *mpcf_tree_tag(mpc_tree_builder_t *b, mpc_val_t *x, const char *t) {
+    mpc_tree_part_t *y = x;
+    if (y == NULL) { return y; }
+    y->tags = NULL;
+    return mpcf_tree_add_tag(b, y, t);
+}
+
+mpc_val_t *mpcf_tree_add_tag(mpc_tree_builder_t *b, mpc_val_t *x, const char *t) {
+    mpc_tree_part_t *y = x;
+    mpc_tree_tags_t *g;
+    if (y == NULL) { return y; }
+    g = mpc_tree_alloc(b, sizeof(mpc_tree_tags_t));
+    g->tag = t;
+    g->next = y->tags;
+    y->tags = g;
     return y;
 }
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-    mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-    free(x);
-    return y;
+static int mpc_tree_intern(const char **names, int *lens, int *num, const char *t, int n) {
+
+    int i;
+
+    for (i = 0; i < *num; i++) {
+        if (lens[i] == n && memcmp(names[i], t, n) == 0) { return i; }
+    }
+
+    names[*num] = t;
+    lens[*num] = n;
+    return (*num)++;
+}
+
+/*
+ ** Lays the tree out in two passes over the nodes.
+ ** The first puts them in breadth first order and
+ ** sizes the tags and contents, the second copies
+ ** them all into one block behind the tree header.
+ */
+
+mpc_tree_t *mpc_tree_build(mpc_tree_builder_t *b, mpc_val_t *x) {
+
+    mpc_tree_part_t **src, *y;
+    mpc_tree_tags_t *g;
+    const char **names;
+    const char *t, *e;
+    int *lens;
+    int nodes_num = x ? 1 : 0, slots = 64;
+    int names_num = 0, tags_num = 0;
+    int i, k, next;
+    size_t size = 0;
+    mpc_tree_t *tr;
+    mpc_node_t *z;
+    char *c;
+
+    (void)b;
+
+    src = malloc(sizeof(mpc_tree_part_t*) * slots);
+    src[0] = x;
+
+    /* At most one name per tag separator, so size by those */
+    for (k = 0; k < nodes_num; k++) {
+        size += src[k]->length + 1;
+        for (g = src[k]->tags; g; g = g->next) {
+            tags_num++;
+            for (t = g->tag; *t; t++) { tags_num += *t == '|'; }
+        }
+        for (y = src[k]->first, i = 0; i < src[k]->children_num; y = y->next, i++) {
+            if (nodes_num == slots) {
+                slots *= 2;
+                src = realloc(src, sizeof(mpc_tree_part_t*) * slots);
+            }
+            src[nodes_num++] = y;
+        }
+    }
+
+    names = malloc(sizeof(char*) * (tags_num + 1));
+    lens = malloc(sizeof(int) * (tags_num + 1));
+    tags_num = 0;
+
+    for (k = 0; k < nodes_num; k++) {
+        for (g = src[k]->tags; g; g = g->next) {
+            for (t = g->tag; *t; t = *e ? e + 1 : e) {
+                e = strchr(t, '|');
+                if (e == NULL) { e = t + strlen(t); }
+                if (e == t) { continue; }
+                i = names_num;
+                mpc_tree_intern(names, lens, &names_num, t, e - t);
+                if (i != names_num) { size += (e - t) + 1; }
+                tags_num++;
+            }
+        }
+    }
+
+    tr = malloc(sizeof(mpc_tree_t)
+        + sizeof(mpc_node_t) * nodes_num
+        + sizeof(char*) * names_num
+        + sizeof(int) * tags_num + size);
+
+    tr->nodes_num = nodes_num;
+    tr->nodes = (mpc_node_t*)(tr + 1);
+    tr->names_num = names_num;
+    tr->names = (char**)(tr->nodes + nodes_num);
+    tr->tagsets = (int*)(tr->names + names_num);
+    c = (char*)(tr->tagsets + tags_num);
+
+    for (i = 0; i < names_num; i++) {
+        tr->names[i] = c;
+        memcpy(c, names[i], lens[i]);
+        c[lens[i]] = '\0';
+        c += lens[i] + 1;
+    }
+
+    for (k = 0, next = 1, tags_num = 0; k < nodes_num; k++) {
+
+        z = &tr->nodes[k];
+        z->contents = c;
+        z->length = src[k]->length;
+        memcpy(c, src[k]->contents, z->length);
+        c[z->length] = '\0';
+        c += z->length + 1;
+        z->state = src[k]->state;
+
+        z->tags = tags_num;
+        for (g = src[k]->tags; g; g = g->next) {
+            for (t = g->tag; *t; t = *e ? e + 1 : e) {
+                e = strchr(t, '|');
+                if (e == NULL) { e = t + strlen(t); }
+                if (e == t) { continue; }
+                tr->tagsets[tags_num++] = mpc_tree_intern(names, lens, &names_num, t, e - t);
+            }
+        }
+        z->tags_num = tags_num - z->tags;
+
+        z->children = next;
+        z->children_num = src[k]->children_num;
+        next += z->children_num;
+    }
+
+    free(names);
+    free(lens);
+    free(src);
+    return tr;
+}
+
+static mpc_tree_part_t *mpc_tree_part_ast(mpc_tree_builder_t *b, mpc_ast_t *a) {
+    mpc_tree_part_t *x = mpc_tree_part(b, a->contents, (int)strlen(a->contents), a->tag);
+    int i;
+    x->state = a->state;
+    for (i = 0; i < a->children_num; i++) {
+        mpc_tree_child(x, mpc_tree_part_ast(b, a->children[i]));
+    }
+    return x;
+}
+
+mpc_tree_t *mpc_tree_new(mpc_ast_t *a) {
+    mpc_tree_builder_t *b = mpc_tree_builder_new();
+    mpc_tree_t *t = mpc_tree_build(b, a ? mpc_tree_part_ast(b, a) : NULL);
+    mpc_tree_builder_delete(b);
+    return t;
+}
+
+void mpc_tree_delete(mpc_tree_t *t) {
+    free(t);
+}
+
+int mpc_tree_tag(mpc_tree_t *t, const char *name) {
+    int i;
+    for (i = 0; i < t->names_num; i++) {
+        if (strcmp(t->names[i], name) == 0) { return i; }
+    }
+    return -1;
+}
+
+int mpc_tree_has(mpc_tree_t *t, int node, int tag) {
+    mpc_node_t *x = &t->nodes[node];
+    int i;
+    for (i = 0; i < x->tags_num; i++) {
+        if (t->tagsets[x->tags + i] == tag) { return 1; }
+    }
+    return 0;
+}
+
+static void mpc_tree_print_depth(mpc_tree_t *t, int node, int d) {
+
+    mpc_node_t *x = &t->nodes[node];
+    int i;
+
+    for (i = 0; i < d; i++) { printf("  "); }
+    for (i = 0; i < x->tags_num; i++) {
+        printf(i ? "|%s" : "%s", t->names[t->tagsets[x->tags + i]]);
+    }
+
+    if (x->length) {
+        printf(":%i:%i '%s'\n", x->state.row+1, x->state.col+1, x->contents);
+    } else {
+        printf(" \n");
+    }
+
+    for (i = 0; i < x->children_num; i++) {
+        mpc_tree_print_depth(t, x->children + i, d+1);
+    }
+
+}
+
+void mpc_tree_print(mpc_tree_t *t) {
+    if (t->nodes_num) { mpc_tree_print_depth(t, 0, 0); }
+}
+
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+    return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+    return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_OR;
+    p->data.or.n = n;
+    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+
+    va_start(va, n);  
+    for (i = 0; i < n; i++) {
+        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    va_end(va);
+
+    return p;
+
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+
+    int i;
+    va_list va;
+
+    mpc_parser_t *p = mpc_undefined();
+
+    p->type = MPC_TYPE_AND;
+    p->data.and.n = n;
+    p->data.and.f = mpcf_fold_ast;
+    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+    va_start(va, n);
+    for (i = 0; i < n; i++) {
+        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+    }
+    for (i = 0; i < (n-1); i++) {
+        p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+    }    
+    va_end(va);
+
+    return p;  
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_memo(mpc_parser_t *a) { return mpc_memo(a, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+ ** Grammar Parser
+ */
+
+/*
+ ** This is another interesting bootstrapping.
+ **
+ ** Having a general purpose AST type allows
+ ** users to specify the grammar alone and
+ ** let all fold rules be automatically taken
+ ** care of by existing functions.
+ **
+ ** You don't get to control the type spat
+ ** out but this means you can make a nice
+ ** parser to take in some grammar in nice
+ ** syntax and spit out a parser that works.
+ **
+ ** The grammar for this looks surprisingly
+ ** like regex but the main difference is that
+ ** it is now whitespace insensitive and the
+ ** base type takes literals of some form.
+ */
+
+/*
+ **
+ **  ### Grammar Grammar
+ **
+ **      <grammar> : (<term> "|" <grammar>) | <term>
+ **     
+ **      <term> : <factor>*
+ **
+ **      <factor> : <base>
+ **               | <base> "*"
+ **               | <base> "+"
+ **               | <base> "?"
+ **               | <base> "{" <digits> "}"
+ **           
+ **      <base> : "<" (<digits> | <ident>) ">"
+ **             | <string_lit>
+ **             | <char_lit>
+ **             | <regex_lit>
+ **             | "(" <grammar> ")"
+ */
+
+typedef struct {
+    va_list *va;
+    int parsers_num;
+    mpc_parser_t **parsers;
+    int flags;
+} mpca_grammar_st_t;
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+    if (xs[1] == NULL) { return xs[0]; }
+    else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+    int i;
+    mpc_parser_t *p = mpc_pass();  
+    for (i = 0; i < n; i++) {
+        if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+    }
+    return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
+
+    int num;
+    if (xs[1] == NULL) { return xs[0]; }  
+    if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
+    if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
+    if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
+    if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
+    if (strcmp(xs[1], "~") == 0) { free(xs[1]); return mpc_commit(xs[0]); }
+    num = *((int*)xs[1]);
+    free(xs[1]);
+    return mpca_count(num, xs[0]);
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+    mpca_grammar_st_t *st = s;
+    char *y = mpcf_unescape(x);
+    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+    free(y);
+    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+    mpca_grammar_st_t *st = s;
+    char *y = mpcf_unescape(x);
+    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+    free(y);
+    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
+    mpca_grammar_st_t *st = s;
+    char *y = mpcf_unescape_regex(x);
+    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+    free(y);
+    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+}
+
+/* Should this just use `isdigit` instead */
+static int is_number(const char* s) {
+    int i;
+    for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+    return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+
+    int i;
+    mpc_parser_t *p;
+
+    /* Case of Number */
+    if (is_number(x)) {
+
+        i = strtol(x, NULL, 10);
+
+        if (!st->va) {
+            if (i < st->parsers_num) { return st->parsers[i]; }
+            return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+        }
+
+        while (st->parsers_num <= i) {
+            st->parsers_num++;
+            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+            st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+            if (st->parsers[st->parsers_num-1] == NULL) {
+                return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+            }
+        }
+
+        return st->parsers[st->parsers_num-1];
+
+        /* Case of Identifier */
+    } else {
+
+        /* Search Existing Parsers */
+        for (i = 0; i < st->parsers_num; i++) {
+            mpc_parser_t *p = st->parsers[i];
+            if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+            if (p->name && strcmp(p->name, x) == 0) { return p; }
+        }
+
+        /* Without parsers supplied, new names are made up as they appear */
+        if (!st->va) {
+            st->parsers_num++;
+            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+            st->parsers[st->parsers_num-1] = mpc_new(x);
+            return st->parsers[st->parsers_num-1];
+        }
+
+        /* Search New Parsers */
+        while (1) {
+
+            p = va_arg(*st->va, mpc_parser_t*);
+
+            st->parsers_num++;
+            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+            st->parsers[st->parsers_num-1] = p;
+
+            if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+            if (p->name && strcmp(p->name, x) == 0) { return p; }
+
+        }
+
+    }  
+
+}
+
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+
+    mpca_grammar_st_t *st = s;
+    mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+    free(x);
+
+    if (p->name) {
+        return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+    } else {
+        return mpca_state(mpca_root(p));
+    }
+}
+
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+
+    char *err_msg;
+    mpc_parser_t *err_out;
+    mpc_result_t r;
+    mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+
+    GrammarTotal = mpc_new("grammar_total");
+    Grammar = mpc_new("grammar");
+    Term = mpc_new("term");
+    Factor = mpc_new("factor");
+    Base = mpc_new("base");
+
+    mpc_define(GrammarTotal,
+            mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+            );
+
+    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+                Term,
+                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+                mpc_soft_delete
+                ));
+
+    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+
+    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+                Base,
+                mpc_or(7,
+                    mpc_sym("*"),
+                    mpc_sym("+"),
+                    mpc_sym("?"),
+                    mpc_sym("!"),
+                    mpc_sym("~"),
+                    mpc_tok_brackets(mpc_int(), free),
+                    mpc_pass()),
+                mpc_soft_delete
+                ));
+
+    mpc_define(Base, mpc_or(5,
+                mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+                mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+                mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+                mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+                mpc_tok_parens(Grammar, mpc_soft_delete)
+                ));
+
+    if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+        err_msg = mpc_err_string(r.error);
+        err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+        mpc_err_delete(r.error);
+        free(err_msg);
+        r.output = err_out;
+    }
+
+    mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+
+    return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+
+}
+
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+    mpca_grammar_st_t st;
+    mpc_parser_t *res;
+    va_list va;
+    va_start(va, grammar);
+
+    st.va = &va;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
+
+    res = mpca_grammar_st(grammar, &st);  
+    free(st.parsers);
+    va_end(va);
+    return res;
+}
+
+typedef struct {
+    char *ident;
+    char *name;
+    mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+
+    mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+    stmt->ident = ((char**)xs)[0];
+    stmt->name = ((char**)xs)[1];
+    stmt->grammar = ((mpc_parser_t**)xs)[3];
+
+    free(((char**)xs)[2]);
+    free(((char**)xs)[4]);
+
+    return stmt;
+}
+
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+
+    int i;
+    mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+
+    for (i = 0; i < n; i++) {
+        stmts[i] = xs[i];
+    }
+    stmts[n] = NULL;  
+
+    return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+    mpca_stmt_t **stmts = x;
+
+    while(*stmts) {
+        mpca_stmt_t *stmt = *stmts; 
+        free(stmt->ident);
+        free(stmt->name);
+        mpc_soft_delete(stmt->grammar);
+        free(stmt);  
+        stmts++;
+    }
+    free(x);
+
+}
+
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+    mpca_grammar_st_t *st = s;
+    mpca_stmt_t *stmt;
+    mpca_stmt_t **stmts = x;
+    mpc_parser_t *left;
+    int j;
+
+    while(*stmts) {
+        stmt = *stmts;
+        left = mpca_grammar_find_parser(stmt->ident, st);
+        if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+        if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+        if (st->flags & MPCA_LANG_MEMOIZE) { stmt->grammar = mpca_memo(stmt->grammar); }
+        mpc_define(left, stmt->grammar);
+        free(stmt->ident);
+        free(stmt->name);
+        free(stmt);
+        stmts++;
+    }
+    free(x);
+
+    if (st->flags & MPCA_LANG_OPTIMISE) {
+        for (j = 0; j < st->parsers_num; j++) {
+            if (st->parsers[j]) { mpc_optimise(st->parsers[j]); }
+        }
+    }
+
+    if (st->flags & MPCA_LANG_COMPILE) {
+        for (j = 0; j < st->parsers_num; j++) {
+            if (st->parsers[j]) { mpc_compile(st->parsers[j]); }
+        }
+    }
+
+    return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+
+    mpc_result_t r;
+    mpc_err_t *e;
+    mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+
+    Lang    = mpc_new("lang");
+    Stmt    = mpc_new("stmt");
+    Grammar = mpc_new("grammar");
+    Term    = mpc_new("term");
+    Factor  = mpc_new("factor");
+    Base    = mpc_new("base");
+
+    mpc_define(Lang, mpc_apply_to(
+                mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+                mpca_stmt_list_apply_to, st
+                ));
+
+    mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+                mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+                free, free, free, mpc_soft_delete
+                ));
+
+    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+                Term,
+                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+                mpc_soft_delete
+                ));
+
+    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+
+    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+                Base,
+                mpc_or(7,
+                    mpc_sym("*"),
+                    mpc_sym("+"),
+                    mpc_sym("?"),
+                    mpc_sym("!"),
+                    mpc_sym("~"),
+                    mpc_tok_brackets(mpc_int(), free),
+                    mpc_pass()),
+                mpc_soft_delete
+                ));
+
+    mpc_define(Base, mpc_or(5,
+                mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+                mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+                mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+                mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+                mpc_tok_parens(Grammar, mpc_soft_delete)
+                ));
+
+
+    if (!mpc_parse_input(i, Lang, &r)) {
+        e = r.error;
+    } else {
+        e = NULL;
+    }
+
+    mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+
+    return e;
+}
+
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
+
+    va_list va;  
+    va_start(va, f);
+
+    st.va = &va;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
+
+    i = mpc_input_new_file("<mpca_lang_file>", f);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
+
+    free(st.parsers);
+    va_end(va);
+    return err;
 }
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { return xs[2]; }
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
-    int i;
-    for (i = 0; i < n; i++) {
-        if (i != x) { free(xs[i]); }
-    }
-    return xs[x];
-}
+    va_list va;  
+    va_start(va, p);
 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+    st.va = &va;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
-    char *x = calloc(1, 1);
-    int i;
-    for (i = 0; i < n; i++) {
-        x = realloc(x, strlen(x) + strlen(xs[i]) + 1);
-        strcat(x, xs[i]);
-        free(xs[i]);
-    }
-    return x;
+    i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
+
+    free(st.parsers);
+    va_end(va);
+    return err;
 }
 
-mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
 
-    int **vs = (int**)xs;
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-    if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
-    if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
-    if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
-    if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
-    if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+    va_list va;
+    va_start(va, language);
 
-    free(xs[1]); free(xs[2]);
+    st.va = &va;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
 
-    return xs[0];
+    i = mpc_input_new_string("<mpca_lang>", language, strlen(language));
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
+
+    free(st.parsers);
+    va_end(va);
+    return err;
 }
 
-/*
- ** Printing
- */
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
 
-    /* TODO: Print Everything Escaped */
+    va_list va;
 
-    int i;
-    char *s, *e;
-    char buff[2];
+    FILE *f = fopen(filename, "rb");
 
-    if (p->retained && !force) {;
-        if (p->name) { printf("<%s>", p->name); }
-        else { printf("<anon>"); }
-        return;
+    if (f == NULL) {
+        return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
     }
 
-    if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-    if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-    if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-    if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-    if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-    if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-    if (p->type == MPC_TYPE_EXPECT) {
-        printf("%s", p->data.expect.m);
-        /*mpc_print_unretained(p->data.expect.x, 0);*/
-    }
+    va_start(va, filename);
 
-    if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-    if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+    st.va = &va;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
 
-    if (p->type == MPC_TYPE_SINGLE) {
-        buff[0] = p->data.single.x; buff[1] = '\0';
-        s = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("'%s'", s);
-        free(s);
-    }
+    i = mpc_input_new_file(filename, f);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-    if (p->type == MPC_TYPE_RANGE) {
-        buff[0] = p->data.range.x; buff[1] = '\0';
-        s = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        buff[0] = p->data.range.y; buff[1] = '\0';
-        e = mpcf_escape_new(
-                buff,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[%s-%s]", s, e);
-        free(s);
-        free(e);
-    }
+    free(st.parsers);
+    va_end(va);  
 
-    if (p->type == MPC_TYPE_ONEOF) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[%s]", s);
-        free(s);
-    }
+    fclose(f);
 
-    if (p->type == MPC_TYPE_NONEOF) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("[^%s]", s);
-        free(s);
-    }
+    return err;
+}
 
-    if (p->type == MPC_TYPE_STRING) {
-        s = mpcf_escape_new(
-                p->data.string.x,
-                mpc_escape_input_c,
-                mpc_escape_output_c);
-        printf("\"%s\"", s);
-        free(s);
-    }
+/*
+ ** Code Generation
+ **
+ ** A grammar can be written out ahead of time as
+ ** C source, with one function for every parser
+ ** in it doing exactly what the parsing loop does
+ ** for that parser. The generated parsers give the
+ ** same outputs and errors as the grammar passed
+ ** to `mpca_lang` but only ever read strings.
+ **
+ ** What a parser does depends on whether it is
+ ** under `mpc_predictive` and on whether it is
+ ** inside a span, so a function is written out for
+ ** each of these a parser is reached in.
+ **
+ ** As with `mpc_parse_input`, a parse first runs
+ ** quietly, leaving every error NULL, and is only
+ ** run again to build the error if it fails. While
+ ** quiet, alternatives of an `or` which cannot
+ ** start with the next byte are not tried at all.
+ **
+ ** The AST folds are called through wrappers which
+ ** use the tree folds instead when the input has a
+ ** tree builder, so every rule can also give a tree.
+ */
 
-    if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-    if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-    if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+enum {
+    MPC_GEN_BACKTRACK = 0,
+    MPC_GEN_PREDICT   = 1,
+    MPC_GEN_SPAN      = 2
+};
 
-    if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-    if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+enum {
+    MPC_GEN_PEEKC     = 1 << 0,
+    MPC_GEN_ADVANCE   = 1 << 1,
+    MPC_GEN_CHAR      = 1 << 2,
+    MPC_GEN_COPY      = 1 << 3,
+    MPC_GEN_STRING    = 1 << 4,
+    MPC_GEN_SLICE     = 1 << 5,
+    MPC_GEN_STATE     = 1 << 6,
+    MPC_GEN_BOUNDARY  = 1 << 7,
+    MPC_GEN_INCORRECT = 1 << 8,
+    MPC_GEN_EXPECTED  = 1 << 9,
+    MPC_GEN_OR        = 1 << 10,
+    MPC_GEN_PUSH      = 1 << 11,
+    MPC_GEN_FOLD_AST  = 1 << 12,
+    MPC_GEN_STR_AST   = 1 << 13,
+    MPC_GEN_STATE_AST = 1 << 14,
+    MPC_GEN_ADD_ROOT  = 1 << 15,
+    MPC_GEN_TAG       = 1 << 16,
+    MPC_GEN_ADD_TAG   = 1 << 17,
+    MPC_GEN_AST_DEL   = 1 << 18,
+    MPC_GEN_TREE      = 0x7F << 12
+};
 
-    if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-    if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-    if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+typedef struct {
+    FILE *f;
+    int num;
+    mpc_parser_t **ps;
+    int *modes;
+    int uses;
+    const char *error;
+} mpc_gen_t;
 
-    if (p->type == MPC_TYPE_OR) {
-        printf("(");
-        for(i = 0; i < p->data.or.n-1; i++) {
-            mpc_print_unretained(p->data.or.xs[i], 0);
-            printf(" | ");
-        }
-        mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-        printf(")");
-    }
+typedef void (*mpc_gen_fn_t)(void);
 
-    if (p->type == MPC_TYPE_AND) {
-        printf("(");
-        for(i = 0; i < p->data.and.n-1; i++) {
-            mpc_print_unretained(p->data.and.xs[i], 0);
-            printf(" ");
-        }
-        mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-        printf(")");
-    }
+/*
+ ** What each function is, so a saved grammar can
+ ** only ever put a function where one of its type
+ ** is called.
+ */
 
-}
+enum {
+    MPC_GEN_FN_DTOR,
+    MPC_GEN_FN_CTOR,
+    MPC_GEN_FN_APPLY,
+    MPC_GEN_FN_APPLY_TO,
+    MPC_GEN_FN_FOLD,
+    MPC_GEN_FN_SATISFY
+};
 
-void mpc_print(mpc_parser_t *p) {
-    mpc_print_unretained(p, 1);
-    printf("\n");
-}
+static const struct { mpc_gen_fn_t f; const char *name; int kind; } mpc_gen_fns[] = {
+    { (mpc_gen_fn_t)free,                     "free",                     MPC_GEN_FN_DTOR },
+    { (mpc_gen_fn_t)mpcf_dtor_null,           "mpcf_dtor_null",           MPC_GEN_FN_DTOR },
+    { (mpc_gen_fn_t)mpcf_ctor_null,           "mpcf_ctor_null",           MPC_GEN_FN_CTOR },
+    { (mpc_gen_fn_t)mpcf_ctor_str,            "mpcf_ctor_str",            MPC_GEN_FN_CTOR },
+    { (mpc_gen_fn_t)mpcf_free,                "mpcf_free",                MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_int,                 "mpcf_int",                 MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_hex,                 "mpcf_hex",                 MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_oct,                 "mpcf_oct",                 MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_float,               "mpcf_float",               MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_escape,              "mpcf_escape",              MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_unescape,            "mpcf_unescape",            MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_unescape_regex,      "mpcf_unescape_regex",      MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_escape_string_raw,   "mpcf_escape_string_raw",   MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_unescape_string_raw, "mpcf_unescape_string_raw", MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_escape_char_raw,     "mpcf_escape_char_raw",     MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_unescape_char_raw,   "mpcf_unescape_char_raw",   MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_null,                "mpcf_null",                MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_fst,                 "mpcf_fst",                 MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_snd,                 "mpcf_snd",                 MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_trd,                 "mpcf_trd",                 MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_fst_free,            "mpcf_fst_free",            MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_snd_free,            "mpcf_snd_free",            MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_trd_free,            "mpcf_trd_free",            MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_strfold,             "mpcf_strfold",             MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_maths,               "mpcf_maths",               MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpc_ast_delete,           "mpc_ast_delete",           MPC_GEN_FN_DTOR },
+    { (mpc_gen_fn_t)mpc_ast_copy,             "mpc_ast_copy",             MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpc_ast_add_root,         "mpc_ast_add_root",         MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpc_ast_tag,              "mpc_ast_tag",              MPC_GEN_FN_APPLY_TO },
+    { (mpc_gen_fn_t)mpc_ast_add_tag,          "mpc_ast_add_tag",          MPC_GEN_FN_APPLY_TO },
+    { (mpc_gen_fn_t)mpcf_fold_ast,            "mpcf_fold_ast",            MPC_GEN_FN_FOLD },
+    { (mpc_gen_fn_t)mpcf_str_ast,             "mpcf_str_ast",             MPC_GEN_FN_APPLY },
+    { (mpc_gen_fn_t)mpcf_state_ast,           "mpcf_state_ast",           MPC_GEN_FN_FOLD },
+    { NULL, NULL, 0 }
+};
 
 /*
- ** Testing
+ ** The helpers every generated parser is written
+ ** against, each only written out if it is used.
  */
 
-/*
- ** These functions are slightly unwieldy and
- ** also the whole of the testing suite for mpc
- ** mpc is pretty shaky.
- **
- ** It could do with a lot more tests and more
- ** precision. Currently I am only really testing
- ** changes off of the examples.
- **
- */
+static const struct { int use; const char *text; } mpc_gen_prelude[] = {
+    { 0,
+        "typedef struct {\n"
+        "    const char *filename;\n"
+        "    const char *string;\n"
+        "    int length;\n"
+        "    mpc_state_t state;\n"
+        "    char last;\n"
+        "    int quiet;\n"
+        "    mpc_err_t *err;\n"
+        "    mpc_tree_builder_t *tree;\n"
+        "} mpcg_input_t;\n"
+        "\n"
+        "typedef int (*mpcg_parser_t)(mpcg_input_t *i, mpc_result_t *r);\n"
+        "\n"
+        "#define MPCG_IN(c, lo, w) ((unsigned char)((unsigned char)(c) - (lo)) <= (w))\n"
+        "#define MPCG_HAS(x, c) (((x)[(unsigned char)(c) >> 3] >> ((unsigned char)(c) & 7)) & 1)\n"
+        "#define MPCG_ERR(i, e) ((i)->quiet ? NULL : (e))\n"
+        "\n"
+        "static void mpcg_err(mpcg_input_t *i, mpc_err_t *e) {\n"
+        "    mpc_err_t *es[2];\n"
+        "    if (i->quiet) { return; }\n"
+        "    es[0] = i->err;\n"
+        "    es[1] = e;\n"
+        "    i->err = mpc_err_or(es, 2);\n"
+        "}\n" },
+    { MPC_GEN_PEEKC,
+        "static char mpcg_peekc(mpcg_input_t *i) {\n"
+        "    return i->state.pos < i->length ? i->string[i->state.pos] : '\\0';\n"
+        "}\n" },
+    { MPC_GEN_ADVANCE,
+        "static void mpcg_advance(mpcg_input_t *i, char c) {\n"
+        "    i->last = c;\n"
+        "    i->state.pos++;\n"
+        "    i->state.col++;\n"
+        "    if (c == '\\n') {\n"
+        "        i->state.col = 0;\n"
+        "        i->state.row++;\n"
+        "    }\n"
+        "}\n" },
+    { MPC_GEN_CHAR,
+        "static char *mpcg_char(char c) {\n"
+        "    char *o = malloc(2);\n"
+        "    o[0] = c;\n"
+        "    o[1] = '\\0';\n"
+        "    return o;\n"
+        "}\n" },
+    { MPC_GEN_COPY,
+        "static char *mpcg_copy(const char *x) {\n"
+        "    char *o = malloc(strlen(x) + 1);\n"
+        "    strcpy(o, x);\n"
+        "    return o;\n"
+        "}\n" },
+    { MPC_GEN_STRING,
+        "static int mpcg_string(mpcg_input_t *i, const char *x, int rewind) {\n"
+        "    mpc_state_t s = i->state;\n"
+        "    char l = i->last;\n"
+        "    while (*x) {\n"
+        "        if (i->state.pos >= i->length || i->string[i->state.pos] != *x) {\n"
+        "            if (rewind) { i->state = s; i->last = l; }\n"
+        "            return 0;\n"
+        "        }\n"
+        "        mpcg_advance(i, *x);\n"
+        "        x++;\n"
+        "    }\n"
+        "    return 1;\n"
+        "}\n" },
+    { MPC_GEN_SLICE,
+        "static char *mpcg_slice(mpcg_input_t *i, int start) {\n"
+        "    const char *x = i->string + start;\n"
+        "    int n = i->state.pos - start;\n"
+        "    int j, k;\n"
+        "    char *o = malloc(n + 1);\n"
+        "    for (j = 0, k = 0; j < n; j++) {\n"
+        "        if (x[j] != '\\0') { o[k++] = x[j]; }\n"
+        "    }\n"
+        "    o[k] = '\\0';\n"
+        "    return o;\n"
+        "}\n" },
+    { MPC_GEN_STATE,
+        "static mpc_state_t *mpcg_state(mpcg_input_t *i) {\n"
+        "    mpc_state_t *s = malloc(sizeof(mpc_state_t));\n"
+        "    *s = i->state;\n"
+        "    return s;\n"
+        "}\n" },
+    { MPC_GEN_BOUNDARY,
+        "static int mpcg_boundary(char prev, char next) {\n"
+        "    const char *word = \"abcdefghijklmnopqrstuvwxyz\"\n"
+        "        \"ABCDEFGHIJKLMNOPQRSTUVWXYZ\"\n"
+        "        \"0123456789_\";\n"
+        "    if ( strchr(word, next) &&  prev == '\\0') { return 1; }\n"
+        "    if ( strchr(word, prev) &&  next == '\\0') { return 1; }\n"
+        "    if ( strchr(word, next) && !strchr(word, prev)) { return 1; }\n"
+        "    if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }\n"
+        "    return 0;\n"
+        "}\n" },
+    { MPC_GEN_INCORRECT,
+        "static int mpcg_incorrect(mpcg_input_t *i, mpc_result_t *r) {\n"
+        "    r->error = MPCG_ERR(i, mpc_err_fail(i->filename, i->state, \"Incorrect Input\"));\n"
+        "    return 0;\n"
+        "}\n" },
+    { MPC_GEN_EXPECTED,
+        "static int mpcg_expected(mpcg_input_t *i, mpc_result_t *r, const char *e) {\n"
+        "    r->error = MPCG_ERR(i, mpc_err_new(i->filename, i->state, e, mpcg_peekc(i)));\n"
+        "    return 0;\n"
+        "}\n" },
+    { MPC_GEN_OR,
+        "static int mpcg_or(mpcg_input_t *i, mpc_err_t **es, int n) {\n"
+        "    while (n) { mpcg_err(i, es[--n]); }\n"
+        "    return 1;\n"
+        "}\n" },
+    { MPC_GEN_PUSH,
+        "static mpc_val_t **mpcg_push(mpc_val_t **xs, int n, mpc_val_t *x) {\n"
+        "    if (n == 0 || (n >= 4 && (n & (n-1)) == 0)) {\n"
+        "        xs = realloc(xs, sizeof(mpc_val_t*) * (n ? n * 2 : 4));\n"
+        "    }\n"
+        "    xs[n] = x;\n"
+        "    return xs;\n"
+        "}\n" },
+    { MPC_GEN_FOLD_AST,
+        "static mpc_val_t *mpcg_fold_ast(mpcg_input_t *i, int n, mpc_val_t **xs) {\n"
+        "    return i->tree ? mpcf_tree_fold(i->tree, n, xs) : mpcf_fold_ast(n, xs);\n"
+        "}\n" },
+    { MPC_GEN_STR_AST,
+        "static mpc_val_t *mpcg_str_ast(mpcg_input_t *i, mpc_val_t *c) {\n"
+        "    return i->tree ? mpcf_tree_str(i->tree, c) : mpcf_str_ast(c);\n"
+        "}\n" },
+    { MPC_GEN_STATE_AST,
+        "static mpc_val_t *mpcg_state_ast(mpcg_input_t *i, int n, mpc_val_t **xs) {\n"
+        "    return i->tree ? mpcf_tree_state(i->tree, n, xs) : mpcf_state_ast(n, xs);\n"
+        "}\n" },
+    { MPC_GEN_ADD_ROOT,
+        "static mpc_val_t *mpcg_add_root(mpcg_input_t *i, mpc_val_t *x) {\n"
+        "    return i->tree ? mpcf_tree_root(i->tree, x) : mpc_ast_add_root(x);\n"
+        "}\n" },
+    { MPC_GEN_TAG,
+        "static mpc_val_t *mpcg_tag(mpcg_input_t *i, mpc_val_t *x, const char *t) {\n"
+        "    return i->tree ? mpcf_tree_tag(i->tree, x, t) : mpc_ast_tag(x, t);\n"
+        "}\n" },
+    { MPC_GEN_ADD_TAG,
+        "static mpc_val_t *mpcg_add_tag(mpcg_input_t *i, mpc_val_t *x, const char *t) {\n"
+        "    return i->tree ? mpcf_tree_add_tag(i->tree, x, t) : mpc_ast_add_tag(x, t);\n"
+        "}\n" },
+    { MPC_GEN_AST_DEL,
+        "static void mpcg_ast_delete(mpcg_input_t *i, mpc_val_t *x) {\n"
+        "    if (!i->tree) { mpc_ast_delete(x); }\n"
+        "}\n" },
+    { 0,
+        "static int mpcg_parse(const char *filename, const char *string, size_t length, mpcg_parser_t p,\n"
+        "                      mpc_tree_builder_t *tree, mpc_result_t *r) {\n"
+        "\n"
+        "    mpcg_input_t i;\n"
+        "    mpc_state_t s;\n"
+        "\n"
+        "    s.pos = 0;\n"
+        "    s.row = 0;\n"
+        "    s.col = 0;\n"
+        "\n"
+        "    if (length > 0x7FFFFFFF) {\n"
+        "        r->output = NULL;\n"
+        "        r->error = mpc_err_fail(filename, s, \"Input too large!\");\n"
+        "        return 0;\n"
+        "    }\n"
+        "\n"
+        "    i.filename = filename;\n"
+        "    i.string = string;\n"
+        "    i.length = (int)length;\n"
+        "    i.state = s;\n"
+        "    i.last = '\\0';\n"
+        "    i.quiet = 1;\n"
+        "    i.err = NULL;\n"
+        "    i.tree = tree;\n"
+        "\n"
+        "    if (p(&i, r)) { return 1; }\n"
+        "\n"
+        "    i.state = s;\n"
+        "    i.last = '\\0';\n"
+        "    i.quiet = 0;\n"
+        "\n"
+        "    s.pos = -1;\n"
+        "    s.row = -1;\n"
+        "    s.col = -1;\n"
+        "    i.err = mpc_err_fail(filename, s, \"Unknown Error\");\n"
+        "\n"
+        "    if (p(&i, r)) {\n"
+        "        mpc_err_delete(i.err);\n"
+        "        return 1;\n"
+        "    }\n"
+        "\n"
+        "    mpcg_err(&i, r->error);\n"
+        "    r->error = i.err;\n"
+        "    return 0;\n"
+        "}\n" },
+    { MPC_GEN_TREE,
+        "static int mpcg_parse_tree(const char *filename, const char *string, size_t length, mpcg_parser_t p, mpc_result_t *r) {\n"
+        "    mpc_tree_builder_t *b = mpc_tree_builder_new();\n"
+        "    int ok = mpcg_parse(filename, string, length, p, b, r);\n"
+        "    if (ok) { r->output = mpc_tree_build(b, r->output); }\n"
+        "    mpc_tree_builder_delete(b);\n"
+        "    return ok;\n"
+        "}\n" },
+    { 0, NULL }
+};
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, void *d,
-        int(*tester)(void*, void*),
-        mpc_dtor_t destructor,
-        void(*printer)(void*)) {
+static void mpc_gen_use(mpc_gen_t *g, int uses) {
+    g->uses |= uses;
+    if (uses & MPC_GEN_EXPECTED) { g->uses |= MPC_GEN_PEEKC; }
+    if (uses & MPC_GEN_STRING) { g->uses |= MPC_GEN_ADVANCE; }
+}
 
-    mpc_result_t r;  
-    if (mpc_parse("<test>", s, p, &r)) {
+static const char *mpc_gen_fn(mpc_gen_t *g, mpc_gen_fn_t f) {
+    int j;
+    for (j = 0; mpc_gen_fns[j].f; j++) {
+        if (mpc_gen_fns[j].f == f) { return mpc_gen_fns[j].name; }
+    }
+    g->error = "Cannot write out a parser using an unknown function!";
+    return "NULL";
+}
+
+static const struct { mpc_gen_fn_t f; int use; const char *name; } mpc_gen_tree_fns[] = {
+    { (mpc_gen_fn_t)mpcf_fold_ast,    MPC_GEN_FOLD_AST,  "mpcg_fold_ast" },
+    { (mpc_gen_fn_t)mpcf_str_ast,     MPC_GEN_STR_AST,   "mpcg_str_ast" },
+    { (mpc_gen_fn_t)mpcf_state_ast,   MPC_GEN_STATE_AST, "mpcg_state_ast" },
+    { (mpc_gen_fn_t)mpc_ast_add_root, MPC_GEN_ADD_ROOT,  "mpcg_add_root" },
+    { (mpc_gen_fn_t)mpc_ast_tag,      MPC_GEN_TAG,       "mpcg_tag" },
+    { (mpc_gen_fn_t)mpc_ast_add_tag,  MPC_GEN_ADD_TAG,   "mpcg_add_tag" },
+    { (mpc_gen_fn_t)mpc_ast_delete,   MPC_GEN_AST_DEL,   "mpcg_ast_delete" },
+    { NULL, 0, NULL }
+};
 
-        if (tester(r.output, d)) {
-            destructor(r.output);
-            return 0;
-        } else {
-            destructor(r.output);
-            return 1;
+/*
+ ** Writes out the start of a call to `f`, going
+ ** through its wrapper if it builds the AST.
+ */
+
+static void mpc_gen_call(mpc_gen_t *g, mpc_gen_fn_t f) {
+    int j;
+    for (j = 0; mpc_gen_tree_fns[j].f; j++) {
+        if (mpc_gen_tree_fns[j].f == f) {
+            mpc_gen_use(g, mpc_gen_tree_fns[j].use);
+            fprintf(g->f, "%s(i, ", mpc_gen_tree_fns[j].name);
+            return;
         }
+    }
+    fprintf(g->f, "%s(", mpc_gen_fn(g, f));
+}
 
+static void mpc_gen_char(FILE *f, char c) {
+    if (c >= ' ' && c <= '~' && c != '\'' && c != '\\') {
+        fprintf(f, "'%c'", c);
     } else {
-        mpc_err_delete(r.error);
-        return 1;
+        fprintf(f, "'\\%03o'", (unsigned char)c);
     }
-
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
-        int(*tester)(void*, void*), 
-        mpc_dtor_t destructor, 
-        void(*printer)(void*)) {
-
-    mpc_result_t r;  
-    if (mpc_parse("<test>", s, p, &r)) {
-
-        if (tester(r.output, d)) {
-            destructor(r.output);
-            return 1;
+static void mpc_gen_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s >= ' ' && *s <= '~' && *s != '"' && *s != '\\' && *s != '?') {
+            fputc(*s, f);
         } else {
-            printf("Got "); printer(r.output); printf("\n");
-            printf("Expected "); printer(d); printf("\n");
-            destructor(r.output);
-            return 0;
+            fprintf(f, "\\%03o", (unsigned char)*s);
         }
-
-    } else {    
-        mpc_err_print(r.error);
-        mpc_err_delete(r.error);
-        return 0;
-
     }
-
+    fputc('"', f);
 }
 
-
 /*
- ** AST
+ ** Returns the function written out for `p` when
+ ** reached in `mode`, adding it to the ones still
+ ** to write out if it is new.
  */
 
-void mpc_ast_delete(mpc_ast_t *a) {
-
-    int i;
+static int mpc_gen_ref(mpc_gen_t *g, mpc_parser_t *p, int mode) {
+    int k;
+    for (k = 0; k < g->num; k++) {
+        if (g->ps[k] == p && g->modes[k] == mode) { return k; }
+    }
+    g->num++;
+    g->ps = realloc(g->ps, sizeof(mpc_parser_t*) * g->num);
+    g->modes = realloc(g->modes, sizeof(int) * g->num);
+    g->ps[g->num-1] = p;
+    g->modes[g->num-1] = mode;
+    return g->num-1;
+}
+
+static void mpc_gen_class_decl(mpc_gen_t *g, mpc_parser_t *c) {
+    int j;
+    if (c->data.class.n) { return; }
+    fprintf(g->f, "    static const unsigned char set[32] = {");
+    for (j = 0; j < 32; j++) {
+        fprintf(g->f, j ? ", %i" : "%i", c->data.class.x[j]);
+    }
+    fprintf(g->f, "};\n");
+}
 
-    if (a == NULL) { return; }
-    for (i = 0; i < a->children_num; i++) {
-        mpc_ast_delete(a->children[i]);
+static void mpc_gen_class_test(mpc_gen_t *g, mpc_parser_t *c) {
+    int j;
+    if (c->data.class.n == 0) {
+        fprintf(g->f, "MPCG_HAS(set, c)");
+        return;
+    }
+    for (j = 0; j < c->data.class.n; j++) {
+        fprintf(g->f, "%sMPCG_IN(c, %i, %i)", j ? " || " : "", c->data.class.lo[j], c->data.class.width[j]);
     }
+}
 
-    free(a->children);
-    free(a->tag);
-    free(a->contents);
-    free(a);
+static void mpc_gen_class_err(mpc_gen_t *g, mpc_parser_t *x) {
+    if (x->type == MPC_TYPE_EXPECT) {
+        mpc_gen_use(g, MPC_GEN_PEEKC);
+        fprintf(g->f, "mpc_err_new(i->filename, i->state, ");
+        mpc_gen_string(g->f, x->data.expect.m);
+        fprintf(g->f, ", mpcg_peekc(i))");
+    } else {
+        fprintf(g->f, "mpc_err_fail(i->filename, i->state, \"Incorrect Input\")");
+    }
+}
 
+static void mpc_gen_mark(mpc_gen_t *g, int back) {
+    if (back) { fprintf(g->f, "    mpc_state_t s = i->state;\n    char l = i->last;\n"); }
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-    free(a->children);
-    free(a->tag);
-    free(a->contents);
-    free(a);
+static void mpc_gen_rewind(mpc_gen_t *g, int back, const char *indent) {
+    if (back) { fprintf(g->f, "%si->state = s;\n%si->last = l;\n", indent, indent); }
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+static void mpc_gen_repeat(mpc_gen_t *g, mpc_parser_t *p, int mode, int out) {
 
-    mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+    FILE *f = g->f;
+    mpc_parser_t *c = mpc_class_of(p->data.repeat.x);
+    int x;
 
-    a->tag = malloc(strlen(tag) + 1);
-    strcpy(a->tag, tag);
+    /* Runs of a class skip straight over the input */
+    if (!out && c && p->type != MPC_TYPE_COUNT) {
+        mpc_gen_use(g, MPC_GEN_ADVANCE);
+        mpc_gen_class_decl(g, c);
+        if (p->type == MPC_TYPE_MANY1) { fprintf(f, "    int n = 0;\n"); }
+        fprintf(f, "    char c;\n");
+        fprintf(f, "    while (i->state.pos < i->length) {\n");
+        fprintf(f, "        c = i->string[i->state.pos];\n");
+        fprintf(f, "        if (!(");
+        mpc_gen_class_test(g, c);
+        fprintf(f, ")) { break; }\n");
+        fprintf(f, "        mpcg_advance(i, c);\n");
+        if (p->type == MPC_TYPE_MANY1) { fprintf(f, "        n++;\n"); }
+        fprintf(f, "    }\n");
+        if (p->type == MPC_TYPE_MANY1) {
+            fprintf(f, "    if (n == 0) {\n        r->error = MPCG_ERR(i, mpc_err_many1(");
+            mpc_gen_class_err(g, p->data.repeat.x);
+            fprintf(f, "));\n        return 0;\n    }\n");
+        }
+        fprintf(f, "    if (!i->quiet) { mpcg_err(i, ");
+        mpc_gen_class_err(g, p->data.repeat.x);
+        fprintf(f, "); }\n    r->output = NULL;\n    return 1;\n");
+        return;
+    }
 
-    a->contents = malloc(strlen(contents) + 1);
-    strcpy(a->contents, contents);
+    x = mpc_gen_ref(g, p->data.repeat.x, mode);
 
-    a->state = mpc_state_new();
+    if (out) { mpc_gen_use(g, MPC_GEN_PUSH); }
 
-    a->children_num = 0;
-    a->children = NULL;
-    return a;
+    fprintf(f, "    mpc_result_t x;\n");
+    if (out) { fprintf(f, "    mpc_val_t **xs = NULL;\n"); }
+    if (out || p->type == MPC_TYPE_COUNT) { fprintf(f, "    int n = 0;\n"); }
+    if (p->type == MPC_TYPE_COUNT) { mpc_gen_mark(g, mode != MPC_GEN_PREDICT); }
+
+    if (p->type == MPC_TYPE_MANY1) {
+        fprintf(f, "    if (!mpcg_p%i(i, &x)) {\n", x);
+        fprintf(f, "        r->error = MPCG_ERR(i, mpc_err_many1(x.error));\n        return 0;\n    }\n");
+        if (out) { fprintf(f, "    xs = mpcg_push(xs, n++, x.output);\n"); }
+    }
+
+    fprintf(f, "    while (mpcg_p%i(i, &x)) {", x);
+    if (out) {
+        fprintf(f, "\n        xs = mpcg_push(xs, n++, x.output);\n    }\n");
+    } else if (p->type == MPC_TYPE_COUNT) {
+        fprintf(f, "\n        n++;\n    }\n");
+    } else {
+        fprintf(f, " }\n");
+    }
+
+    if (p->type == MPC_TYPE_COUNT) {
+        fprintf(f, "    if (n != %i) {\n", p->data.repeat.n);
+        if (out) {
+            fprintf(f, "        while (n) { n--; ");
+            mpc_gen_call(g, (mpc_gen_fn_t)p->data.repeat.dx);
+            fprintf(f, "xs[n]); }\n");
+            fprintf(f, "        free(xs);\n");
+        }
+        mpc_gen_rewind(g, mode != MPC_GEN_PREDICT, "        ");
+        fprintf(f, "        r->error = MPCG_ERR(i, mpc_err_count(x.error, %i));\n        return 0;\n    }\n", p->data.repeat.n);
+    }
 
+    fprintf(f, "    mpcg_err(i, x.error);\n");
+    if (out) {
+        fprintf(f, "    r->output = ");
+        mpc_gen_call(g, (mpc_gen_fn_t)p->data.repeat.f);
+        fprintf(f, "n, xs);\n");
+        fprintf(f, "    free(xs);\n");
+    } else {
+        fprintf(f, "    r->output = NULL;\n");
+    }
+    fprintf(f, "    return 1;\n");
 }
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+/*
+ ** While quiet, each alternative which fails on
+ ** the next byte without consuming anything, as
+ ** found by `mpc_first`, is first tested against
+ ** a set of the bytes it can start with. As with
+ ** optimising, NUL and the end of input never skip.
+ */
 
-    mpc_ast_t *a = mpc_ast_new(tag, "");
+static void mpc_gen_or_quiet(mpc_gen_t *g, mpc_parser_t *p, int mode) {
 
-    int i;
-    va_list va;
-    va_start(va, tag);
+    FILE *f = g->f;
+    unsigned char set[32];
+    int j, k, skips = 0;
 
-    for (i = 0; i < n; i++) {
-        mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+    for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_first(p->data.or.xs[j], set, 0)) { continue; }
+        if (!skips++) { fprintf(f, "    char c;\n"); }
+        fprintf(f, "    static const unsigned char first%i[32] = {", j);
+        for (k = 0; k < 32; k++) { fprintf(f, k ? ", %i" : "%i", set[k]); }
+        fprintf(f, "};\n");
     }
 
-    va_end(va);
-
-    return a;
+    if (!skips) { return; }
 
+    mpc_gen_use(g, MPC_GEN_PEEKC);
+    fprintf(f, "    if (i->quiet) {\n");
+    for (j = 0; j < p->data.or.n; j++) {
+        if (mpc_first(p->data.or.xs[j], set, 0)) {
+            fprintf(f, "        c = mpcg_peekc(i);\n        if ((c == '\\0' || MPCG_HAS(first%i, c)) && mpcg_p%i(i, r)) { return 1; }\n", j, mpc_gen_ref(g, p->data.or.xs[j], mode));
+        } else {
+            fprintf(f, "        if (mpcg_p%i(i, r)) { return 1; }\n", mpc_gen_ref(g, p->data.or.xs[j], mode));
+        }
+    }
+    fprintf(f, "        r->error = NULL;\n        return 0;\n    }\n");
 }
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+static void mpc_gen_or(mpc_gen_t *g, mpc_parser_t *p, int mode) {
 
-    mpc_ast_t *r;
+    FILE *f = g->f;
+    int j;
 
-    if (a == NULL) { return a; }
-    if (a->children_num == 0) { return a; }
-    if (a->children_num == 1) { return a; }
+    if (p->data.or.n == 0) {
+        fprintf(f, "    r->output = NULL;\n    return 1;\n");
+        return;
+    }
 
-    r = mpc_ast_new(">", "");
-    mpc_ast_add_child(r, a);
-    return r;
+    fprintf(f, "    mpc_err_t *es[%i];\n", p->data.or.n);
+    mpc_gen_or_quiet(g, p, mode);
+    for (j = 0; j < p->data.or.n; j++) {
+        if (j == 0) {
+            fprintf(f, "    if (mpcg_p%i(i, r)) { return 1; }\n", mpc_gen_ref(g, p->data.or.xs[j], mode));
+        } else {
+            mpc_gen_use(g, MPC_GEN_OR);
+            fprintf(f, "    if (mpcg_p%i(i, r)) { return mpcg_or(i, es, %i); }\n", mpc_gen_ref(g, p->data.or.xs[j], mode), j);
+        }
+        fprintf(f, "    es[%i] = r->error;\n", j);
+    }
+    fprintf(f, "    r->error = MPCG_ERR(i, mpc_err_or(es, %i));\n    return 0;\n", p->data.or.n);
 }
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+static void mpc_gen_and(mpc_gen_t *g, mpc_parser_t *p, int mode, int out) {
 
-    int i;
+    FILE *f = g->f;
+    int back = mode != MPC_GEN_PREDICT;
+    int n = p->data.and.n;
+    int j;
 
-    if (strcmp(a->tag, b->tag) != 0) { return 0; }
-    if (strcmp(a->contents, b->contents) != 0) { return 0; }
-    if (a->children_num != b->children_num) { return 0; }
+    if (n == 0) {
+        if (out) {
+            fprintf(f, "    r->output = ");
+            mpc_gen_call(g, (mpc_gen_fn_t)p->data.and.f);
+            fprintf(f, "0, NULL);\n    return 1;\n");
+        } else {
+            fprintf(f, "    r->output = NULL;\n    return 1;\n");
+        }
+        return;
+    }
 
-    for (i = 0; i < a->children_num; i++) {
-        if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+    if (!out) {
+        mpc_gen_mark(g, back);
+        for (j = 0; j < n; j++) {
+            fprintf(f, "%s!mpcg_p%i(i, r)", j ? " ||\n        " : "    if (", mpc_gen_ref(g, p->data.and.xs[j], mode));
+        }
+        fprintf(f, ") {\n");
+        mpc_gen_rewind(g, back, "        ");
+        fprintf(f, "        return 0;\n    }\n    r->output = NULL;\n    return 1;\n");
+        return;
     }
 
-    return 1;
-}
+    fprintf(f, "    mpc_val_t *xs[%i];\n", n);
+    mpc_gen_mark(g, back);
+    for (j = 0; j < n; j++) {
+        fprintf(f, "    if (!mpcg_p%i(i, r)) { goto fail%i; }\n", mpc_gen_ref(g, p->data.and.xs[j], mode), j);
+        fprintf(f, "    xs[%i] = r->output;\n", j);
+    }
+    fprintf(f, "    r->output = ");
+    mpc_gen_call(g, (mpc_gen_fn_t)p->data.and.f);
+    fprintf(f, "%i, xs);\n    return 1;\n", n);
+    for (j = n-1; j > 0; j--) {
+        fprintf(f, "fail%i:\n    ", j);
+        mpc_gen_call(g, (mpc_gen_fn_t)p->data.and.dxs[j-1]);
+        fprintf(f, "xs[%i]);\n", j-1);
+    }
+    fprintf(f, "fail0:\n");
+    mpc_gen_rewind(g, back, "    ");
+    fprintf(f, "    return 0;\n");
+}
+
+static void mpc_gen_parser(mpc_gen_t *g, int k) {
+
+    FILE *f = g->f;
+    mpc_parser_t *p = g->ps[k];
+    int mode = g->modes[k];
+    int out = mode != MPC_GEN_SPAN;
+    int back = mode != MPC_GEN_PREDICT;
+    int child = mode;
+    mpc_gen_fn_t fn;
+
+    if (p->retained) { fprintf(f, "/* %s */\n", p->name); }
+    fprintf(f, "static int mpcg_p%i(mpcg_input_t *i, mpc_result_t *r) {\n", k);
+
+    /* The outermost span matches with outputs off and is copied out of the input */
+    if (mode == MPC_GEN_BACKTRACK && p->span) {
+        mpc_gen_use(g, MPC_GEN_SLICE);
+        fprintf(f, "    int start = i->state.pos;\n");
+        fprintf(f, "    if (!mpcg_p%i(i, r)) { return 0; }\n", mpc_gen_ref(g, p, MPC_GEN_SPAN));
+        fprintf(f, "    r->output = mpcg_slice(i, start);\n    return 1;\n}\n\n");
+        return;
+    }
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-    r->children_num++;
-    r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-    r->children[r->children_num-1] = a;
-    return r;
-}
+    switch (p->type) {
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-    if (a == NULL) { return a; }
-    a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-    memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-    memmove(a->tag, t, strlen(t));
-    memmove(a->tag + strlen(t), "|", 1);
-    return a;
-}
+        case MPC_TYPE_ANY:
+        case MPC_TYPE_CLASS:
+        case MPC_TYPE_SATISFY:
+            mpc_gen_use(g, MPC_GEN_ADVANCE | MPC_GEN_INCORRECT | (out ? MPC_GEN_CHAR : 0));
+            if (p->type == MPC_TYPE_CLASS) { mpc_gen_class_decl(g, p); }
+            fprintf(f, "    char c;\n");
+            fprintf(f, "    if (i->state.pos >= i->length) { return mpcg_incorrect(i, r); }\n");
+            fprintf(f, "    c = i->string[i->state.pos];\n");
+            if (p->type == MPC_TYPE_CLASS) {
+                fprintf(f, "    if (!(");
+                mpc_gen_class_test(g, p);
+                fprintf(f, ")) { return mpcg_incorrect(i, r); }\n");
+            }
+            if (p->type == MPC_TYPE_SATISFY) {
+                fprintf(f, "    if (!%s(c)) { return mpcg_incorrect(i, r); }\n", mpc_gen_fn(g, (mpc_gen_fn_t)p->data.satisfy.f));
+            }
+            fprintf(f, "    mpcg_advance(i, c);\n");
+            fprintf(f, "    r->output = %s;\n    return 1;\n", out ? "mpcg_char(c)" : "NULL");
+            break;
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-    a->tag = realloc(a->tag, strlen(t) + 1);
-    strcpy(a->tag, t);
-    return a;
-}
+        case MPC_TYPE_SINGLE:
+            mpc_gen_use(g, MPC_GEN_ADVANCE | MPC_GEN_INCORRECT | (out ? MPC_GEN_CHAR : 0));
+            fprintf(f, "    if (i->state.pos >= i->length || i->string[i->state.pos] != ");
+            mpc_gen_char(f, p->data.single.x);
+            fprintf(f, ") { return mpcg_incorrect(i, r); }\n");
+            fprintf(f, "    mpcg_advance(i, i->string[i->state.pos]);\n");
+            fprintf(f, "    r->output = %s;\n    return 1;\n", out ? "mpcg_char(i->last)" : "NULL");
+            break;
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-    if (a == NULL) { return a; }
-    a->state = s;
-    return a;
-}
+        case MPC_TYPE_STRING:
+            mpc_gen_use(g, MPC_GEN_STRING | MPC_GEN_INCORRECT | (out ? MPC_GEN_COPY : 0));
+            fprintf(f, "    if (!mpcg_string(i, ");
+            mpc_gen_string(f, p->data.string.x);
+            fprintf(f, ", %i)) { return mpcg_incorrect(i, r); }\n", back);
+            if (out) {
+                fprintf(f, "    r->output = mpcg_copy(");
+                mpc_gen_string(f, p->data.string.x);
+                fprintf(f, ");\n    return 1;\n");
+            } else {
+                fprintf(f, "    r->output = NULL;\n    return 1;\n");
+            }
+            break;
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d) {
+        case MPC_TYPE_UNDEFINED:
+            fprintf(f, "    r->error = MPCG_ERR(i, mpc_err_fail(i->filename, i->state, \"Parser Undefined!\"));\n    return 0;\n");
+            break;
 
-    int i;
-    for (i = 0; i < d; i++) { printf("  "); }
+        case MPC_TYPE_PASS:
+            fprintf(f, "    (void)i;\n    r->output = NULL;\n    return 1;\n");
+            break;
 
-    if (strlen(a->contents)) {
-        printf("%s:%i:%i '%s'\n", a->tag, a->state.row+1, a->state.col+1, a->contents);
-    } else {
-        printf("%s \n", a->tag);
-    }
+        case MPC_TYPE_FAIL:
+            fprintf(f, "    r->error = MPCG_ERR(i, mpc_err_fail(i->filename, i->state, ");
+            mpc_gen_string(f, p->data.fail.m);
+            fprintf(f, "));\n    return 0;\n");
+            break;
 
-    for (i = 0; i < a->children_num; i++) {
-        mpc_ast_print_depth(a->children[i], d+1);
-    }
+        case MPC_TYPE_LIFT:
+            fprintf(f, "    (void)i;\n    r->output = %s%s;\n    return 1;\n", out ? mpc_gen_fn(g, (mpc_gen_fn_t)p->data.lift.lf) : "NULL", out ? "()" : "");
+            break;
 
-}
+        case MPC_TYPE_LIFT_VAL:
+            if (p->data.lift.x) { g->error = "Cannot write out a parser lifting a value!"; }
+            fprintf(f, "    (void)i;\n    r->output = NULL;\n    return 1;\n");
+            break;
 
-void mpc_ast_print(mpc_ast_t *a) {
-    mpc_ast_print_depth(a, 0);
-}
+        case MPC_TYPE_STATE:
+            mpc_gen_use(g, MPC_GEN_STATE);
+            fprintf(f, "    r->output = mpcg_state(i);\n    return 1;\n");
+            break;
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+        case MPC_TYPE_ANCHOR:
+            mpc_gen_use(g, MPC_GEN_EXPECTED);
+            if (p->data.anchor.f == mpc_soi_anchor) {
+                fprintf(f, "    if (i->state.pos == 0) {\n");
+            } else if (p->data.anchor.f == mpc_eoi_anchor) {
+                fprintf(f, "    if (i->state.pos >= i->length) {\n");
+            } else if (p->data.anchor.f == mpc_boundary_anchor) {
+                mpc_gen_use(g, MPC_GEN_BOUNDARY);
+                fprintf(f, "    if (mpcg_boundary(i->last, mpcg_peekc(i))) {\n");
+            } else {
+                g->error = "Cannot write out a parser using an unknown anchor!";
+                fprintf(f, "    if (0) {\n");
+            }
+            fprintf(f, "        r->output = NULL;\n        return 1;\n    }\n");
+            fprintf(f, "    return mpcg_expected(i, r, \"anchor\");\n");
+            break;
 
-    int i, j;
-    mpc_ast_t** as = (mpc_ast_t**)xs;
-    mpc_ast_t *r;
+        case MPC_TYPE_EXPECT:
+            mpc_gen_use(g, MPC_GEN_EXPECTED);
+            fprintf(f, "    if (mpcg_p%i(i, r)) { return 1; }\n", mpc_gen_ref(g, p->data.expect.x, child));
+            fprintf(f, "    mpc_err_delete(r->error);\n");
+            fprintf(f, "    return mpcg_expected(i, r, ");
+            mpc_gen_string(f, p->data.expect.m);
+            fprintf(f, ");\n");
+            break;
 
-    if (n == 0) { return NULL; }
-    if (n == 1) { return xs[0]; }
-    if (n == 2 && xs[1] == NULL) { return xs[0]; }
-    if (n == 2 && xs[0] == NULL) { return xs[1]; }
+        case MPC_TYPE_APPLY:
+            fprintf(f, "    if (!mpcg_p%i(i, r)) { return 0; }\n", mpc_gen_ref(g, p->data.apply.x, child));
+            fprintf(f, "    r->output = ");
+            mpc_gen_call(g, (mpc_gen_fn_t)p->data.apply.f);
+            fprintf(f, "r->output);\n    return 1;\n");
+            break;
 
-    r = mpc_ast_new(">", "");
+        case MPC_TYPE_APPLY_TO:
+            fn = (mpc_gen_fn_t)p->data.apply_to.f;
+            fprintf(f, "    if (!mpcg_p%i(i, r)) { return 0; }\n", mpc_gen_ref(g, p->data.apply_to.x, child));
+            fprintf(f, "    r->output = ");
+            mpc_gen_call(g, fn);
+            fprintf(f, "r->output, ");
+            if (fn == (mpc_gen_fn_t)mpc_ast_tag || fn == (mpc_gen_fn_t)mpc_ast_add_tag) {
+                mpc_gen_string(f, p->data.apply_to.d);
+            } else {
+                if (p->data.apply_to.d) { g->error = "Cannot write out a parser applying a value!"; }
+                fprintf(f, "NULL");
+            }
+            fprintf(f, ");\n    return 1;\n");
+            break;
 
-    for (i = 0; i < n; i++) {
+        case MPC_TYPE_PREDICT:
+            fprintf(f, "    return mpcg_p%i(i, r);\n", mpc_gen_ref(g, p->data.predict.x, MPC_GEN_PREDICT));
+            break;
 
-        if (as[i] == NULL) { continue; }
+        case MPC_TYPE_COMMIT:
+            g->error = "Cannot write out a parser using mpc_commit!";
+            fprintf(f, "    return mpcg_p%i(i, r);\n", mpc_gen_ref(g, p->data.predict.x, child));
+            break;
+
+        case MPC_TYPE_MEMO:
+            fprintf(f, "    return mpcg_p%i(i, r);\n", mpc_gen_ref(g, p->data.memo.x, child));
+            break;
 
-        if (as[i] && as[i]->children_num > 0) {
+        case MPC_TYPE_DFA:
+            fprintf(f, "    return mpcg_p%i(i, r);\n", mpc_gen_ref(g, p->data.dfa.x, child));
+            break;
 
-            for (j = 0; j < as[i]->children_num; j++) {
-                mpc_ast_add_child(r, as[i]->children[j]);
+        case MPC_TYPE_NOT:
+            mpc_gen_use(g, MPC_GEN_EXPECTED);
+            mpc_gen_mark(g, back);
+            fprintf(f, "    if (mpcg_p%i(i, r)) {\n", mpc_gen_ref(g, p->data.not.x, child));
+            mpc_gen_rewind(g, back, "        ");
+            if (out) {
+                fprintf(f, "        ");
+                mpc_gen_call(g, (mpc_gen_fn_t)p->data.not.dx);
+                fprintf(f, "r->output);\n");
             }
+            fprintf(f, "        return mpcg_expected(i, r, \"opposite\");\n    }\n");
+            fprintf(f, "    mpcg_err(i, r->error);\n");
+            fprintf(f, "    r->output = %s%s;\n    return 1;\n", out ? mpc_gen_fn(g, (mpc_gen_fn_t)p->data.not.lf) : "NULL", out ? "()" : "");
+            break;
 
-            mpc_ast_delete_no_children(as[i]);
+        case MPC_TYPE_MAYBE:
+            fprintf(f, "    if (mpcg_p%i(i, r)) { return 1; }\n", mpc_gen_ref(g, p->data.not.x, child));
+            fprintf(f, "    mpcg_err(i, r->error);\n");
+            fprintf(f, "    r->output = %s%s;\n    return 1;\n", out ? mpc_gen_fn(g, (mpc_gen_fn_t)p->data.not.lf) : "NULL", out ? "()" : "");
+            break;
 
-        } else if (as[i] && as[i]->children_num == 0) {
-            mpc_ast_add_child(r, as[i]);
-        }
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            mpc_gen_repeat(g, p, child, out);
+            break;
 
-    }
+        case MPC_TYPE_OR:
+            mpc_gen_or(g, p, child);
+            break;
 
-    if (r->children_num) {
-        r->state = r->children[0]->state;
+        case MPC_TYPE_AND:
+            mpc_gen_and(g, p, child, out);
+            break;
+
+        default:
+            fprintf(f, "    r->error = MPCG_ERR(i, mpc_err_fail(i->filename, i->state, \"Unknown Parser Type Id!\"));\n    return 0;\n");
+            break;
     }
 
-    return r;
+    fprintf(f, "}\n\n");
 }
 
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-    mpc_ast_t *a = mpc_ast_new("", c);
-    free(c);
-    return a;
+static void mpc_gen_copy(FILE *from, FILE *to) {
+    char buffer[4096];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        fwrite(buffer, 1, n, to);
+    }
 }
 
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-    mpc_state_t *s = ((mpc_state_t**)xs)[0];
-    mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-    a = mpc_ast_state(a, *s);
-    free(s);
-    return a;
-}
+static mpc_err_t *mpc_gen(const char *filename, const char *prefix, mpca_grammar_st_t *st, FILE *source, FILE *header) {
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-    return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
-}
+    mpc_gen_t g;
+    int j, k;
+    const char *c;
+    int *entries;
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
-}
+    g.f = tmpfile();
+    g.num = 0;
+    g.ps = NULL;
+    g.modes = NULL;
+    g.uses = 0;
+    g.error = NULL;
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-    return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
-}
+    if (!g.f) { return mpc_err_fail(filename, mpc_state_new(), "Unable to open temporary file!"); }
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-    return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
-}
+    entries = malloc(sizeof(int) * (st->parsers_num + 1));
+    for (j = 0; j < st->parsers_num; j++) {
+        entries[j] = mpc_gen_ref(&g, st->parsers[j], MPC_GEN_BACKTRACK);
+    }
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+    for (k = 0; k < g.num; k++) {
+        mpc_gen_parser(&g, k);
+    }
 
-mpc_parser_t *mpca_or(int n, ...) {
+    if (header) {
+        fprintf(header, "/*\n** Generated from %s by mpca_lang_codegen\n*/\n\n#ifndef ", filename);
+        for (c = prefix; *c; c++) { fputc(toupper((unsigned char)*c), header); }
+        fprintf(header, "_H\n#define ");
+        for (c = prefix; *c; c++) { fputc(toupper((unsigned char)*c), header); }
+        fprintf(header, "_H\n\n#include \"mpc.h\"\n\n");
+        for (j = 0; j < st->parsers_num; j++) {
+            fprintf(header, "int %s_%s(const char *filename, const char *string, size_t length, mpc_result_t *r);\n", prefix, st->parsers[j]->name);
+        }
+        for (j = 0; j < st->parsers_num && (g.uses & MPC_GEN_TREE); j++) {
+            fprintf(header, "int %s_%s_tree(const char *filename, const char *string, size_t length, mpc_result_t *r);\n", prefix, st->parsers[j]->name);
+        }
+        fprintf(header, "\n#endif\n");
+    }
 
-    int i;
-    va_list va;
+    fprintf(source, "/*\n** Generated from %s by mpca_lang_codegen\n*/\n\n", filename);
+    fprintf(source, "#include <stdlib.h>\n#include <string.h>\n\n#include \"mpc.h\"\n\n");
 
-    mpc_parser_t *p = mpc_undefined();
+    for (j = 0; mpc_gen_prelude[j].text; j++) {
+        if (mpc_gen_prelude[j].use && !(g.uses & mpc_gen_prelude[j].use)) { continue; }
+        fprintf(source, "%s\n", mpc_gen_prelude[j].text);
+    }
 
-    p->type = MPC_TYPE_OR;
-    p->data.or.n = n;
-    p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+    for (k = 0; k < g.num; k++) {
+        fprintf(source, "static int mpcg_p%i(mpcg_input_t *i, mpc_result_t *r);\n", k);
+    }
+    fprintf(source, "\n");
 
-    va_start(va, n);  
-    for (i = 0; i < n; i++) {
-        p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+    mpc_gen_copy(g.f, source);
+
+    for (j = 0; j < st->parsers_num; j++) {
+        fprintf(source, "int %s_%s(const char *filename, const char *string, size_t length, mpc_result_t *r) {\n", prefix, st->parsers[j]->name);
+        fprintf(source, "    return mpcg_parse(filename, string, length, mpcg_p%i, NULL, r);\n}\n\n", entries[j]);
     }
-    va_end(va);
 
-    return p;
+    for (j = 0; j < st->parsers_num && (g.uses & MPC_GEN_TREE); j++) {
+        fprintf(source, "int %s_%s_tree(const char *filename, const char *string, size_t length, mpc_result_t *r) {\n", prefix, st->parsers[j]->name);
+        fprintf(source, "    return mpcg_parse_tree(filename, string, length, mpcg_p%i, r);\n}\n\n", entries[j]);
+    }
 
+    fclose(g.f);
+    free(g.ps);
+    free(g.modes);
+    free(entries);
+
+    return g.error ? mpc_err_fail(filename, mpc_state_new(), g.error) : NULL;
 }
 
-mpc_parser_t *mpca_and(int n, ...) {
+/*
+ ** Reads the grammar in `filename` and writes out a
+ ** parser for it to `source`, with a function named
+ ** `prefix`_`rule` for every rule, and declarations
+ ** of those to `header` if it is given. The rules
+ ** do not need to be passed in; they are made for
+ ** every name the grammar uses. Each also gets a
+ ** `prefix`_`rule`_tree function giving an
+ ** `mpc_tree_t` in place of the AST.
+ */
+
+mpc_err_t *mpca_lang_codegen(int flags, const char *filename, const char *prefix, FILE *source, FILE *header) {
+
+    mpca_grammar_st_t st;
+    mpc_input_t *i;
+    mpc_err_t *err;
+    int j;
+
+    FILE *f = fopen(filename, "rb");
 
-    int i;
-    va_list va;
+    if (f == NULL) {
+        return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+    }
 
-    mpc_parser_t *p = mpc_undefined();
+    st.va = NULL;
+    st.parsers_num = 0;
+    st.parsers = NULL;
+    st.flags = flags;
 
-    p->type = MPC_TYPE_AND;
-    p->data.and.n = n;
-    p->data.and.f = mpcf_fold_ast;
-    p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-    p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+    i = mpc_input_new_file(filename, f);
+    err = mpca_lang_st(i, &st);
+    mpc_input_delete(i);
 
-    va_start(va, n);
-    for (i = 0; i < n; i++) {
-        p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-    }
-    for (i = 0; i < (n-1); i++) {
-        p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
-    }    
-    va_end(va);
+    fclose(f);
 
-    return p;  
-}
+    if (!err) { err = mpc_gen(filename, prefix, &st, source, header); }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+    for (j = 0; j < st.parsers_num; j++) { mpc_undefine(st.parsers[j]); }
+    for (j = 0; j < st.parsers_num; j++) { mpc_delete(st.parsers[j]); }
+    free(st.parsers);
 
-/*
- ** Grammar Parser
- */
+    return err;
+}
 
 /*
- ** This is another interesting bootstrapping.
- **
- ** Having a general purpose AST type allows
- ** users to specify the grammar alone and
- ** let all fold rules be automatically taken
- ** care of by existing functions.
- **
- ** You don't get to control the type spat
- ** out but this means you can make a nice
- ** parser to take in some grammar in nice
- ** syntax and spit out a parser that works.
+ ** Saving and Loading
  **
- ** The grammar for this looks surprisingly
- ** like regex but the main difference is that
- ** it is now whitespace insensitive and the
- ** base type takes literals of some form.
+ ** A saved grammar is a flat list of every parser
+ ** reachable from those given, referring to each
+ ** other by index. The given parsers come first,
+ ** so loading can define them straight from the
+ ** list without running the grammar parser or
+ ** `mpc_re`. Regex DFAs are saved as their tables,
+ ** while `or` tables and programs are rebuilt as
+ ** they are cheap. As in code generation functions
+ ** are saved as their place in `mpc_gen_fns`, and
+ ** tags as the name of a parser or one of the
+ ** tags `mpca_lang` gives literals. Numbers are
+ ** written as four bytes, low byte first. After
+ ** the magic and version comes an FNV-1a hash of
+ ** all that follows it, so a damaged file is
+ ** turned away before any of it is read.
  */
 
-/*
- **
- **  ### Grammar Grammar
- **
- **      <grammar> : (<term> "|" <grammar>) | <term>
- **     
- **      <term> : <factor>*
- **
- **      <factor> : <base>
- **               | <base> "*"
- **               | <base> "+"
- **               | <base> "?"
- **               | <base> "{" <digits> "}"
- **           
- **      <base> : "<" (<digits> | <ident>) ">"
- **             | <string_lit>
- **             | <char_lit>
- **             | <regex_lit>
- **             | "(" <grammar> ")"
- */
+enum {
+    MPC_SAVE_VERSION  = 2,
 
-typedef struct {
-    va_list *va;
-    int parsers_num;
-    mpc_parser_t **parsers;
-    int flags;
-} mpca_grammar_st_t;
+    MPC_SAVE_SOI      = 0,
+    MPC_SAVE_EOI      = 1,
+    MPC_SAVE_BOUNDARY = 2
+};
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-    if (xs[1] == NULL) { return xs[0]; }
-    else { return mpca_or(2, xs[0], xs[1]); }
-}
+static const char mpc_save_magic[4] = { 'M', 'P', 'C', 'B' };
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-    int i;
-    mpc_parser_t *p = mpc_pass();  
-    for (i = 0; i < n; i++) {
-        if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+static const char *mpc_save_tags[] = { "string", "char", "regex", NULL };
+
+typedef struct {
+    FILE *f;
+    int num;
+    mpc_parser_t **ps;
+    unsigned long hash;
+    const char *error;
+} mpc_save_t;
+
+static unsigned long mpc_save_hash(unsigned long h, const unsigned char *x, size_t n) {
+    size_t j;
+    for (j = 0; j < n; j++) {
+        h = ((h ^ x[j]) * 16777619UL) & 0xFFFFFFFFUL;
     }
-    return p;
+    return h;
 }
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) {
+static void mpc_save_bytes(mpc_save_t *s, const void *x, size_t n) {
+    s->hash = mpc_save_hash(s->hash, x, n);
+    fwrite(x, 1, n, s->f);
+}
 
-    int num;
-    if (xs[1] == NULL) { return xs[0]; }  
-    if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
-    if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
-    if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
-    if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
-    num = *((int*)xs[1]);
-    free(xs[1]);
-    return mpca_count(num, xs[0]);
+static void mpc_save_byte(mpc_save_t *s, int x) {
+    unsigned char b = (unsigned char)x;
+    mpc_save_bytes(s, &b, 1);
 }
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-    mpca_grammar_st_t *st = s;
-    char *y = mpcf_unescape(x);
-    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-    free(y);
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+static void mpc_save_int(mpc_save_t *s, long x) {
+    unsigned long u = (unsigned long)x;
+    unsigned char b[4];
+    b[0] = (unsigned char)(u & 0xFF);
+    b[1] = (unsigned char)((u >> 8) & 0xFF);
+    b[2] = (unsigned char)((u >> 16) & 0xFF);
+    b[3] = (unsigned char)((u >> 24) & 0xFF);
+    mpc_save_bytes(s, b, 4);
 }
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-    mpca_grammar_st_t *st = s;
-    char *y = mpcf_unescape(x);
-    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-    free(y);
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+static void mpc_save_string(mpc_save_t *s, const char *x) {
+    if (x == NULL) { mpc_save_int(s, -1); return; }
+    mpc_save_int(s, (long)strlen(x));
+    mpc_save_bytes(s, x, strlen(x));
 }
 
-static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
-    mpca_grammar_st_t *st = s;
-    char *y = mpcf_unescape_regex(x);
-    mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
-    free(y);
-    return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+static int mpc_save_index(mpc_save_t *s, mpc_parser_t *p) {
+    int j;
+    for (j = 0; j < s->num; j++) {
+        if (s->ps[j] == p) { return j; }
+    }
+    s->ps = realloc(s->ps, sizeof(mpc_parser_t*) * (s->num + 1));
+    s->ps[s->num] = p;
+    return s->num++;
 }
 
-/* Should this just use `isdigit` instead */
-static int is_number(const char* s) {
-    int i;
-    for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
-    return 1;
+static void mpc_save_fn(mpc_save_t *s, mpc_gen_fn_t f) {
+    int j;
+    if (f == NULL) { mpc_save_int(s, -1); return; }
+    for (j = 0; mpc_gen_fns[j].f; j++) {
+        if (mpc_gen_fns[j].f == f) { mpc_save_int(s, j); return; }
+    }
+    s->error = "Cannot save a parser using an unknown function!";
+    mpc_save_int(s, -1);
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+static int mpc_save_is_tag(mpc_save_t *s, const char *t) {
+    int j;
+    for (j = 0; j < s->num; j++) {
+        if (s->ps[j]->name && strcmp(s->ps[j]->name, t) == 0) { return 1; }
+    }
+    for (j = 0; mpc_save_tags[j]; j++) {
+        if (strcmp(mpc_save_tags[j], t) == 0) { return 1; }
+    }
+    return 0;
+}
 
-    int i;
-    mpc_parser_t *p;
+/* Numbers every parser reachable from `p` */
+static void mpc_save_children(mpc_save_t *s, mpc_parser_t *p) {
 
-    /* Case of Number */
-    if (is_number(x)) {
+    int j;
 
-        i = strtol(x, NULL, 10);
+    switch (p->type) {
+        case MPC_TYPE_EXPECT:   mpc_save_index(s, p->data.expect.x);   break;
+        case MPC_TYPE_APPLY:    mpc_save_index(s, p->data.apply.x);    break;
+        case MPC_TYPE_APPLY_TO: mpc_save_index(s, p->data.apply_to.x); break;
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT:   mpc_save_index(s, p->data.predict.x);  break;
+        case MPC_TYPE_MEMO:     mpc_save_index(s, p->data.memo.x);     break;
+        case MPC_TYPE_DFA:      mpc_save_index(s, p->data.dfa.x);      break;
 
-        while (st->parsers_num <= i) {
-            st->parsers_num++;
-            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-            st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-            if (st->parsers[st->parsers_num-1] == NULL) {
-                return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
-            }
-        }
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+                                mpc_save_index(s, p->data.not.x);
+                                break;
 
-        return st->parsers[st->parsers_num-1];
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+                                mpc_save_index(s, p->data.repeat.x);
+                                break;
 
-        /* Case of Identifier */
-    } else {
+        case MPC_TYPE_OR:
+                                for (j = 0; j < p->data.or.n; j++) { mpc_save_index(s, p->data.or.xs[j]); }
+                                break;
 
-        /* Search Existing Parsers */
-        for (i = 0; i < st->parsers_num; i++) {
-            mpc_parser_t *p = st->parsers[i];
-            if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-            if (p->name && strcmp(p->name, x) == 0) { return p; }
-        }
+        case MPC_TYPE_AND:
+                                for (j = 0; j < p->data.and.n; j++) { mpc_save_index(s, p->data.and.xs[j]); }
+                                break;
 
-        /* Search New Parsers */
-        while (1) {
+        default: break;
+    }
+}
 
-            p = va_arg(*st->va, mpc_parser_t*);
+static void mpc_save_parser(mpc_save_t *s, mpc_parser_t *p) {
 
-            st->parsers_num++;
-            st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-            st->parsers[st->parsers_num-1] = p;
+    mpc_dfa_t *d;
+    int j;
 
-            if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-            if (p->name && strcmp(p->name, x) == 0) { return p; }
+    mpc_save_byte(s, p->type);
+    mpc_save_byte(s, p->retained);
+    mpc_save_byte(s, p->span);
+    mpc_save_byte(s, p->prog != NULL);
+    mpc_save_string(s, p->name);
 
-        }
+    switch (p->type) {
 
-    }  
+        case MPC_TYPE_FAIL: mpc_save_string(s, p->data.fail.m); break;
 
-}
+        case MPC_TYPE_LIFT:
+        case MPC_TYPE_LIFT_VAL:
+            if (p->data.lift.x) { s->error = "Cannot save a parser lifting a value!"; }
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.lift.lf);
+            break;
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+        case MPC_TYPE_ANCHOR:
+            if (p->data.anchor.f == mpc_soi_anchor) {
+                mpc_save_int(s, MPC_SAVE_SOI);
+            } else if (p->data.anchor.f == mpc_eoi_anchor) {
+                mpc_save_int(s, MPC_SAVE_EOI);
+            } else if (p->data.anchor.f == mpc_boundary_anchor) {
+                mpc_save_int(s, MPC_SAVE_BOUNDARY);
+            } else {
+                s->error = "Cannot save a parser using an unknown anchor!";
+                mpc_save_int(s, -1);
+            }
+            break;
 
-    mpca_grammar_st_t *st = s;
-    mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-    free(x);
+        case MPC_TYPE_SINGLE: mpc_save_int(s, (unsigned char)p->data.single.x); break;
 
-    if (p->name) {
-        return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-    } else {
-        return mpca_state(mpca_root(p));
-    }
-}
+        case MPC_TYPE_CLASS:
+            mpc_save_bytes(s, p->data.class.x, 32);
+            mpc_save_int(s, p->data.class.n);
+            mpc_save_bytes(s, p->data.class.lo, 4);
+            mpc_save_bytes(s, p->data.class.width, 4);
+            break;
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+        case MPC_TYPE_SATISFY: mpc_save_fn(s, (mpc_gen_fn_t)p->data.satisfy.f); break;
+        case MPC_TYPE_STRING:  mpc_save_string(s, p->data.string.x); break;
 
-    char *err_msg;
-    mpc_parser_t *err_out;
-    mpc_result_t r;
-    mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+        case MPC_TYPE_EXPECT:
+            mpc_save_int(s, mpc_save_index(s, p->data.expect.x));
+            mpc_save_string(s, p->data.expect.m);
+            break;
 
-    GrammarTotal = mpc_new("grammar_total");
-    Grammar = mpc_new("grammar");
-    Term = mpc_new("term");
-    Factor = mpc_new("factor");
-    Base = mpc_new("base");
+        case MPC_TYPE_APPLY:
+            mpc_save_int(s, mpc_save_index(s, p->data.apply.x));
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.apply.f);
+            break;
 
-    mpc_define(GrammarTotal,
-            mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-            );
+        case MPC_TYPE_APPLY_TO:
+            mpc_save_int(s, mpc_save_index(s, p->data.apply_to.x));
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.apply_to.f);
+            if ((p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+            ||   p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag)
+            &&  mpc_save_is_tag(s, p->data.apply_to.d)) {
+                mpc_save_string(s, p->data.apply_to.d);
+            } else {
+                if (p->data.apply_to.d) { s->error = "Cannot save a parser applying a value!"; }
+                mpc_save_string(s, NULL);
+            }
+            break;
 
-    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-                Term,
-                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-                mpc_soft_delete
-                ));
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT:
+            mpc_save_int(s, mpc_save_index(s, p->data.predict.x));
+            break;
 
-    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+            mpc_save_int(s, mpc_save_index(s, p->data.not.x));
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.not.dx);
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.not.lf);
+            break;
 
-    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-                Base,
-                mpc_or(6,
-                    mpc_sym("*"),
-                    mpc_sym("+"),
-                    mpc_sym("?"),
-                    mpc_sym("!"),
-                    mpc_tok_brackets(mpc_int(), free),
-                    mpc_pass()),
-                mpc_soft_delete
-                ));
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            mpc_save_int(s, p->data.repeat.n);
+            mpc_save_int(s, mpc_save_index(s, p->data.repeat.x));
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.repeat.f);
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.repeat.dx);
+            break;
 
-    mpc_define(Base, mpc_or(5,
-                mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-                mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-                mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-                mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-                mpc_tok_parens(Grammar, mpc_soft_delete)
-                ));
+        case MPC_TYPE_OR:
+            mpc_save_int(s, p->data.or.n);
+            for (j = 0; j < p->data.or.n; j++) { mpc_save_int(s, mpc_save_index(s, p->data.or.xs[j])); }
+            mpc_save_int(s, p->data.or.table != NULL);
+            break;
 
-    if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-        err_msg = mpc_err_string(r.error);
-        err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-        mpc_err_delete(r.error);
-        free(err_msg);
-        r.output = err_out;
-    }
+        case MPC_TYPE_AND:
+            mpc_save_int(s, p->data.and.n);
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.and.f);
+            for (j = 0; j < p->data.and.n; j++) { mpc_save_int(s, mpc_save_index(s, p->data.and.xs[j])); }
+            for (j = 0; j < p->data.and.n-1; j++) { mpc_save_fn(s, (mpc_gen_fn_t)p->data.and.dxs[j]); }
+            break;
 
-    mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+        case MPC_TYPE_MEMO:
+            mpc_save_int(s, mpc_save_index(s, p->data.memo.x));
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.memo.c);
+            mpc_save_fn(s, (mpc_gen_fn_t)p->data.memo.dx);
+            break;
 
-    return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+        case MPC_TYPE_DFA:
+            d = p->data.dfa.d;
+            mpc_save_int(s, mpc_save_index(s, p->data.dfa.x));
+            mpc_save_int(s, d->states_num);
+            mpc_save_bytes(s, d->accept, d->states_num);
+            for (j = 0; j < d->states_num * 256; j++) { mpc_save_int(s, d->trans[j]); }
+            break;
 
+        default: break;
+    }
 }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-    mpca_grammar_st_t st;
-    mpc_parser_t *res;
+mpc_err_t *mpc_save(const char *filename, ...) {
+
+    mpc_save_t s;
+    mpc_parser_t *p;
+    int j, roots;
     va_list va;
-    va_start(va, grammar);
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+    s.f = fopen(filename, "wb");
+    s.num = 0;
+    s.ps = NULL;
+    s.hash = 0;
+    s.error = NULL;
 
-    res = mpca_grammar_st(grammar, &st);  
-    free(st.parsers);
-    va_end(va);
-    return res;
-}
+    if (s.f == NULL) {
+        return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
+    }
 
-typedef struct {
-    char *ident;
-    char *name;
-    mpc_parser_t *grammar;
-} mpca_stmt_t;
+    va_start(va, filename);
+    while ((p = va_arg(va, mpc_parser_t*))) { mpc_save_index(&s, p); }
+    va_end(va);
 
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+    roots = s.num;
+    for (j = 0; j < s.num; j++) { mpc_save_children(&s, s.ps[j]); }
 
-    mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-    stmt->ident = ((char**)xs)[0];
-    stmt->name = ((char**)xs)[1];
-    stmt->grammar = ((mpc_parser_t**)xs)[3];
+    fwrite(mpc_save_magic, 1, 4, s.f);
+    mpc_save_int(&s, MPC_SAVE_VERSION);
+    mpc_save_int(&s, 0);
 
-    free(((char**)xs)[2]);
-    free(((char**)xs)[4]);
+    s.hash = 2166136261UL;
+    mpc_save_int(&s, s.num);
+    mpc_save_int(&s, roots);
+    for (j = 0; j < s.num; j++) { mpc_save_parser(&s, s.ps[j]); }
 
-    return stmt;
-}
+    /* Go back and fill in the hash */
+    if (fseek(s.f, 8, SEEK_SET) == 0) {
+        mpc_save_int(&s, (long)s.hash);
+    } else if (!s.error) {
+        s.error = "Unable to write file!";
+    }
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+    if (ferror(s.f) && !s.error) { s.error = "Unable to write file!"; }
 
-    int i;
-    mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+    fclose(s.f);
+    free(s.ps);
 
-    for (i = 0; i < n; i++) {
-        stmts[i] = xs[i];
+    if (s.error) {
+        remove(filename);
+        return mpc_err_fail(filename, mpc_state_new(), s.error);
     }
-    stmts[n] = NULL;  
 
-    return stmts;
+    return NULL;
 }
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+/*
+ ** Sizes and indices are checked as they are read,
+ ** functions must be of the kind the node calls,
+ ** and every unretained parser must have just one
+ ** parent, so a bad file cannot leave a graph that
+ ** breaks when it is deleted. Every node is made up
+ ** front and marked retained while it is filled
+ ** in, so whatever has been read so far can be
+ ** undefined one node at a time if the file turns
+ ** out to be bad. Bad indices read as node 0 so the
+ ** half built graph stays safe to walk. The given
+ ** parsers are only defined once all has been read,
+ ** and until then references to them point at the
+ ** given parsers while their data is read into
+ ** stand-ins in `ps`.
+ */
 
-    mpca_stmt_t **stmts = x;
+typedef struct {
+    const unsigned char *s;
+    size_t len;
+    size_t pos;
+    int num;
+    mpc_parser_t **ps;
+    mpc_parser_t **refs;
+    int *uses;
+    int fns_num;
+    const char *error;
+} mpc_load_t;
+
+static void mpc_load_bad(mpc_load_t *l) {
+    if (!l->error) { l->error = "Bad or truncated file!"; }
+    l->pos = l->len;
+}
+
+static int mpc_load_bytes(mpc_load_t *l, void *x, size_t n) {
+    if (l->len - l->pos < n) { mpc_load_bad(l); memset(x, 0, n); return 0; }
+    memcpy(x, l->s + l->pos, n);
+    l->pos += n;
+    return 1;
+}
 
-    while(*stmts) {
-        mpca_stmt_t *stmt = *stmts; 
-        free(stmt->ident);
-        free(stmt->name);
-        mpc_soft_delete(stmt->grammar);
-        free(stmt);  
-        stmts++;
-    }
-    free(x);
+static long mpc_load_int(mpc_load_t *l) {
+    unsigned char b[4];
+    unsigned long u;
+    if (!mpc_load_bytes(l, b, 4)) { return 0; }
+    u = (unsigned long)b[0] | ((unsigned long)b[1] << 8) | ((unsigned long)b[2] << 16) | ((unsigned long)b[3] << 24);
+    return u & 0x80000000UL ? -(long)(0xFFFFFFFFUL - u) - 1 : (long)u;
+}
 
+static char *mpc_load_string(mpc_load_t *l) {
+    long n = mpc_load_int(l);
+    char *x;
+    if (n == -1) { return NULL; }
+    if (n < 0 || (size_t)n > l->len - l->pos) { mpc_load_bad(l); return NULL; }
+    x = malloc(n + 1);
+    mpc_load_bytes(l, x, n);
+    x[n] = '\0';
+    return x;
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+static mpc_parser_t *mpc_load_ref(mpc_load_t *l) {
+    long j = mpc_load_int(l);
+    if (j < 0 || j >= l->num) { mpc_load_bad(l); return l->refs[0]; }
+    l->uses[j]++;
+    return l->refs[j];
+}
 
-    mpca_grammar_st_t *st = s;
-    mpca_stmt_t *stmt;
-    mpca_stmt_t **stmts = x;
-    mpc_parser_t *left;
+/* Functions must be of the kind the node calls */
+static mpc_gen_fn_t mpc_load_fn(mpc_load_t *l, int kind) {
+    long j = mpc_load_int(l);
+    if (j == -1) { return NULL; }
+    if (j < 0 || j >= l->fns_num || mpc_gen_fns[j].kind != kind) { mpc_load_bad(l); return NULL; }
+    return mpc_gen_fns[j].f;
+}
 
-    while(*stmts) {
-        stmt = *stmts;
-        left = mpca_grammar_find_parser(stmt->ident, st);
-        if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-        if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-        mpc_define(left, stmt->grammar);
-        free(stmt->ident);
-        free(stmt->name);
-        free(stmt);
-        stmts++;
+/* Tags are read as strings and swapped for names once all are read */
+static void mpc_load_tag(mpc_load_t *l, mpc_parser_t *p) {
+    char *t = p->data.apply_to.d;
+    const char *found = NULL;
+    int j;
+    if (t == NULL) { return; }
+    for (j = 0; j < l->num && !found; j++) {
+        if (l->refs[j]->name && strcmp(l->refs[j]->name, t) == 0) { found = l->refs[j]->name; }
     }
-    free(x);
-
-    return NULL;
+    for (j = 0; mpc_save_tags[j] && !found; j++) {
+        if (strcmp(mpc_save_tags[j], t) == 0) { found = mpc_save_tags[j]; }
+    }
+    if (!found) { mpc_load_bad(l); }
+    p->data.apply_to.d = (void*)found;
+    free(t);
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+static void mpc_load_parser(mpc_load_t *l, mpc_parser_t *p, char *retained, char *prog, int *table) {
 
-    mpc_result_t r;
-    mpc_err_t *e;
-    mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+    unsigned char head[4];
+    mpc_dfa_t *d;
+    long n;
+    int j;
 
-    Lang    = mpc_new("lang");
-    Stmt    = mpc_new("stmt");
-    Grammar = mpc_new("grammar");
-    Term    = mpc_new("term");
-    Factor  = mpc_new("factor");
-    Base    = mpc_new("base");
+    mpc_load_bytes(l, head, 4);
+    *retained = (char)head[1];
+    *prog = (char)head[3];
+    p->span = (char)head[2];
+    p->name = mpc_load_string(l);
 
-    mpc_define(Lang, mpc_apply_to(
-                mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-                mpca_stmt_list_apply_to, st
-                ));
+    switch (head[0]) {
 
-    mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-                mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-                free, free, free, mpc_soft_delete
-                ));
+        case MPC_TYPE_UNDEFINED:
+        case MPC_TYPE_PASS:
+        case MPC_TYPE_STATE:
+        case MPC_TYPE_ANY:
+            break;
 
-    mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-                Term,
-                mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-                mpc_soft_delete
-                ));
+        case MPC_TYPE_FAIL: p->data.fail.m = mpc_load_string(l); break;
 
-    mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+        case MPC_TYPE_LIFT:
+        case MPC_TYPE_LIFT_VAL:
+            p->data.lift.lf = (mpc_ctor_t)mpc_load_fn(l, MPC_GEN_FN_CTOR);
+            p->data.lift.x = NULL;
+            break;
 
-    mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-                Base,
-                mpc_or(6,
-                    mpc_sym("*"),
-                    mpc_sym("+"),
-                    mpc_sym("?"),
-                    mpc_sym("!"),
-                    mpc_tok_brackets(mpc_int(), free),
-                    mpc_pass()),
-                mpc_soft_delete
-                ));
+        case MPC_TYPE_ANCHOR:
+            switch (mpc_load_int(l)) {
+                case MPC_SAVE_SOI:      p->data.anchor.f = mpc_soi_anchor;      break;
+                case MPC_SAVE_EOI:      p->data.anchor.f = mpc_eoi_anchor;      break;
+                case MPC_SAVE_BOUNDARY: p->data.anchor.f = mpc_boundary_anchor; break;
+                default: p->data.anchor.f = mpc_soi_anchor; mpc_load_bad(l); break;
+            }
+            break;
 
-    mpc_define(Base, mpc_or(5,
-                mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-                mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-                mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-                mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-                mpc_tok_parens(Grammar, mpc_soft_delete)
-                ));
+        case MPC_TYPE_SINGLE: p->data.single.x = (char)mpc_load_int(l); break;
 
+        case MPC_TYPE_CLASS:
+            mpc_load_bytes(l, p->data.class.x, 32);
+            p->data.class.n = (int)mpc_load_int(l);
+            mpc_load_bytes(l, p->data.class.lo, 4);
+            mpc_load_bytes(l, p->data.class.width, 4);
+            if (p->data.class.n < 0 || p->data.class.n > 4) { p->data.class.n = 0; mpc_load_bad(l); }
+            mpc_class_ranges(&p->data.class);
+            break;
 
-    if (!mpc_parse_input(i, Lang, &r)) {
-        e = r.error;
-    } else {
-        e = NULL;
-    }
+        case MPC_TYPE_SATISFY:
+            p->data.satisfy.f = (int(*)(char))mpc_load_fn(l, MPC_GEN_FN_SATISFY);
+            if (!p->data.satisfy.f) { mpc_load_bad(l); }
+            break;
 
-    mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+        case MPC_TYPE_STRING:
+            p->data.string.x = mpc_load_string(l);
+            if (!p->data.string.x) { p->data.string.x = calloc(1, 1); mpc_load_bad(l); }
+            break;
 
-    return e;
-}
+        case MPC_TYPE_EXPECT:
+            p->data.expect.x = mpc_load_ref(l);
+            p->data.expect.m = mpc_load_string(l);
+            break;
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+        case MPC_TYPE_APPLY:
+            p->data.apply.x = mpc_load_ref(l);
+            p->data.apply.f = (mpc_apply_t)mpc_load_fn(l, MPC_GEN_FN_APPLY);
+            break;
 
-    va_list va;  
-    va_start(va, f);
+        case MPC_TYPE_APPLY_TO:
+            p->data.apply_to.x = mpc_load_ref(l);
+            p->data.apply_to.f = (mpc_apply_to_t)mpc_load_fn(l, MPC_GEN_FN_APPLY_TO);
+            p->data.apply_to.d = mpc_load_string(l);
+            break;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+        case MPC_TYPE_PREDICT:
+        case MPC_TYPE_COMMIT:
+            p->data.predict.x = mpc_load_ref(l);
+            break;
 
-    i = mpc_input_new_file("<mpca_lang_file>", f);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+        case MPC_TYPE_NOT:
+        case MPC_TYPE_MAYBE:
+            p->data.not.x = mpc_load_ref(l);
+            p->data.not.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+            p->data.not.lf = (mpc_ctor_t)mpc_load_fn(l, MPC_GEN_FN_CTOR);
+            break;
 
-    free(st.parsers);
-    va_end(va);
-    return err;
-}
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+            p->data.repeat.n = (int)mpc_load_int(l);
+            p->data.repeat.x = mpc_load_ref(l);
+            p->data.repeat.f = (mpc_fold_t)mpc_load_fn(l, MPC_GEN_FN_FOLD);
+            p->data.repeat.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+            break;
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+        case MPC_TYPE_OR:
+            n = mpc_load_int(l);
+            if (n < 1 || (size_t)n > (l->len - l->pos) / 4) { n = 0; mpc_load_bad(l); }
+            p->data.or.n = (int)n;
+            p->data.or.xs = malloc(sizeof(mpc_parser_t*) * (n ? n : 1));
+            for (j = 0; j < n; j++) { p->data.or.xs[j] = mpc_load_ref(l); }
+            p->data.or.table = NULL;
+            *table = (int)mpc_load_int(l);
+            break;
 
-    va_list va;  
-    va_start(va, p);
+        case MPC_TYPE_AND:
+            n = mpc_load_int(l);
+            if (n < 1 || (size_t)n > (l->len - l->pos) / 4) { n = 0; mpc_load_bad(l); }
+            p->data.and.n = (int)n;
+            p->data.and.f = (mpc_fold_t)mpc_load_fn(l, MPC_GEN_FN_FOLD);
+            p->data.and.xs = malloc(sizeof(mpc_parser_t*) * (n ? n : 1));
+            p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n > 1 ? n-1 : 1));
+            for (j = 0; j < n; j++) { p->data.and.xs[j] = mpc_load_ref(l); }
+            for (j = 0; j < n-1; j++) { p->data.and.dxs[j] = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR); }
+            break;
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+        case MPC_TYPE_MEMO:
+            p->data.memo.x = mpc_load_ref(l);
+            p->data.memo.c = (mpc_apply_t)mpc_load_fn(l, MPC_GEN_FN_APPLY);
+            p->data.memo.dx = (mpc_dtor_t)mpc_load_fn(l, MPC_GEN_FN_DTOR);
+            break;
 
-    i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+        case MPC_TYPE_DFA:
+            p->data.dfa.x = mpc_load_ref(l);
+            n = mpc_load_int(l);
+            if (n < 1 || n > MPC_DFA_MAX_STATES || (size_t)n > (l->len - l->pos) / 1025) { n = 1; mpc_load_bad(l); }
+            d = calloc(1, sizeof(mpc_dfa_t));
+            d->states_num = (int)n;
+            d->accept = calloc(n, 1);
+            d->trans = malloc(sizeof(int) * 256 * n);
+            mpc_load_bytes(l, d->accept, n);
+            for (j = 0; j < n * 256; j++) {
+                d->trans[j] = (int)mpc_load_int(l);
+                if (d->trans[j] < MPC_DFA_UNKNOWN || d->trans[j] >= n) { d->trans[j] = MPC_DFA_DEAD; mpc_load_bad(l); }
+            }
+            p->data.dfa.d = d;
+            break;
 
-    free(st.parsers);
-    va_end(va);
-    return err;
+        default:
+            mpc_load_bad(l);
+            return;
+    }
+
+    p->type = (char)head[0];
 }
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+static mpc_err_t *mpc_load_va(const char *filename, const unsigned char *s, size_t len, va_list va) {
 
-    mpca_grammar_st_t st;
-    mpc_input_t *i;
-    mpc_err_t *err;
+    mpc_load_t l;
+    mpc_parser_t **args = NULL;
+    mpc_parser_t *p;
+    char *retained = NULL, *prog = NULL;
+    int *tables = NULL;
+    char magic[4];
+    unsigned long hash;
+    int j, args_num = 0;
+
+    l.s = s;
+    l.len = len;
+    l.pos = 0;
+    l.num = 0;
+    l.ps = NULL;
+    l.error = NULL;
+    for (l.fns_num = 0; mpc_gen_fns[l.fns_num].f; l.fns_num++);
+
+    while ((p = va_arg(va, mpc_parser_t*))) {
+        args = realloc(args, sizeof(mpc_parser_t*) * (args_num + 1));
+        args[args_num++] = p;
+    }
 
-    va_list va;
-    va_start(va, language);
+    mpc_load_bytes(&l, magic, 4);
+    if (memcmp(magic, mpc_save_magic, 4) != 0 || mpc_load_int(&l) != MPC_SAVE_VERSION) {
+        free(args);
+        return mpc_err_fail(filename, mpc_state_new(), "Not a saved grammar!");
+    }
 
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
+    hash = (unsigned long)mpc_load_int(&l) & 0xFFFFFFFFUL;
+    if (l.error || hash != mpc_save_hash(2166136261UL, l.s + l.pos, l.len - l.pos)) {
+        free(args);
+        return mpc_err_fail(filename, mpc_state_new(), "Saved grammar is damaged!");
+    }
 
-    i = mpc_input_new_string("<mpca_lang>", language);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
+    l.num = (int)mpc_load_int(&l);
+    if (l.num < 1 || (size_t)l.num > l.len / 8 || mpc_load_int(&l) != args_num || args_num > l.num) {
+        free(args);
+        return mpc_err_fail(filename, mpc_state_new(), "Saved grammar does not match the parsers given!");
+    }
 
-    free(st.parsers);
-    va_end(va);
-    return err;
+    l.ps = malloc(sizeof(mpc_parser_t*) * l.num);
+    l.refs = malloc(sizeof(mpc_parser_t*) * l.num);
+    l.uses = calloc(l.num, sizeof(int));
+    retained = calloc(l.num, 1);
+    prog = calloc(l.num, 1);
+    tables = calloc(l.num, sizeof(int));
+
+    for (j = 0; j < l.num; j++) {
+        l.ps[j] = mpc_undefined();
+        l.ps[j]->retained = 1;
+        l.refs[j] = j < args_num ? args[j] : l.ps[j];
+    }
+
+    for (j = 0; j < l.num && !l.error; j++) {
+        mpc_load_parser(&l, l.ps[j], &retained[j], &prog[j], &tables[j]);
+        if (j < args_num && (!l.ps[j]->name || strcmp(l.ps[j]->name, args[j]->name) != 0)) {
+            l.error = "Saved grammar does not match the parsers given!";
+        }
+    }
+
+    for (j = 0; j < l.num; j++) {
+        if (l.ps[j]->type == MPC_TYPE_APPLY_TO) { mpc_load_tag(&l, l.ps[j]); }
+        if (j >= args_num && !retained[j] && l.uses[j] != 1) { mpc_load_bad(&l); }
+    }
+
+    if (l.error) {
+        for (j = 0; j < l.num; j++) { mpc_undefine_unretained(l.ps[j], 1); }
+        for (j = 0; j < l.num; j++) {
+            free(l.ps[j]->name);
+            free(l.ps[j]);
+        }
+    } else {
+
+        for (j = args_num; j < l.num; j++) {
+            l.ps[j]->retained = retained[j];
+        }
+        for (j = 0; j < args_num; j++) {
+            free(l.ps[j]->name);
+            l.ps[j]->name = NULL;
+            mpc_define(args[j], l.ps[j]);
+            l.ps[j] = args[j];
+        }
+
+        for (j = 0; j < l.num; j++) {
+            if (tables[j] && l.ps[j]->type == MPC_TYPE_OR) { mpc_optimise_or(l.ps[j]); }
+        }
+        for (j = 0; j < l.num; j++) {
+            if (prog[j]) { mpc_compile(l.ps[j]); }
+        }
+    }
+
+    free(args);
+    free(l.ps);
+    free(l.refs);
+    free(l.uses);
+    free(retained);
+    free(prog);
+    free(tables);
+
+    return l.error ? mpc_err_fail(filename, mpc_state_new(), l.error) : NULL;
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+mpc_err_t *mpc_load(const char *filename, ...) {
 
-    mpca_grammar_st_t st;
     mpc_input_t *i;
     mpc_err_t *err;
-
+    char *buffer = NULL;
+    const char *s;
+    size_t len = 0, n;
     va_list va;
 
     FILE *f = fopen(filename, "rb");
@@ -3195,22 +8602,28 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
         return mpc_err_fail(filename, mpc_state_new(), "Unable to open file!");
     }
 
-    va_start(va, filename);
-
-    st.va = &va;
-    st.parsers_num = 0;
-    st.parsers = NULL;
-    st.flags = flags;
-
+    /* Read straight from the mapping where there is one */
     i = mpc_input_new_file(filename, f);
-    err = mpca_lang_st(i, &st);
-    mpc_input_delete(i);
 
-    free(st.parsers);
-    va_end(va);  
+    if (i->type == MPC_INPUT_MMAP) {
+        s = i->string;
+        len = i->length;
+    } else {
+        buffer = malloc(4096);
+        while ((n = fread(buffer + len, 1, 4096, f)) > 0) {
+            len += n;
+            buffer = realloc(buffer, len + 4096);
+        }
+        s = buffer;
+    }
+
+    va_start(va, filename);
+    err = mpc_load_va(filename, (const unsigned char*)s, len, va);
+    va_end(va);
 
+    mpc_input_delete(i);
     fclose(f);
+    free(buffer);
 
     return err;
 }
-
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <math.h>
 #include <errno.h>
+#include <ctype.h>
 
 /*
 ** State Type
@@ -47,6 +48,17 @@ void mpc_err_print_to(mpc_err_t *e, FILE *f);
 
 /*
 ** Parsing
+**
+** Parsing never changes a parser. Everything a parse
+** needs lives in its input, or in `c` for the `_ctx`
+** functions, so a parser once built can be used by
+** any number of threads at once, each with its own
+** context. Defining, optimising, or deleting it while
+** it is in use is not safe.
+**
+** Positions are held as `int`, so an input can be at
+** most 2GB long. For a pipe, or a context being fed,
+** this counts everything it has read since it began.
 */
 
 typedef void mpc_val_t;
@@ -60,10 +72,17 @@ struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_n(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+typedef struct mpc_ctx_t mpc_ctx_t;
+
+mpc_ctx_t *mpc_ctx_new(void);
+void mpc_ctx_delete(mpc_ctx_t *c);
+int mpc_parse_ctx(mpc_ctx_t *c, const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
+
 /*
 ** Function Types
 */
@@ -75,6 +94,27 @@ typedef mpc_val_t*(*mpc_apply_t)(mpc_val_t*);
 typedef mpc_val_t*(*mpc_apply_to_t)(mpc_val_t*,void*);
 typedef mpc_val_t*(*mpc_fold_t)(int,mpc_val_t**);
 
+/*
+** Feeding
+**
+** A context can instead be fed its input in chunks
+** as they arrive. A match cut short by the end of a
+** chunk is held where it stopped and carried on by
+** the next, and as soon as it is decided the result
+** is passed to `f`, which then owns it. A match only
+** waiting on trailing whitespace is decided already.
+** Outputs of matches thrown away, such as one still
+** waiting when the context is deleted, are deleted
+** with `da`. After an error nothing more is parsed,
+** and `mpc_feed` returns 0. A chunk of length zero
+** ends the input.
+*/
+
+typedef void(*mpc_feed_t)(int,mpc_result_t*,void*);
+
+mpc_ctx_t *mpc_ctx_new_feed(const char *filename, mpc_parser_t *p, mpc_dtor_t da, mpc_feed_t f, void *d);
+int mpc_feed(mpc_ctx_t *c, const char *buf, size_t len);
+
 /*
 ** Building a Parser
 */
@@ -86,6 +126,9 @@ mpc_parser_t *mpc_undefine(mpc_parser_t *p);
 void mpc_delete(mpc_parser_t *p);
 void mpc_cleanup(int n, ...);
 
+void mpc_optimise(mpc_parser_t *p);
+int mpc_compile(mpc_parser_t *p);
+
 /*
 ** Basic Parsers
 */
@@ -132,6 +175,8 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_commit(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_apply_t c, mpc_dtor_t da);
 
 /*
 ** Common Parsers
@@ -266,6 +311,7 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a);
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
 
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
@@ -279,11 +325,89 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **as);
 mpc_val_t *mpcf_str_ast(mpc_val_t *c);
 mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 
+/*
+** Trees
+**
+** A flat copy of an AST in a single allocation, freed
+** with one call. Nodes are in breadth first order, so
+** the children of a node are the `children_num` nodes
+** starting at index `children`. Tags are interned as
+** integer ids per tree and each node holds the set of
+** ids named in its `|` separated tag.
+*/
+
+typedef struct mpc_node_t {
+  char *contents;
+  int length;
+  mpc_state_t state;
+  int tags;
+  int tags_num;
+  int children;
+  int children_num;
+} mpc_node_t;
+
+typedef struct mpc_tree_t {
+  int nodes_num;
+  mpc_node_t *nodes;
+  int *tagsets;
+  int names_num;
+  char **names;
+} mpc_tree_t;
+
+mpc_tree_t *mpc_tree_new(mpc_ast_t *a);
+void mpc_tree_delete(mpc_tree_t *t);
+void mpc_tree_print(mpc_tree_t *t);
+
+int mpc_tree_tag(mpc_tree_t *t, const char *name);
+int mpc_tree_has(mpc_tree_t *t, int node, int tag);
+
+/*
+** A tree can also be built straight from a parse, without
+** an AST in between, by using these folds in place of the
+** AST ones. Their values are nodes held by the builder,
+** and only live as long as it does. Parsers written out
+** by `mpca_lang_codegen` do this in their `_tree` variants.
+*/
+
+typedef struct mpc_tree_builder_t mpc_tree_builder_t;
+
+mpc_tree_builder_t *mpc_tree_builder_new(void);
+void mpc_tree_builder_delete(mpc_tree_builder_t *b);
+mpc_tree_t *mpc_tree_build(mpc_tree_builder_t *b, mpc_val_t *x);
+
+mpc_val_t *mpcf_tree_fold(mpc_tree_builder_t *b, int n, mpc_val_t **xs);
+mpc_val_t *mpcf_tree_str(mpc_tree_builder_t *b, mpc_val_t *c);
+mpc_val_t *mpcf_tree_state(mpc_tree_builder_t *b, int n, mpc_val_t **xs);
+mpc_val_t *mpcf_tree_root(mpc_tree_builder_t *b, mpc_val_t *x);
+mpc_val_t *mpcf_tree_tag(mpc_tree_builder_t *b, mpc_val_t *x, const char *t);
+mpc_val_t *mpcf_tree_add_tag(mpc_tree_builder_t *b, mpc_val_t *x, const char *t);
+
+/*
+** Events
+**
+** Parses with a compiled `mpca` grammar without
+** building an AST. `enter` and `leave` are called
+** around every rule it refers to and `token` for every
+** string, char and regex, in the order of the input.
+** Only matches the parse has committed to are ever
+** reported. Any of the callbacks may be NULL.
+*/
+
+typedef struct mpc_events_t {
+  void (*enter)(void *d, const char *rule, mpc_state_t s);
+  void (*leave)(void *d, const char *rule);
+  void (*token)(void *d, const char *tag, const char *contents, mpc_state_t s);
+} mpc_events_t;
+
+int mpc_parse_events(const char *filename, const char *string, size_t length, mpc_parser_t *p,
+  const mpc_events_t *e, void *d, mpc_result_t *r);
+
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -298,7 +422,10 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOIZE              = 4,
+  MPCA_LANG_OPTIMISE             = 8,
+  MPCA_LANG_COMPILE              = 16
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -308,12 +435,78 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Code Generation
+*/
+
+mpc_err_t *mpca_lang_codegen(int flags, const char *filename, const char *prefix, FILE *source, FILE *header);
+
+/*
+** Saving and Loading
+**
+** `mpc_save` writes the parsers given, and every parser they
+** use, to a file. `mpc_load` defines the same parsers again
+** from it, given in the same order and under the same names,
+** without going through the grammar or building any regex.
+** Both take a NULL terminated list of parsers, and return an
+** error if the file cannot be used, such as one written by
+** another version of mpc or damaged since. As with code
+** generation only the library's own functions can be saved.
+** A file is trusted to give each rule functions that suit
+** the values it builds, so only load files you wrote.
+*/
+
+mpc_err_t *mpc_save(const char *filename, ...);
+mpc_err_t *mpc_load(const char *filename, ...);
+
+/*
+** Generated parsers build their errors with these
+*/
+
+mpc_err_t *mpc_err_new(const char *filename, mpc_state_t s, const char *expected, char recieved);
+mpc_err_t *mpc_err_fail(const char *filename, mpc_state_t s, const char *failure);
+mpc_err_t *mpc_err_or(mpc_err_t **x, int n);
+mpc_err_t *mpc_err_many1(mpc_err_t *x);
+mpc_err_t *mpc_err_count(mpc_err_t *x, int n);
+
 /*
 ** Debug & Testing
 */
 
 void mpc_print(mpc_parser_t *p);
 
+/*
+** With `MPC_PROFILE` defined when building mpc, parses made
+** through a context given a report with `mpc_ctx_profile`
+** count for every named parser the times it was run,
+** succeeded and failed, the backtracks made while it ran,
+** the bytes it consumed and the cycles it took. The last
+** three include the parsers it ran in turn, counted once
+** across recursive runs of the same parser. A failed parse
+** is run twice, once to find the failure and once to build
+** the error, and both runs are counted. Counts are kept in
+** the context and added to the report after each parse, so
+** the parsers are left untouched and may be shared. A
+** report belongs to the caller and must not be given to
+** contexts on several threads at once; give each thread
+** its own and combine them with `mpc_profile_merge`.
+** Profiled parses never run on the machine of `mpc_compile`.
+** The report lists parsers costliest first, and must be
+** printed while they are still alive.
+*/
+
+#ifdef MPC_PROFILE
+typedef struct mpc_profile_t mpc_profile_t;
+
+mpc_profile_t *mpc_profile_new(void);
+void mpc_profile_delete(mpc_profile_t *r);
+void mpc_profile_clear(mpc_profile_t *r);
+void mpc_profile_merge(mpc_profile_t *r, mpc_profile_t *from);
+void mpc_profile_print(mpc_profile_t *r);
+void mpc_profile_print_to(mpc_profile_t *r, FILE *f);
+void mpc_ctx_profile(mpc_ctx_t *c, mpc_profile_t *r);
+#endif
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
   int(*tester)(void*, void*), 
   mpc_dtor_t destructor, 
@@ -0,0 +1,82 @@
+/*
+** mpcgen - writes out an mpca_lang grammar as a C parser
+**
+**     mpcgen [-p] [-w] grammar prefix
+**
+** Writes `prefix`.c and `prefix`.h with a function
+** `prefix`_`rule` for every rule of the grammar.
+** The functions take the same arguments as
+** `mpc_parse_n` less the parser, and give the same
+** results, and `prefix`_`rule`_tree gives a flat
+** `mpc_tree_t` built without an AST. `-p` and `-w` stand for the
+** MPCA_LANG_PREDICTIVE and
+** MPCA_LANG_WHITESPACE_SENSITIVE flags.
+*/
+
+#include "mpc.h"
+
+static char *mpcgen_filename(const char *prefix, const char *ext) {
+    char *filename = malloc(strlen(prefix) + strlen(ext) + 1);
+    strcpy(filename, prefix);
+    strcat(filename, ext);
+    return filename;
+}
+
+static FILE *mpcgen_open(const char *filename) {
+    FILE *f = fopen(filename, "w");
+    if (f == NULL) {
+        fprintf(stderr, "mpcgen: cannot open '%s': %s\n", filename, strerror(errno));
+    }
+    return f;
+}
+
+int main(int argc, char **argv) {
+
+    int flags = MPCA_LANG_DEFAULT;
+    int i = 1;
+    char *source_name, *header_name;
+    FILE *source, *header;
+    mpc_err_t *err;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-p") == 0) { flags |= MPCA_LANG_PREDICTIVE; continue; }
+        if (strcmp(argv[i], "-w") == 0) { flags |= MPCA_LANG_WHITESPACE_SENSITIVE; continue; }
+        break;
+    }
+
+    if (argc - i != 2) {
+        fprintf(stderr, "usage: mpcgen [-p] [-w] grammar prefix\n");
+        return 1;
+    }
+
+    source_name = mpcgen_filename(argv[i+1], ".c");
+    header_name = mpcgen_filename(argv[i+1], ".h");
+
+    source = mpcgen_open(source_name);
+    header = source ? mpcgen_open(header_name) : NULL;
+
+    if (source == NULL || header == NULL) {
+        err = NULL;
+    } else {
+        err = mpca_lang_codegen(flags, argv[i], argv[i+1], source, header);
+    }
+
+    if (source) { fclose(source); }
+    if (header) { fclose(header); }
+
+    /* Never leave half written files behind for make to pick up */
+    if (err || header == NULL) {
+        remove(source_name);
+        remove(header_name);
+    }
+
+    if (err) {
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+    }
+
+    free(source_name);
+    free(header_name);
+
+    return err || header == NULL;
+}
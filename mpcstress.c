@@ -0,0 +1,223 @@
+/*
+** mpcstress - parses with one set of parsers on many threads
+**
+**     mpcstress [rounds]
+**
+** Builds the same grammars with the interpreter, with
+** memoizing, optimised and compiled, and for each has
+** several threads parse a set of inputs over and over
+** with the same parsers, half of them through a parse
+** context of their own. Every result must match the
+** one got before the threads were started. Built with
+** `-fsanitize=thread` by `make stress` to also check
+** that parsing never writes to the shared parsers.
+*/
+
+#include <pthread.h>
+
+#include "mpc.h"
+
+enum {
+    MPCSTRESS_THREADS = 8,
+    MPCSTRESS_ROUNDS  = 50
+};
+
+static const char *mpcstress_lisp =
+    " number : /-?[0-9]+/ ;                         "
+    " symbol : '+' | '-' | '*' | '/' ;              "
+    " sexpr  : '(' <expr>* ')' ;                    "
+    " expr   : <number> | <symbol> | <sexpr> ;      "
+    " lisp   : /^/ <expr>+ /$/ ;                    ";
+
+static const char *mpcstress_json =
+    " value  : <string> | <number> | <object> | <array> | \"true\" | \"false\" | \"null\" ; "
+    " string : /\"(\\\\.|[^\"])*\"/ ;                                               "
+    " number : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;                          "
+    " object : '{' (<pair> (',' <pair>)*)? '}' ;                                   "
+    " pair   : <string> ':' <value> ;                                              "
+    " array  : '[' (<value> (',' <value>)*)? ']' ;                                 "
+    " json   : /^/ <value> /$/ ;                                                   ";
+
+static const char *mpcstress_lisp_inputs[] = {
+    "(+ 1 2)",
+    "(* (+ 1 2) (- 4 -3))",
+    "(/ 10 (+ 1 1)) (- 5) 7",
+    "(+ 1 (* 2",
+    "(+ 1 x)",
+    "((((((1))))))",
+    "",
+    NULL
+};
+
+static const char *mpcstress_json_inputs[] = {
+    "{\"a\": [1, 2.5, -3e4], \"b\": {\"c\": null}}",
+    "[true, false, \"x\\\"y\", []]",
+    "{\"a\" 1}",
+    "[1, 2,]",
+    "\"unterminated",
+    "{}",
+    NULL
+};
+
+static const int mpcstress_flags[] = {
+    MPCA_LANG_DEFAULT,
+    MPCA_LANG_MEMOIZE,
+    MPCA_LANG_OPTIMISE,
+    MPCA_LANG_COMPILE,
+    MPCA_LANG_OPTIMISE | MPCA_LANG_COMPILE,
+    -1
+};
+
+static const char *mpcstress_names[] = {
+    "default", "memoize", "optimise", "compile", "optimise|compile"
+};
+
+typedef struct mpcstress_t {
+    mpc_parser_t *parser;
+    const char **inputs;
+    int inputs_num;
+    int *oks;
+    mpc_ast_t **asts;
+    char **errs;
+    int rounds;
+} mpcstress_t;
+
+static int mpcstress_check(mpcstress_t *s, int j, int ok, mpc_result_t *r) {
+
+    int same;
+    char *e;
+
+    if (ok) {
+        same = s->oks[j] && mpc_ast_eq(r->output, s->asts[j]);
+        mpc_ast_delete(r->output);
+    } else {
+        e = mpc_err_string(r->error);
+        same = !s->oks[j] && strcmp(e, s->errs[j]) == 0;
+        free(e);
+        mpc_err_delete(r->error);
+    }
+
+    return same;
+}
+
+static void *mpcstress_work(void *data) {
+
+    mpcstress_t *s = data;
+    mpc_ctx_t *c = mpc_ctx_new();
+    mpc_result_t r;
+    const char *in;
+    int k, j, ok, failed = 0;
+
+    for (k = 0; k < s->rounds; k++) {
+        for (j = 0; j < s->inputs_num; j++) {
+            in = s->inputs[j];
+            if ((k + j) % 2) {
+                ok = mpc_parse_ctx(c, "<stress>", in, strlen(in), s->parser, &r);
+            } else {
+                ok = mpc_parse("<stress>", in, s->parser, &r);
+            }
+            failed += !mpcstress_check(s, j, ok, &r);
+        }
+    }
+
+    mpc_ctx_delete(c);
+    return (void*)(size_t)failed;
+}
+
+static int mpcstress_run(mpc_parser_t *p, const char **inputs, int rounds) {
+
+    mpcstress_t s;
+    mpc_result_t r;
+    pthread_t threads[MPCSTRESS_THREADS];
+    void *failed;
+    int j, started = 0, total = 0;
+
+    s.parser = p;
+    s.inputs = inputs;
+    s.rounds = rounds;
+    for (s.inputs_num = 0; inputs[s.inputs_num]; s.inputs_num++);
+
+    s.oks = malloc(sizeof(int) * s.inputs_num);
+    s.asts = malloc(sizeof(mpc_ast_t*) * s.inputs_num);
+    s.errs = malloc(sizeof(char*) * s.inputs_num);
+
+    for (j = 0; j < s.inputs_num; j++) {
+        s.oks[j] = mpc_parse("<stress>", inputs[j], p, &r);
+        s.asts[j] = s.oks[j] ? r.output : NULL;
+        s.errs[j] = s.oks[j] ? NULL : mpc_err_string(r.error);
+        if (!s.oks[j]) { mpc_err_delete(r.error); }
+    }
+
+    for (j = 0; j < MPCSTRESS_THREADS; j++) {
+        if (pthread_create(&threads[j], NULL, mpcstress_work, &s) != 0) { break; }
+        started++;
+    }
+
+    for (j = 0; j < started; j++) {
+        pthread_join(threads[j], &failed);
+        total += (int)(size_t)failed;
+    }
+
+    for (j = 0; j < s.inputs_num; j++) {
+        mpc_ast_delete(s.asts[j]);
+        free(s.errs[j]);
+    }
+
+    free(s.oks);
+    free(s.asts);
+    free(s.errs);
+
+    if (started == 0) { return -1; }
+    return total;
+}
+
+int main(int argc, char **argv) {
+
+    int rounds = argc > 1 ? atoi(argv[1]) : MPCSTRESS_ROUNDS;
+    int f, lisp_failed, json_failed, failed = 0;
+    mpc_parser_t *Number, *Symbol, *Sexpr, *Expr, *Lisp;
+    mpc_parser_t *Value, *String, *Num, *Object, *Pair, *Array, *Json;
+    mpc_err_t *err;
+
+    for (f = 0; mpcstress_flags[f] >= 0; f++) {
+
+        Number = mpc_new("number");
+        Symbol = mpc_new("symbol");
+        Sexpr  = mpc_new("sexpr");
+        Expr   = mpc_new("expr");
+        Lisp   = mpc_new("lisp");
+
+        Value  = mpc_new("value");
+        String = mpc_new("string");
+        Num    = mpc_new("number");
+        Object = mpc_new("object");
+        Pair   = mpc_new("pair");
+        Array  = mpc_new("array");
+        Json   = mpc_new("json");
+
+        err = mpca_lang(mpcstress_flags[f], mpcstress_lisp,
+            Number, Symbol, Sexpr, Expr, Lisp, NULL);
+        if (!err) {
+            err = mpca_lang(mpcstress_flags[f], mpcstress_json,
+                Value, String, Num, Object, Pair, Array, Json, NULL);
+        }
+
+        if (err) {
+            mpc_err_print_to(err, stderr);
+            mpc_err_delete(err);
+            failed = 1;
+        } else {
+            lisp_failed = mpcstress_run(Lisp, mpcstress_lisp_inputs, rounds);
+            json_failed = mpcstress_run(Json, mpcstress_json_inputs, rounds);
+            printf("%-17s lisp %s, json %s\n", mpcstress_names[f],
+                lisp_failed < 0 ? "no threads" : lisp_failed ? "FAILED" : "ok",
+                json_failed < 0 ? "no threads" : json_failed ? "FAILED" : "ok");
+            failed |= lisp_failed != 0 || json_failed != 0;
+        }
+
+        mpc_cleanup(5, Number, Symbol, Sexpr, Expr, Lisp);
+        mpc_cleanup(7, Value, String, Num, Object, Pair, Array, Json);
+    }
+
+    return failed;
+}
@@ -0,0 +1,141 @@
+/*
+** mpctest - regression tests for mpc
+**
+**     mpctest
+**
+** Each test builds a small grammar and checks which
+** inputs it accepts. Prints each test that fails and
+** exits non-zero if any did. Run by `make test`.
+*/
+
+#include "mpc.h"
+
+static int mpctest_any(void *x, void *d) { (void)x; (void)d; return 1; }
+static void mpctest_print(void *x) { mpc_ast_print(x); }
+
+static int mpctest_accepts(mpc_parser_t *p, const char *s) {
+    return mpc_test_pass(p, s, NULL, mpctest_any, (mpc_dtor_t)mpc_ast_delete, mpctest_print);
+}
+
+static int mpctest_rejects(mpc_parser_t *p, const char *s) {
+    return mpc_test_fail(p, s, NULL, mpctest_any, (mpc_dtor_t)mpc_ast_delete, mpctest_print);
+}
+
+/* A failure after a commit fails the parse rather than retrying from the commit */
+static int mpctest_commit(void) {
+
+    mpc_parser_t *A = mpc_new("a");
+    mpc_parser_t *B = mpc_new("b");
+    mpc_parser_t *C = mpc_new("c");
+    mpc_err_t *err;
+    int ok = 1;
+
+    err = mpca_lang(MPCA_LANG_DEFAULT,
+        " a : /^/ (('x'~ 'y') | ('x' 'z')) /$/ ; "
+        " b : /^/ ('a'~ 'b')* /$/ ;               "
+        " c : /^/ ('a'~ 'b')? 'a' 'c' /$/ ;       ",
+        A, B, C, NULL);
+
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        mpc_cleanup(3, A, B, C);
+        return 0;
+    }
+
+    ok = ok && mpctest_accepts(A, "xy");
+    ok = ok && mpctest_rejects(A, "xxz");
+    ok = ok && mpctest_rejects(A, "xz");
+    ok = ok && mpctest_accepts(B, "");
+    ok = ok && mpctest_accepts(B, "abab");
+    ok = ok && mpctest_rejects(B, "abac");
+    ok = ok && mpctest_accepts(C, "abac");
+    ok = ok && mpctest_rejects(C, "ac");
+
+    mpc_cleanup(3, A, B, C);
+    return ok;
+}
+
+/* Records which chunk each fed result arrived after, negated for errors */
+typedef struct { int chunk; int n; int got[8]; } mpctest_arrivals_t;
+
+static void mpctest_arrive(int x, mpc_result_t *r, void *d) {
+    mpctest_arrivals_t *a = d;
+    if (x) { mpc_ast_delete(r->output); } else { mpc_err_delete(r->error); }
+    if (a->n < 8) { a->got[a->n] = x ? a->chunk : -1 - a->chunk; }
+    a->n++;
+}
+
+static int mpctest_arrivals(mpc_parser_t *p, const char **chunks, const int *expected, int n) {
+
+    mpctest_arrivals_t a;
+    mpc_ctx_t *c = mpc_ctx_new_feed("<test>", p, (mpc_dtor_t)mpc_ast_delete, mpctest_arrive, &a);
+    int j;
+
+    a.n = 0;
+    for (a.chunk = 0; chunks[a.chunk]; a.chunk++) {
+        mpc_feed(c, chunks[a.chunk], strlen(chunks[a.chunk]));
+    }
+    mpc_feed(c, NULL, 0);
+    mpc_ctx_delete(c);
+
+    if (a.n != n) { return 0; }
+    for (j = 0; j < n; j++) {
+        if (a.got[j] != expected[j]) { return 0; }
+    }
+    return 1;
+}
+
+/* Each fed result is passed on with the chunk that completes it */
+static int mpctest_feed(void) {
+
+    static const char *one[] = { "(+ 1 2 3 4 5 6 7", " 8) ", "]", NULL };
+    static const int one_at[] = { 1, -3 };
+    static const char *two[] = { "(+ 1", " 2) ", "(* 3 4) ", NULL };
+    static const int two_at[] = { 1, 2 };
+    static const char *split[] = { "(+ 1", "0", "0)", NULL };
+    static const int split_at[] = { 2 };
+
+    mpc_parser_t *E = mpc_new("expr");
+    mpc_err_t *err;
+    int ok = 1;
+
+    err = mpca_lang(MPCA_LANG_DEFAULT,
+        " expr : /-?[0-9]+/ | /[a-z+*]/ | '(' <expr>* ')' ; ",
+        E, NULL);
+
+    if (err) {
+        mpc_err_print(err);
+        mpc_err_delete(err);
+        mpc_cleanup(1, E);
+        return 0;
+    }
+
+    ok = ok && mpctest_arrivals(E, one, one_at, 2);
+    ok = ok && mpctest_arrivals(E, two, two_at, 2);
+    ok = ok && mpctest_arrivals(E, split, split_at, 1);
+
+    mpc_cleanup(1, E);
+    return ok;
+}
+
+static const struct { int (*f)(void); const char *name; } mpctest_tests[] = {
+    { mpctest_commit, "commit" },
+    { mpctest_feed, "feed" },
+    { NULL, NULL }
+};
+
+int main(void) {
+
+    int j, failed = 0;
+
+    for (j = 0; mpctest_tests[j].f; j++) {
+        if (!mpctest_tests[j].f()) {
+            printf("%s FAILED\n", mpctest_tests[j].name);
+            failed = 1;
+        }
+    }
+
+    if (!failed) { printf("all passed\n"); }
+    return failed;
+}